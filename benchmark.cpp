@@ -0,0 +1,422 @@
+#include "cpu.h"
+#include "cpu_types.h"
+#include "disassembler.h"
+#include "memory.h"
+#include "rom.h"
+#include "trace.h"
+
+#include <chrono>
+#include <filesystem>
+#include <vector>
+
+// implemented in tests.cpp
+uint64_t cpu_test_load_loop_program(uint32_t iterations);
+void cpu_test_reset();
+extern uint64_t branch_delay_slot_address;
+
+using bench_clock = std::chrono::steady_clock;
+
+template<typename Func>
+static double bench_seconds(Func&& func)
+{
+    const auto start = bench_clock::now();
+    func();
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// a mix of real encodings (fixed bits from the descriptors, random fields)
+// and the odd garbage word, roughly what a ROM's code segment looks like
+static std::vector<uint32_t> bench_make_opcodes(int count)
+{
+    std::vector<uint32_t> opcodes;
+    opcodes.reserve(count);
+
+    uint32_t state{0xC0FFEE};
+    auto next = [&state]()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    };
+
+    const InstructionType common[] = {
+        InstructionType::ADD, InstructionType::ADDIU, InstructionType::ADDU, InstructionType::LW,
+        InstructionType::SW, InstructionType::LUI, InstructionType::ORI, InstructionType::BNE,
+        InstructionType::BEQ, InstructionType::SLL, InstructionType::JAL, InstructionType::JR,
+        InstructionType::AND, InstructionType::SLTI, InstructionType::MFC0, InstructionType::BGEZ,
+    };
+
+    for (int i = 0; i < count; i++)
+    {
+        const auto r = next();
+
+        if ((r & 0xF) == 0)
+        {
+            opcodes.push_back(next());
+            continue;
+        }
+
+        const auto* desc = disassembler_find_descriptor(common[r % std::size(common)]);
+        opcodes.push_back(desc->value | (next() & ~desc->mask));
+    }
+
+    return opcodes;
+}
+
+static void bench_decoder()
+{
+    const auto opcodes = bench_make_opcodes(1 << 20);
+    const int passes = 32;
+    const double decodes = double(opcodes.size()) * passes;
+
+    uintptr_t sink{};
+
+    auto linear = bench_seconds([&]()
+    {
+        for (int p = 0; p < passes; p++)
+            for (auto op : opcodes)
+                sink += (uintptr_t)disassembler_decode_instruction_linear(op);
+    });
+
+    auto table = bench_seconds([&]()
+    {
+        for (int p = 0; p < passes; p++)
+            for (auto op : opcodes)
+                sink += (uintptr_t)disassembler_decode_instruction(op);
+    });
+
+    printf("decoder: linear %.1f M decodes/s, table %.1f M decodes/s (%.1fx) [%zx]\n",
+        decodes / linear / 1e6, decodes / table / 1e6, linear / table, sink & 0xF);
+}
+
+static void bench_execution_modes()
+{
+    struct Mode
+    {
+        const char* name;
+        ExecutionMode mode;
+    };
+
+    static const Mode modes[] = {
+        { "interpreter", ExecutionMode::Interpreter },
+        { "cached interpreter", ExecutionMode::CachedInterpreter },
+        { "chained blocks", ExecutionMode::ChainedBlocks },
+        { "recompiler", ExecutionMode::Recompiler },
+    };
+
+    for (const auto& mode : modes)
+    {
+        cpu_test_reset();
+        branch_delay_slot_address = 0;
+        cpu.pc = cpu_test_load_loop_program(2000000);
+        cpu_set_execution_mode(mode.mode);
+
+        const auto start = cpu_get_cycle_count();
+        const auto stats = cpu_get_dispatch_stats();
+        const auto seconds = bench_seconds([]() { cpu_run(UINT64_MAX); });
+        const auto executed = cpu_get_cycle_count() - start;
+
+        printf("%s: %.2f MIPS\n", mode.name, executed / seconds / 1e6);
+
+        if (mode.mode == ExecutionMode::ChainedBlocks)
+        {
+            const auto& after = cpu_get_dispatch_stats();
+
+            printf("    %.2f M dispatcher exits/s, %.2f M links followed/s\n",
+                (after.dispatcher_exits - stats.dispatcher_exits) / seconds / 1e6,
+                (after.links_followed - stats.links_followed) / seconds / 1e6);
+        }
+    }
+
+    cpu_set_execution_mode(ExecutionMode::Interpreter);
+}
+
+// cost of the dirty page bookkeeping relative to the whole RDRAM store path
+static void bench_rdram_dirty_tracking()
+{
+    const int stores = 1 << 24;
+    const uint32_t span = MB(4);
+
+    auto store = bench_seconds([&]()
+    {
+        for (int i = 0; i < stores; i++)
+            memory_write32(0x80000000 | ((i * 4u) & (span - 1)), i);
+    });
+
+    auto tracking = bench_seconds([&]()
+    {
+        for (int i = 0; i < stores; i++)
+            memory_rdram_written((i * 4u) & (span - 1), 4);
+    });
+
+    auto dma = bench_seconds([&]()
+    {
+        for (int i = 0; i < stores / 1024; i++)
+            memory_rdram_written((i * 4096u) & (span - 1), 4096);
+    });
+
+    printf("rdram dirty tracking: %.2f ns/store of %.2f ns/store (%.1f%%), %.2f ns per 4 KB dma\n",
+        tracking / stores * 1e9, store / stores * 1e9, tracking / store * 100.0, dma / (stores / 1024) * 1e9);
+}
+
+// loads from a page table backed region against ones that still go through
+// the registered callbacks (an MMIO register), then the same through fastmem
+static void bench_memory_bus()
+{
+    const int loads = 1 << 24;
+    const uint32_t span = MB(4);
+    uint32_t sink{};
+
+    auto rdram = [&]()
+    {
+        for (int i = 0; i < loads; i++)
+        {
+            uint32_t value{};
+            memory_read32(0x80000000 | ((i * 4u) & (span - 1)), value);
+            sink += value;
+        }
+    };
+
+    auto mmio = [&]()
+    {
+        for (int i = 0; i < loads / 16; i++)
+        {
+            uint32_t value{};
+            memory_read32(0xA4300004, value);
+            sink += value;
+        }
+    };
+
+    // the same rdram through a single 4 MB KSEG3 TLB page
+    auto mapped = [&]()
+    {
+        for (int i = 0; i < loads; i++)
+        {
+            uint32_t value{};
+            memory_read32(0xE0000000 | ((i * 4u) & (span - 1)), value);
+            sink += value;
+        }
+    };
+
+    const auto paged = bench_seconds(rdram);
+    const auto paged_mmio = bench_seconds(mmio) * 16;
+
+    memory_tlb_write(0, { 0x007FE000, 0xE0000000, TLB_ENTRY_VALID | TLB_ENTRY_GLOBAL, TLB_ENTRY_GLOBAL });
+
+    const auto stats = memory_get_tlb_stats();
+    const auto tlb = bench_seconds(mapped);
+    const auto hits = memory_get_tlb_stats().hits - stats.hits;
+    const auto misses = memory_get_tlb_stats().misses - stats.misses;
+
+    memory_tlb_reset();
+
+    printf("memory bus: rdram %.2f ns/load, mmio %.2f ns/load, tlb mapped %.2f ns/load (%llu hits, %llu misses) [%x]\n",
+        paged / loads * 1e9, paged_mmio / loads * 1e9, tlb / loads * 1e9,
+        (unsigned long long)hits, (unsigned long long)misses, sink & 0xF);
+
+    if (!memory_enable_fastmem(true))
+        return;
+
+    const auto fast = bench_seconds(rdram);
+    const auto fast_mmio = bench_seconds(mmio) * 16;
+
+    memory_enable_fastmem(false);
+
+    printf("fastmem: rdram %.2f ns/load, mmio %.2f ns/load [%x]\n",
+        fast / loads * 1e9, fast_mmio / loads * 1e9, sink & 0xF);
+}
+
+// 1 MB cartridge -> rdram PI style DMA, span copies against the byte at a
+// time bus loop memory_do_dma() used to be
+static void bench_dma()
+{
+    const uint32_t size = MB(1);
+    const int passes = 64;
+
+    auto bytewise = [&]()
+    {
+        for (uint32_t i = 0; i < size; i++)
+        {
+            uint8_t b{};
+            memory_read8(0xB0000000 + i, b);
+            memory_write8(0xA0100000 + i, b);
+        }
+    };
+
+    auto spans = [&]()
+    {
+        for (int p = 0; p < passes; p++)
+            memory_do_dma(0x00100000, 0xB0000000, size);
+    };
+
+    const auto old_seconds = bench_seconds(bytewise);
+    const auto new_seconds = bench_seconds(spans) / passes;
+
+    printf("dma: byte loop %.3f GB/s, spans %.2f GB/s (%.0fx)\n",
+        size / old_seconds / 1e9, size / new_seconds / 1e9, old_seconds / new_seconds);
+}
+
+// byte order conversion of a full size 64 MB v64 image (a shuffle in either
+// memory layout), and loading one
+static void bench_rom_loading()
+{
+    const size_t size = MB(64);
+    std::vector<uint8_t> image(size);
+
+    for (size_t i = 0; i < size; i++)
+        image[i] = uint8_t(i * 31);
+
+    const uint8_t magic[] = { 0x37, 0x80, 0x40, 0x12 };
+    memcpy(image.data(), magic, sizeof(magic));
+
+    const auto scalar = bench_seconds([&]() { rom_convert_scalar(image.data(), size, RomFormat::V64); });
+    const auto simd = bench_seconds([&]() { rom_convert(image.data(), size, RomFormat::V64); });
+
+    printf("rom conversion: scalar %.2f GB/s, simd %.2f GB/s\n", size / scalar / 1e9, size / simd / 1e9);
+
+    // Time to first instruction: loading the image and the boot code's DMA of
+    // the game's first megabyte, read in full against mapped. Converting twice
+    // swapped it back to v64, the z64 file is the one that maps as it is
+    // (n64 with native words).
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string paths[] = { (dir / "ultra_bench.v64").string(), (dir / "ultra_bench.z64").string() };
+
+    for (const auto& path : paths)
+    {
+        if (auto* file = fopen(path.c_str(), "wb"))
+        {
+            fwrite(image.data(), 1, size, file);
+            fclose(file);
+        }
+
+        rom_convert(image.data(), size, RomFormat::V64);
+    }
+
+    double seconds[2][2]{};
+
+    for (int f = 0; f < 2; f++)
+    {
+        for (int mapped = 0; mapped < 2; mapped++)
+        {
+            memory_enable_rom_mapping(mapped);
+
+            seconds[f][mapped] = bench_seconds([&]() {
+                memory_load_rom(paths[f].c_str());
+                memory_do_dma(0xA0000400, 0xB0001000, MB(1));
+            });
+        }
+
+        std::filesystem::remove(paths[f]);
+    }
+
+    memory_enable_rom_mapping(true);
+    memory_unload_rom();
+
+    printf("64 MB rom to first instruction: v64 read %.1f ms, mapped %.2f ms; z64 read %.1f ms, mapped %.2f ms\n",
+        seconds[0][0] * 1e3, seconds[0][1] * 1e3, seconds[1][0] * 1e3, seconds[1][1] * 1e3);
+}
+
+// A byteswapped image mapped by successive instances: private conversions,
+// the first instance converting into the shared file and one after it. Each
+// maps, reads the boot megabyte, then touches the rest of the image.
+static void bench_rom_sharing()
+{
+    if (!rom_lazy_is_supported())
+        return;
+
+    const size_t size = MB(64);
+    std::vector<uint8_t> image(size);
+
+    for (size_t i = 0; i < size; i++)
+        image[i] = uint8_t(i * 31);
+
+    const uint8_t magic[] = { 0x37, 0x80, 0x40, 0x12 };
+    memcpy(image.data(), magic, sizeof(magic));
+
+    const auto dir = std::filesystem::temp_directory_path() / "ultra_bench_roms";
+    const auto path = (std::filesystem::temp_directory_path() / "ultra_bench.v64").string();
+
+    std::filesystem::create_directories(dir);
+
+    if (auto* file = fopen(path.c_str(), "wb"))
+    {
+        fwrite(image.data(), 1, size, file);
+        fclose(file);
+    }
+
+    const char* names[] = { "private", "first shared", "later shared" };
+    const char* dirs[] = { nullptr, dir.c_str(), dir.c_str() };
+
+    for (int i = 0; i < 3; i++)
+    {
+        rom_set_shared_dir(dirs[i]);
+
+        RomImage rom{};
+        uint32_t sink{};
+
+        const auto first = bench_seconds([&]() {
+            rom_map(path.c_str(), size, rom);
+            memcpy(image.data(), rom.data, MB(1));
+        });
+
+        const auto rest = bench_seconds([&]() {
+            for (size_t offset = MB(1); offset < size; offset += KB(4))
+                sink += rom.data[offset];
+        });
+
+        printf("rom sharing, %s: first instruction %.2f ms, whole image %.1f ms, %zu pages converted [%x]\n",
+            names[i], first * 1e3, (first + rest) * 1e3, rom_converted_pages(rom), sink & 0xF);
+
+        rom_unmap(rom);
+    }
+
+    rom_set_shared_dir(nullptr);
+    std::filesystem::remove_all(dir);
+    std::filesystem::remove(path);
+}
+
+// binary trace recording against the plain interpreter it runs on top of
+static void bench_trace_recording()
+{
+    const auto path = (std::filesystem::temp_directory_path() / "ultra_bench.trace").string();
+    double mips[2]{};
+    uint64_t executed{};
+
+    for (int i = 0; i < 2; i++)
+    {
+        cpu_test_reset();
+        branch_delay_slot_address = 0;
+        cpu.pc = cpu_test_load_loop_program(2000000);
+        cpu_set_execution_mode(ExecutionMode::Interpreter);
+
+        if (i == 1 && !cpu_start_recording(path.c_str()))
+            return;
+
+        const auto start = cpu_get_cycle_count();
+        const auto seconds = bench_seconds([]() { cpu_run(UINT64_MAX); cpu_stop_recording(); });
+
+        executed = cpu_get_cycle_count() - start;
+        mips[i] = executed / seconds / 1e6;
+    }
+
+    const auto bytes = std::filesystem::file_size(path);
+    std::filesystem::remove(path);
+
+    printf("trace recording: %.2f MIPS (%.2fx slowdown), %.2f bytes/instruction, %.1f MB/s\n",
+        mips[1], mips[0] / mips[1], double(bytes) / executed, mips[1] * double(bytes) / executed);
+}
+
+void cpu_run_benchmarks()
+{
+    memory_enable_logging(false);
+
+    bench_decoder();
+    bench_rdram_dirty_tracking();
+    bench_memory_bus();
+    bench_dma();
+    bench_rom_loading();
+    bench_rom_sharing();
+    bench_execution_modes();
+    bench_trace_recording();
+}
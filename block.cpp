@@ -0,0 +1,208 @@
+#include "block.h"
+
+#include "memory.h"
+#include "disassembler.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+// Two level table from the (32 bit) guest pc to the block starting there:
+// the top 16 bits pick a lazily allocated table of one slot per instruction.
+#define BLOCK_L1_SHIFT          16
+#define BLOCK_L2_ENTRIES        (1 << (BLOCK_L1_SHIFT - 2))
+
+struct BlockTable
+{
+    BasicBlock* slots[BLOCK_L2_ENTRIES];
+};
+
+static BlockTable* block_tables[1 << (32 - BLOCK_L1_SHIFT)]{};
+
+// blocks decoded from each physical page, for invalidation
+static std::unordered_map<uint32_t, std::vector<BasicBlock*>> page_blocks;
+
+static uint64_t compile_count{};
+
+static BasicBlock*& block_slot(uint64_t pc)
+{
+    const auto address = uint32_t(pc);
+    auto*& table = block_tables[address >> BLOCK_L1_SHIFT];
+
+    if (!table)
+        table = new BlockTable{};
+
+    return table->slots[(address & ((1 << BLOCK_L1_SHIFT) - 1)) >> 2];
+}
+
+static void block_unlink(BasicBlock* block)
+{
+    for (auto* slot : block->incoming)
+        *slot = nullptr;
+
+    block->incoming.clear();
+
+    for (auto*& link : block->links)
+    {
+        if (!link)
+            continue;
+
+        auto& incoming = link->incoming;
+        incoming.erase(std::remove(incoming.begin(), incoming.end(), &link), incoming.end());
+        link = nullptr;
+    }
+}
+
+static void block_track_page(uint32_t page, BasicBlock* block)
+{
+    auto& blocks = page_blocks[page];
+
+    if (std::find(blocks.begin(), blocks.end(), block) == blocks.end())
+        blocks.push_back(block);
+}
+
+// icache listener, guest code in this page was overwritten
+static void block_invalidate_page(uint32_t page)
+{
+    auto it = page_blocks.find(page);
+
+    if (it == page_blocks.end())
+        return;
+
+    for (auto* block : it->second)
+    {
+        block->valid = false;
+        block_unlink(block);
+    }
+
+    page_blocks.erase(it);
+}
+
+// TLB listener, KSSEG and KSEG3 may now map to different code. Blocks are
+// keyed by virtual pc so everything decoded from there is dropped.
+static void block_invalidate_mapped()
+{
+    for (uint32_t i = 0xC0000000 >> BLOCK_L1_SHIFT; i < std::size(block_tables); i++)
+    {
+        if (!block_tables[i])
+            continue;
+
+        for (auto* block : block_tables[i]->slots)
+        {
+            if (!block || !block->valid)
+                continue;
+
+            block->valid = false;
+            block_unlink(block);
+        }
+    }
+}
+
+static bool block_compile(BasicBlock& block, uint64_t pc)
+{
+    uint32_t physical_address{};
+
+    block_unlink(&block);
+    block.valid = false;
+
+    if (!memory_translate(pc, physical_address))
+        return false;
+
+    block.start_pc = pc;
+    block.instructions.clear();
+    block.branch_index = -1;
+    block.indirect = false;
+    block.first_page = physical_address & ~(ICACHE_PAGE_SIZE - 1);
+    block.last_page = block.first_page;
+
+    while (block.instructions.size() < BLOCK_MAX_INSTRUCTIONS)
+    {
+        const auto* cached = icache_lookup(physical_address);
+
+        if (!cached || !cached->func)
+            break;
+
+        block.instructions.push_back(*cached);
+        block.last_page = physical_address & ~(ICACHE_PAGE_SIZE - 1);
+
+        // the branch's delay slot is part of the block
+        if (block.branch_index >= 0)
+            break;
+
+        const auto* desc = disassembler_decode_instruction(cached->ctx.opbits);
+
+        if (disassembler_is_branch(desc->type))
+        {
+            block.branch_index = block.instructions.size() - 1;
+            block.indirect = desc->type == InstructionType::JR || desc->type == InstructionType::JALR;
+        }
+
+        physical_address += 4;
+
+        // only a delay slot is allowed to spill into the next page
+        if ((physical_address & (ICACHE_PAGE_SIZE - 1)) == 0 && block.branch_index < 0)
+            break;
+    }
+
+    if (block.instructions.empty())
+        return false;
+
+    block_track_page(block.first_page, &block);
+    block_track_page(block.last_page, &block);
+
+    block.id = ++compile_count;
+    block.valid = true;
+
+    return true;
+}
+
+void block_init()
+{
+    for (auto*& table : block_tables)
+    {
+        if (!table)
+            continue;
+
+        for (auto* block : table->slots)
+            delete block;
+
+        delete table;
+        table = nullptr;
+    }
+
+    page_blocks.clear();
+    icache_set_invalidation_listener(block_invalidate_page);
+    memory_set_tlb_listener(block_invalidate_mapped);
+}
+
+BasicBlock* block_lookup(uint64_t pc)
+{
+    auto*& block = block_slot(pc);
+
+    if (block && block->valid && block->start_pc == pc)
+        return block;
+
+    if (!block)
+        block = new BasicBlock{};
+
+    return block_compile(*block, pc) ? block : nullptr;
+}
+
+void block_link(BasicBlock* from, BlockLink link, BasicBlock* to)
+{
+    if (from->links[link] == to)
+        return;
+
+    if (auto* previous = from->links[link])
+    {
+        auto& incoming = previous->incoming;
+        incoming.erase(std::remove(incoming.begin(), incoming.end(), &from->links[link]), incoming.end());
+    }
+
+    from->links[link] = to;
+    to->incoming.push_back(&from->links[link]);
+}
+
+uint64_t block_get_compile_count()
+{
+    return compile_count;
+}
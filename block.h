@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "icache.h"
+
+#define BLOCK_MAX_INSTRUCTIONS      128
+
+enum BlockLink
+{
+    // branch/jump taken
+    BLOCK_LINK_TAKEN,
+
+    // branch not taken, or the block ran into the next one
+    BLOCK_LINK_FALLTHROUGH,
+
+    NUM_BLOCK_LINKS
+};
+
+// A run of straight line guest code decoded once and executed as a unit. It
+// ends at a branch/jump plus its delay slot, the end of a page or the first
+// opcode we can't decode.
+struct BasicBlock
+{
+    // unique per compilation, changes whenever the block is rebuilt
+    uint64_t id;
+
+    // cleared when the guest code under the block is overwritten
+    bool valid;
+
+    uint64_t start_pc;
+    std::vector<CachedInstruction> instructions;
+
+    // index of the terminating branch or jump, -1 if the block doesn't end in one
+    int branch_index;
+
+    // JR/JALR, the taken successor isn't known until it runs
+    bool indirect;
+
+    // physical pages the block was decoded from, the delay slot may spill into a second one
+    uint32_t first_page;
+    uint32_t last_page;
+
+    // direct successors, followed without going back through block_lookup()
+    BasicBlock* links[NUM_BLOCK_LINKS];
+
+    // link slots in other blocks pointing at this one, cleared when it's invalidated
+    std::vector<BasicBlock**> incoming;
+};
+
+void block_init();
+
+// block starting at pc, decoding it on a miss or when its code was overwritten.
+// nullptr if pc isn't in cacheable memory or starts with an unknown opcode.
+BasicBlock* block_lookup(uint64_t pc);
+
+// chain `from` straight to `to` for the given exit
+void block_link(BasicBlock* from, BlockLink link, BasicBlock* to);
+
+uint64_t block_get_compile_count();
@@ -7,17 +7,27 @@
 #include "cpu_types.h"
 #include "cartridge.h"
 #include "disassembler.h"
-
+#include "icache.h"
+#include "block.h"
+#include "jit.h"
+#include "trace.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <bitset>
 #include <cstring>
+#include <unordered_map>
+#include <vector>
 
 // Implemented in parser.cpp
 const char* parser_get_symbolic_gpr_name(int i);
 const char* parser_get_symbolic_cop0_name(int i);
 
-struct RSP
+// page aligned so fastmem can map it
+struct alignas(MEMORY_PAGE_SIZE) RSP
 {
-    uint8_t dmem[0xFFF]{};
-    uint8_t imem[0xFFF]{};
+    uint8_t dmem[0x1000]{};
+    uint8_t imem[0x1000]{};
 } rsp{};
 
 CPU cpu{};
@@ -25,10 +35,10 @@ CPU cpu{};
 uint64_t branch_delay_slot_address{};
 uint64_t cycle_counter{};
 
-uint8_t rdram[MB(8)];
+alignas(MEMORY_PAGE_SIZE) uint8_t rdram[RDRAM_SIZE];
 //static uint8_t rdram[0x03EFFFFF];
-static uint8_t pif_ram[0x3F];
-uint8_t cartridge_rom[MB(64)];
+static uint8_t pif_ram[0x40];
+alignas(MEMORY_PAGE_SIZE) uint8_t cartridge_rom[MB(64)];
 
 static MemoryMappedRegister<uint32_t> RI_MODE_REG             = { [](uint32_t& value, bool write){}};
 static MemoryMappedRegister<uint32_t> RI_CONFIG_REG         = { [](uint32_t& value, bool write){}};
@@ -67,59 +77,150 @@ static MemoryMappedRegister<uint32_t> MI_VERSION_REG = {
     }
 };
 
+/*******************************************************/
+// MI interrupts, the RCP's devices share one line into the cpu (cause IP2)
+#define MI_INTR_SP                  0x01
+#define MI_INTR_SI                  0x02
+#define MI_INTR_AI                  0x04
+#define MI_INTR_VI                  0x08
+#define MI_INTR_PI                  0x10
+#define MI_INTR_DP                  0x20
+
+#define CAUSE_IP2                   (1 << 10)
+#define CAUSE_IP7                   (1 << 15)
+
+static uint32_t mi_intr{};
+static uint32_t mi_intr_mask{};
+
+static void mi_update_interrupt()
+{
+    if (mi_intr & mi_intr_mask)
+        cpu.cop0.cause() |= CAUSE_IP2;
+    else
+        cpu.cop0.cause() &= ~uint64_t(CAUSE_IP2);
+}
+
+static void mi_raise(uint32_t bits)
+{
+    mi_intr |= bits;
+    mi_update_interrupt();
+}
+
+static void mi_clear(uint32_t bits)
+{
+    mi_intr &= ~bits;
+    mi_update_interrupt();
+}
+
 static MemoryMappedRegister<uint32_t> MI_INTR_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        // read only, devices acknowledge their own interrupts
+        value = mi_intr;
     }
 };
 
 static MemoryMappedRegister<uint32_t> MI_INTR_MASK_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
-    }
-};
+        if (write)
+        {
+            // a clear/set bit pair per interrupt
+            for (int i = 0; i < 6; i++)
+            {
+                if (value & (1 << (i * 2)))
+                    mi_intr_mask &= ~(1u << i);
 
-static MemoryMappedRegister<uint32_t> SP_MEM_ADDR_REG = {
-    [](uint32_t& value, bool write)
-    {
-        throw nullptr;
+                if (value & (1 << (i * 2 + 1)))
+                    mi_intr_mask |= 1u << i;
+            }
+
+            mi_update_interrupt();
+        }
+
+        value = mi_intr_mask;
     }
 };
 
-static MemoryMappedRegister<uint32_t> SP_DRAM_ADDR_REG = {
-    [](uint32_t& value, bool write)
+/*******************************************************/
+// SP DMA, RDRAM <-> DMEM/IMEM
+#define SP_STATUS_HALT              0x01
+#define SP_STATUS_BROKE             0x02
+#define SP_STATUS_DMA_BUSY          0x04
+
+#define SP_DMA_CYCLES_PER_BYTE      1
+
+static uint32_t sp_status{SP_STATUS_HALT};
+
+static MemoryMappedRegister<uint32_t> SP_MEM_ADDR_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> SP_DRAM_ADDR_REG = { [](uint32_t& value, bool write){} };
+
+// length is (bytes - 1) | (rows - 1) << 12 | skip << 20, rows are 8 byte aligned
+static void sp_do_dma(uint32_t length_reg, bool to_rdram)
+{
+    const uint32_t length = ((length_reg & 0xFFF) | 7) + 1;
+    const uint32_t rows = ((length_reg >> 12) & 0xFF) + 1;
+    const uint32_t skip = length_reg >> 20;
+
+    uint32_t mem = 0x04000000 | (SP_MEM_ADDR_REG.value & 0x1FF8);
+    uint32_t dram = SP_DRAM_ADDR_REG.value & 0x00FFFFF8;
+
+    const bool logging = memory_logging_enabled();
+    memory_enable_logging(false);
+
+    for (uint32_t row = 0; row < rows; row++)
     {
-        throw nullptr;
+        if (to_rdram)
+            memory_do_dma(dram, mem, length);
+        else
+            memory_do_dma(mem, dram, length);
+
+        mem += length;
+        dram += length + skip;
     }
-};
+
+    memory_enable_logging(logging);
+
+    sp_status |= SP_STATUS_DMA_BUSY;
+    scheduler_schedule(SchedulerEvent::SpDma, cycle_counter + length * rows * SP_DMA_CYCLES_PER_BYTE);
+}
 
 static MemoryMappedRegister<uint32_t> SP_RD_LEN_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        if (write)
+            sp_do_dma(value, false);
     }
 };
 
 static MemoryMappedRegister<uint32_t> SP_WR_LEN_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        if (write)
+            sp_do_dma(value, true);
     }
 };
 
 static MemoryMappedRegister<uint32_t> SP_STATUS_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        if (write)
+        {
+            if (value & 0x01) sp_status &= ~SP_STATUS_HALT;
+            if (value & 0x02) sp_status |= SP_STATUS_HALT;
+            if (value & 0x04) sp_status &= ~SP_STATUS_BROKE;
+            if (value & 0x08) mi_clear(MI_INTR_SP);
+            if (value & 0x10) mi_raise(MI_INTR_SP);
+        }
+
+        value = sp_status;
     }
 };
 
 static MemoryMappedRegister<uint32_t> SP_DMA_FULL_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        memory_bus_error("register not implemented");
     }
 };
 
@@ -127,28 +228,28 @@ static MemoryMappedRegister<uint32_t> SP_DMA_FULL_REG = {
 static MemoryMappedRegister<uint32_t> SP_DMA_BUSY_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        value = (sp_status & SP_STATUS_DMA_BUSY) ? 1 : 0;
     }
 };
 
 static MemoryMappedRegister<uint32_t> SP_SEMAPHORE_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        memory_bus_error("register not implemented");
     }
 };
 
 static MemoryMappedRegister<uint32_t> SP_PC_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        memory_bus_error("register not implemented");
     }
 };
 
 static MemoryMappedRegister<uint32_t> SP_IBIST_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        memory_bus_error("register not implemented");
     }
 };
 
@@ -175,17 +276,32 @@ static MemoryMappedRegister<uint32_t> PI_CART_ADDR_REG = {
 static MemoryMappedRegister<uint32_t> PI_RD_LEN_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        memory_bus_error("register not implemented");
     }
 };
 
-// DMA WRITE LENGTH, also fires the operation
+#define PI_STATUS_DMA_BUSY          0x01
+#define PI_STATUS_INTERRUPT         0x08
+
+// roughly 19 MB/s from the cartridge
+#define PI_DMA_CYCLES_PER_BYTE      5
+
+static bool pi_dma_busy{};
+
+// DMA WRITE LENGTH, also fires the operation. The copy runs on the DMA
+// worker while the cpu carries on (the cpu only waits for it if it touches
+// the destination early), busy and the interrupt follow the transfer time.
 static MemoryMappedRegister<uint32_t> PI_WR_LEN_REG = {
     [](uint32_t& value, bool write)
     {
-        memory_enable_logging(false);
-        memory_do_dma(dma_dst_addr, dma_src_addr, value);
-        memory_enable_logging(true);
+        if (!write)
+            return;
+
+        const uint32_t length = (value & 0x00FFFFFF) + 1;
+        memory_do_dma_async(dma_dst_addr & 0x00FFFFFF, dma_src_addr, length);
+
+        pi_dma_busy = true;
+        scheduler_schedule(SchedulerEvent::PiDma, cycle_counter + length * PI_DMA_CYCLES_PER_BYTE);
     }
 };
 static MemoryMappedRegister<uint32_t> PI_STATUS_REG = {
@@ -193,128 +309,214 @@ static MemoryMappedRegister<uint32_t> PI_STATUS_REG = {
     {
         if (write)
         {
+            // bit 1 acknowledges the interrupt
+            if (value & 0x02)
+                mi_clear(MI_INTR_PI);
         }
-        else
-        {
-            value = 0;
-            set_bit(value, 0, 0);
-            set_bit(value, 1, 0);
-            set_bit(value, 2, 0);
-        }
-    }
-};
-//static MemoryMappedRegister<uint32_t> PI_BSD_DOM1_LAT_REG = {};
-//static MemoryMappedRegister<uint32_t> PI_BSD_DOM1_PWD_REG = {};
-//static MemoryMappedRegister<uint32_t> PI_BSD_DOM1_PGS_REG = {};
-//static MemoryMappedRegister<uint32_t> PI_BSD_DOM1_RLS_REG = {};
-//static MemoryMappedRegister<uint32_t> PI_BSD_DOM2_LAT_REG = {};
-//static MemoryMappedRegister<uint32_t> PI_BSD_DOM2_PWD_REG = {};
-//static MemoryMappedRegister<uint32_t> PI_BSD_DOM2_PGS_REG = {};
-//static MemoryMappedRegister<uint32_t> PI_BSD_DOM2_RLS_REG = {};
 
-static MemoryMappedRegister<uint32_t> VI_CONTROL_REG = {
-    [](uint32_t& value, bool write)
-    {
-        throw nullptr;
+        value = (pi_dma_busy ? PI_STATUS_DMA_BUSY : 0) | ((mi_intr & MI_INTR_PI) ? PI_STATUS_INTERRUPT : 0);
     }
 };
 
-static MemoryMappedRegister<uint32_t> VI_ORIGIN_REG = {
+/*******************************************************/
+// SI DMA, 64 bytes between RDRAM and PIF RAM
+#define SI_STATUS_DMA_BUSY          0x0001
+#define SI_STATUS_INTERRUPT         0x1000
+
+#define SI_PIF_RAM_ADDRESS          0x1FC007C0
+#define SI_DMA_CYCLES               9000
+
+static bool si_dma_busy{};
+
+static MemoryMappedRegister<uint32_t> SI_DRAM_ADDR_REG = { [](uint32_t& value, bool write){} };
+
+static void si_do_dma(bool to_pif)
+{
+    const uint32_t dram = SI_DRAM_ADDR_REG.value & 0x00FFFFF8;
+    const bool logging = memory_logging_enabled();
+
+    memory_enable_logging(false);
+
+    if (to_pif)
+        memory_do_dma(SI_PIF_RAM_ADDRESS, dram, 64);
+    else
+        memory_do_dma(dram, SI_PIF_RAM_ADDRESS, 64);
+
+    memory_enable_logging(logging);
+
+    si_dma_busy = true;
+    scheduler_schedule(SchedulerEvent::SiDma, cycle_counter + SI_DMA_CYCLES);
+}
+
+static MemoryMappedRegister<uint32_t> SI_PIF_ADDR_RD64B_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        if (write)
+            si_do_dma(false);
     }
 };
 
-static MemoryMappedRegister<uint32_t> VI_WIDTH_REG = {
+static MemoryMappedRegister<uint32_t> SI_PIF_ADDR_WR64B_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        if (write)
+            si_do_dma(true);
     }
 };
 
-static MemoryMappedRegister<uint32_t> VI_INTR_REG = {
+static MemoryMappedRegister<uint32_t> SI_STATUS_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
+        // any write acknowledges the interrupt
+        if (write)
+            mi_clear(MI_INTR_SI);
+
+        value = (si_dma_busy ? SI_STATUS_DMA_BUSY : 0) | ((mi_intr & MI_INTR_SI) ? SI_STATUS_INTERRUPT : 0);
     }
 };
+//static MemoryMappedRegister<uint32_t> PI_BSD_DOM1_LAT_REG = {};
+//static MemoryMappedRegister<uint32_t> PI_BSD_DOM1_PWD_REG = {};
+//static MemoryMappedRegister<uint32_t> PI_BSD_DOM1_PGS_REG = {};
+//static MemoryMappedRegister<uint32_t> PI_BSD_DOM1_RLS_REG = {};
+//static MemoryMappedRegister<uint32_t> PI_BSD_DOM2_LAT_REG = {};
+//static MemoryMappedRegister<uint32_t> PI_BSD_DOM2_PWD_REG = {};
+//static MemoryMappedRegister<uint32_t> PI_BSD_DOM2_PGS_REG = {};
+//static MemoryMappedRegister<uint32_t> PI_BSD_DOM2_RLS_REG = {};
+
+/*******************************************************/
+// VI, only timing for now: the current line and the line interrupt
+#define VI_NUM_LINES                262     // NTSC, progressive
+
+static uint32_t vi_line{};
+static uint64_t vi_frame_start{};
+
+static MemoryMappedRegister<uint32_t> VI_CONTROL_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_ORIGIN_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_WIDTH_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_INTR_REG = { [](uint32_t& value, bool write){} };
 
+// counts half lines, writing it acknowledges the interrupt
 static MemoryMappedRegister<uint32_t> VI_V_CURRENT_REG = {
     [](uint32_t& value, bool write)
     {
-        throw nullptr;
-    }
-};
+        if (write)
+            mi_clear(MI_INTR_VI);
 
-static MemoryMappedRegister<uint32_t> VI_BURST_REG = {
-    [](uint32_t& value, bool write)
-    {
-        throw nullptr;
+        value = vi_line * 2;
     }
 };
 
-static MemoryMappedRegister<uint32_t> VI_V_SYNC_REG = {
-    [](uint32_t& value, bool write)
-    {
-        throw nullptr;
-    }
-};
+static MemoryMappedRegister<uint32_t> VI_BURST_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_V_SYNC_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_H_SYNC_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_LEAP_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_H_START_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_V_START_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_V_BURST_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_X_SCALE_REG = { [](uint32_t& value, bool write){} };
+static MemoryMappedRegister<uint32_t> VI_Y_SCALE_REG = { [](uint32_t& value, bool write){} };
+
+// frames start every CPU_CYCLES_PER_FRAME cycles, same boundary cpu_run_frame() uses
+static uint64_t vi_line_cycle(uint32_t line)
+{
+    return vi_frame_start + uint64_t(line) * CPU_CYCLES_PER_FRAME / VI_NUM_LINES;
+}
 
-static MemoryMappedRegister<uint32_t> VI_H_SYNC_REG = {
-    [](uint32_t& value, bool write)
-    {
-        throw nullptr;
-    }
-};
-static MemoryMappedRegister<uint32_t> VI_LEAP_REG = {
-    [](uint32_t& value, bool write)
-    {
-        throw nullptr;
-    }
-};
-static MemoryMappedRegister<uint32_t> VI_H_START_REG = {
-    [](uint32_t& value, bool write)
-    {
-        throw nullptr;
-    }
-};
-static MemoryMappedRegister<uint32_t> VI_V_START_REG = {
-    [](uint32_t& value, bool write)
-    {
-        throw nullptr;
-    }
-};
-static MemoryMappedRegister<uint32_t> VI_V_BURST_REG = {
-    [](uint32_t& value, bool write)
-    {
-        throw nullptr;
-    }
-};
-static MemoryMappedRegister<uint32_t> VI_X_SCALE_REG = {
-    [](uint32_t& value, bool write)
-    {
-        throw nullptr;
-    }
-};
-static MemoryMappedRegister<uint32_t> VI_Y_SCALE_REG = {
-    [](uint32_t& value, bool write)
+static void vi_reset()
+{
+    vi_frame_start = cycle_counter - cycle_counter % CPU_CYCLES_PER_FRAME;
+    vi_line = 0;
+
+    while (vi_line + 1 < VI_NUM_LINES && vi_line_cycle(vi_line + 1) <= cycle_counter)
+        vi_line++;
+
+    scheduler_schedule(SchedulerEvent::ViLine, vi_line_cycle(vi_line + 1));
+}
+
+static void vi_line_event(uint64_t)
+{
+    if (++vi_line == VI_NUM_LINES)
     {
-        throw nullptr;
+        vi_line = 0;
+        vi_frame_start += CPU_CYCLES_PER_FRAME;
     }
-};
+
+    if (vi_line * 2 == (VI_INTR_REG.value & 0x3FE))
+        mi_raise(MI_INTR_VI);
+
+    scheduler_schedule(SchedulerEvent::ViLine, vi_line_cycle(vi_line + 1));
+}
+
+/*******************************************************/
+// COP0 count and random are worked out from cycle_counter when they're read
+// rather than updated every instruction
+
+// count ticks on odd cycles, cycle_counter / 2 of them so far
+static uint32_t count_base{};
+
+// random counts down from 31 to wired once per instruction, restarting at 31
+// whenever wired is written
+static uint64_t random_base_cycle{};
+
+static uint32_t cpu_get_count()
+{
+    return count_base + uint32_t(cycle_counter / 2);
+}
+
+static void cpu_set_count(uint32_t value)
+{
+    count_base = value - uint32_t(cycle_counter / 2);
+}
+
+static uint32_t cpu_get_random()
+{
+    const uint32_t wired = uint32_t(cpu.cop0.wired()) & 0x3F;
+    const uint32_t range = wired < 32 ? 32 - wired : 32;
+
+    return 31 - uint32_t((cycle_counter - random_base_cycle) % range);
+}
+
+// COP0 count/compare
+static void cpu_schedule_compare()
+{
+    const uint32_t ticks = uint32_t(cpu.cop0.compare()) - cpu_get_count();
+    const uint64_t remaining = ticks ? ticks : 1ull << 32;
+
+    // the first tick is on the next odd cycle, the event is due once that
+    // cycle's instruction has retired
+    scheduler_schedule(SchedulerEvent::CountCompare, (cycle_counter | 1) + 2 * (remaining - 1) + 1);
+}
+
+static void cpu_compare_event(uint64_t)
+{
+    cpu.cop0.cause() |= CAUSE_IP7;
+    cpu_schedule_compare();
+}
+
+static void sp_dma_event(uint64_t)
+{
+    sp_status &= ~SP_STATUS_DMA_BUSY;
+}
+
+static void pi_dma_event(uint64_t)
+{
+    // normally long done, the modelled transfer is far slower than the copy
+    memory_finish_async_dma();
+
+    pi_dma_busy = false;
+    mi_raise(MI_INTR_PI);
+}
+
+static void si_dma_event(uint64_t)
+{
+    si_dma_busy = false;
+    mi_raise(MI_INTR_SI);
+}
 
 template<typename T>
 void bind_register(MemoryMappedRegister<T>* reg, uint32_t addr_start, uint32_t addr_end, const char* name)
 {
-    using namespace std::placeholders;
-
-    memory_install_rw_callback(
-        addr_start, addr_end,
-        std::bind(&MemoryMappedRegister<T>::read, reg, _1, _2, _3),
-        std::bind(&MemoryMappedRegister<T>::write, reg, _1, _2, _3),
-        name
-    );
+    memory_install_handlers(addr_start, addr_end, memory_make_handlers(reg), name);
 }
 
 void cpu_link(uint64_t address)
@@ -326,94 +528,52 @@ void cpu_init()
 {
     memory_init();
     disassembler_init();
+    icache_init();
+    block_init();
+    jit_init();
 
     // main system ram (with expansion pack)
-    memory_install_rw_callback(
-        0x00000000, 0x03EFFFFF,
-        [](uint32_t address, uint32_t size, void* dst)
+    memory_install_buffer(
+        0x00000000, RDRAM_SIZE - 1,
+        rdram, true,
+        [](uint32_t address, uint32_t size)
         {
-            memcpy(dst, rdram + address, size);
-        },
-        [](uint32_t address, uint32_t size, const void* src)
-        {
-            assert(address + size < sizeof(rdram));
-            memcpy(rdram + address, src, size);
+            memory_rdram_written(address, size);
+            icache_invalidate(address, size);
         },
         "RDRAM Memory"
     );
 
-    // hack to fix the crash that happens when we try and work with the stack
-    static uint8_t stack_hack[MB(1)]{};
-    memory_install_rw_callback(
-        0x04002000, 0x0403FFFF,
-        [](uint32_t addr, uint32_t size, void* dst) { memcpy(dst, stack_hack + addr, size); },
-        [](uint32_t addr, uint32_t size, const void* src) { memcpy(stack_hack + addr, src, size); },
-        "RDRAM Memory Mirror???"
-    );
+    // rest of the RDRAM space, nothing fitted there
+    memory_install_open_bus(RDRAM_SIZE, 0x03EFFFFF, 0x00, false, "RDRAM Unmapped");
 
-    // RSP data memory
-    memory_install_rw_callback(
-        0x04000000, 0x04000FFF,
-        std::bind(default_buffer_read, rsp.dmem, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3),
-        std::bind(default_buffer_write, rsp.dmem, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3),
-        "RSP_DMEM"
-    );
+    // hack to fix the crash that happens when we try and work with the stack
+    alignas(MEMORY_PAGE_SIZE) static uint8_t stack_hack[MB(1)]{};
+    memory_install_buffer(0x04002000, 0x0403FFFF, stack_hack, true, nullptr, "RDRAM Memory Mirror???");
 
-    // RSP code memory
-    memory_install_rw_callback(
-        0x04001000, 0x04001FFF,
-        std::bind(default_buffer_read, rsp.imem, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3),
-        std::bind(default_buffer_write, rsp.imem, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3),
-        "RSP_IMEM"
-    );
+    // RSP data memory (the PIF boot code runs from here) and code memory
+    memory_install_buffer(0x04000000, 0x04000FFF, rsp.dmem, true, icache_invalidate, "RSP_DMEM");
+    memory_install_buffer(0x04001000, 0x04001FFF, rsp.imem, true, icache_invalidate, "RSP_IMEM");
 
     // N64DD address (return all 0xFF when not connected)
-    memory_install_rw_callback(
-        0x05000000, 0x07FFFFFF,
-        [](uint32_t, uint32_t size, void* dst){ memset(dst, 0xFF, size); },
-        [](uint32_t, uint32_t, const void* src){ },
-        "N64DD"
-    );
+    memory_install_open_bus(0x05000000, 0x07FFFFFF, 0xFF, false, "N64DD");
 
     // SRAM
-    memory_install_rw_callback(
-        0x08000000, 0x0FFFFFFF,
-        [](uint32_t, uint32_t, void*){ },
-        [](uint32_t, uint32_t, const void*){ },
-        "Cartridge SRAM"
-    );
+    memory_install_open_bus(0x08000000, 0x0FFFFFFF, 0x00, false, "Cartridge SRAM");
 
-    // cartridge data
-    memory_install_rw_callback(
-        0x10000000, 0x1FBFFFFF,
-        std::bind(default_buffer_read, cartridge_rom, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3),
-        [](uint32_t, uint32_t, const void*) { printf("Write attempt to cartridge space\n"); throw nullptr; },
-        "Cartridge ROM"
-    );
+    // cartridge data, reads past the end of the buffer are open bus
+    memory_install_buffer(0x10000000, 0x10000000 + sizeof(cartridge_rom) - 1, cartridge_rom, false, nullptr, "Cartridge ROM");
 
-    // PIF RAM
-    memory_install_rw_callback(
-        0x1FC007C0, 0x1FC007FF,
-        std::bind(default_buffer_read, pif_ram, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3),
-        std::bind(default_buffer_write, pif_ram, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3),
-        "PIF RAM"
-    );
+    memory_install_open_bus(0x10000000 + sizeof(cartridge_rom), 0x1FBFFFFF, 0x00, true, "Cartridge ROM");
+
+    // PIF RAM, shares its page with the PIF boot ROM so it stays on the handlers
+    memory_install_buffer(0x1FC007C0, 0x1FC007FF, pif_ram, true, nullptr, "PIF RAM");
 
     // RDMEM registers (ignored)
-    memory_install_rw_callback(
-        0x03F00000, 0x03FFFFFF,
-        [](uint32_t, uint32_t, void*){ },
-        [](uint32_t, uint32_t, const void*){ },
-        "RDMEM registers "
-    );
+    memory_install_open_bus(0x03F00000, 0x03FFFFFF, 0x00, false, "RDMEM registers ");
 
     // Unused SP register space?
-    memory_install_rw_callback(
-        0x04040020, 0x0407FFFF,
-        [](uint32_t, uint32_t, void*){ },
-        [](uint32_t, uint32_t, const void*){ },
-        "Unused SP registers"
-    );
+    memory_install_open_bus(0x04040020, 0x0407FFFF, 0x00, false, "Unused SP registers");
 
     /*static char debug_string_buffer[128]{};
 
@@ -464,20 +624,20 @@ void cpu_init()
     bind_register(&SP_PC_REG,             0x04080000, 0x04080003, "SP_PC_REG");
     bind_register(&SP_IBIST_REG,         0x04080004, 0x04080007, "SP_IBIST_REG");
 
-    bind_register(&VI_CONTROL_REG,         0x04400000, 0x04400000 + 4, "VI_CONTROL_REG");
-    bind_register(&VI_ORIGIN_REG,         0x04400004, 0x04400004 + 4, "VI_ORIGIN_REG");
-    bind_register(&VI_WIDTH_REG,         0x04400008, 0x04400008 + 4, "VI_WIDTH_REG");
-    bind_register(&VI_INTR_REG,         0x0440000C, 0x0440000C + 4, "VI_INTR_REG");
-    bind_register(&VI_V_CURRENT_REG,     0x04400010, 0x04400010 + 4, "VI_V_CURRENT_REG");
-    bind_register(&VI_BURST_REG,         0x04400014, 0x04400014 + 4, "VI_BURST_REG");
-    bind_register(&VI_V_SYNC_REG,         0x04400018, 0x04400018 + 4, "VI_V_SYNC_REG");
-    bind_register(&VI_H_SYNC_REG,         0x0440001C, 0x0440001C + 4, "VI_H_SYNC_REG");
-    bind_register(&VI_LEAP_REG,         0x04400020, 0x04400020 + 4, "VI_LEAP_REG");
-    bind_register(&VI_H_START_REG,         0x04400024, 0x04400024 + 4, "VI_H_START_REG");
-    bind_register(&VI_V_START_REG,         0x04400028, 0x04400028 + 4, "VI_V_START_REG");
-    bind_register(&VI_V_BURST_REG,         0x0440002C, 0x0440002C + 4, "VI_V_BURST_REG");
-    bind_register(&VI_X_SCALE_REG,         0x04400030, 0x04400030 + 4, "VI_X_SCALE_REG");
-    bind_register(&VI_Y_SCALE_REG,         0x04400034, 0x04400034 + 4, "VI_Y_SCALE_REG");
+    bind_register(&VI_CONTROL_REG,         0x04400000, 0x04400003, "VI_CONTROL_REG");
+    bind_register(&VI_ORIGIN_REG,         0x04400004, 0x04400007, "VI_ORIGIN_REG");
+    bind_register(&VI_WIDTH_REG,         0x04400008, 0x0440000B, "VI_WIDTH_REG");
+    bind_register(&VI_INTR_REG,         0x0440000C, 0x0440000F, "VI_INTR_REG");
+    bind_register(&VI_V_CURRENT_REG,     0x04400010, 0x04400013, "VI_V_CURRENT_REG");
+    bind_register(&VI_BURST_REG,         0x04400014, 0x04400017, "VI_BURST_REG");
+    bind_register(&VI_V_SYNC_REG,         0x04400018, 0x0440001B, "VI_V_SYNC_REG");
+    bind_register(&VI_H_SYNC_REG,         0x0440001C, 0x0440001F, "VI_H_SYNC_REG");
+    bind_register(&VI_LEAP_REG,         0x04400020, 0x04400023, "VI_LEAP_REG");
+    bind_register(&VI_H_START_REG,         0x04400024, 0x04400027, "VI_H_START_REG");
+    bind_register(&VI_V_START_REG,         0x04400028, 0x0440002B, "VI_V_START_REG");
+    bind_register(&VI_V_BURST_REG,         0x0440002C, 0x0440002F, "VI_V_BURST_REG");
+    bind_register(&VI_X_SCALE_REG,         0x04400030, 0x04400033, "VI_X_SCALE_REG");
+    bind_register(&VI_Y_SCALE_REG,         0x04400034, 0x04400037, "VI_Y_SCALE_REG");
 
     bind_register(&PI_DRAM_ADDR_REG,    0x04600000, 0x04600003, "PI_DRAM_ADDR_REG");
     bind_register(&PI_CART_ADDR_REG,    0x04600004, 0x04600007, "PI_CART_ADDR_REG");
@@ -485,6 +645,11 @@ void cpu_init()
     bind_register(&PI_WR_LEN_REG,        0x0460000C, 0x0460000F, "PI_WR_LEN_REG");
     bind_register(&PI_STATUS_REG,        0x04600010, 0x04600013, "PI_STATUS_REG");
 
+    bind_register(&SI_DRAM_ADDR_REG,        0x04800000, 0x04800003, "SI_DRAM_ADDR_REG");
+    bind_register(&SI_PIF_ADDR_RD64B_REG,   0x04800004, 0x04800007, "SI_PIF_ADDR_RD64B_REG");
+    bind_register(&SI_PIF_ADDR_WR64B_REG,   0x04800010, 0x04800013, "SI_PIF_ADDR_WR64B_REG");
+    bind_register(&SI_STATUS_REG,           0x04800018, 0x0480001B, "SI_STATUS_REG");
+
     // reset cpu
     cpu.pc = 0;
     cpu.hi_lo = 0;
@@ -511,17 +676,33 @@ void cpu_init()
     cpu.sp() = 0xFFFFFFFFA4001FF0;
 
     cpu.cop0.r[0] = 0;
-    cpu.cop0.r[1] = 0x0000001F;         // random
     cpu.cop0.r[12] = 0x70400004;        // status
     cpu.cop0.r[15] = 0x00000B00;        // PRId
     cpu.cop0.r[16] = 0x0006E463;        // Config
 
+    cpu_set_count(0);
+    random_base_cycle = cycle_counter;
+
+    mi_intr = 0;
+    mi_intr_mask = 0;
+    sp_status = SP_STATUS_HALT;
+    pi_dma_busy = false;
+    si_dma_busy = false;
+
+    scheduler_init();
+    scheduler_set_handler(SchedulerEvent::CountCompare, cpu_compare_event);
+    scheduler_set_handler(SchedulerEvent::ViLine, vi_line_event);
+    scheduler_set_handler(SchedulerEvent::PiDma, pi_dma_event);
+    scheduler_set_handler(SchedulerEvent::SiDma, si_dma_event);
+    scheduler_set_handler(SchedulerEvent::SpDma, sp_dma_event);
+    cpu_schedule_compare();
+    vi_reset();
+
     memory_write32(0x04300004, 0x10101010);
     /*******************************************************/
 
     /*memory_load_rom(
-        "/Users/chroma/Downloads/N64-master/HelloWorld/16BPP/HelloWorldCPU320x240/HelloWorldCPU16BPP320X240.N64",
-        false
+        "/Users/chroma/Downloads/N64-master/HelloWorld/16BPP/HelloWorldCPU320x240/HelloWorldCPU16BPP320X240.N64"
     );
 
     printf("Copying rom code to rdram...");
@@ -531,24 +712,80 @@ void cpu_init()
     //cpu.pc = memory_get_rom_header()->pc;
     cpu.pc = 0xFFFFFFFFA4000040;
 
-    memory_enable_logging(true);
+    // bus accesses are only logged while tracing (see cpu_set_tracing)
+    memory_enable_logging(false);
 }
 
 void cpu_get_cop0_register(int index, uint64_t& value)
 {
-    printf("Unsupported COP0 register read: %d\n", index);
-    value = cpu.cop0.r[index];
+    switch (index)
+    {
+        case 1:        // random
+            value = cpu_get_random();
+            break;
+
+        case 9:        // count
+            value = cpu_get_count();
+            break;
+
+        case 0:        // index
+        case 2:        // entry_lo0
+        case 3:        // entry_lo1
+        case 5:        // pagemask
+            value = cpu.cop0.r[index];
+            break;
+
+        default:
+            printf("Unsupported COP0 register read: %d\n", index);
+            value = cpu.cop0.r[index];
+            break;
+    }
 }
 
 void cpu_set_cop0_register(int index, uint64_t value)
 {
     switch (index)
     {
+        case 13:    // cause
+            cpu.cop0.r[index] = value;
+            break;
+
+        // TLB staging registers, only TLBWI/TLBWR act on them
+        case 0:        // index, 64 entries plus the probe failure bit
+            cpu.cop0.r[index] = value & 0x8000003F;
+            break;
+
+        case 2:        // entry_lo0
+        case 3:        // entry_lo1
+        case 5:        // pagemask
+            cpu.cop0.r[index] = value;
+            break;
+
+        // read only
+        case 1:        // random
+            break;
+
         case 6:        // wired
+            cpu.cop0.r[index] = value;
+            random_base_cycle = cycle_counter;
+            break;
+
         case 9:        // count
-        case 11:    // cause
-        case 13:    // compare
+            cpu_set_count(uint32_t(value));
+            cpu_schedule_compare();
+            break;
+
+        // the ASID picks which TLB entries apply
+        case 10:    // entry_hi
+            cpu.cop0.r[index] = value;
+            memory_tlb_set_asid(uint8_t(value));
+            break;
+
+        // writing compare acknowledges the timer interrupt
+        case 11:    // compare
             cpu.cop0.r[index] = value;
+            cpu.cop0.cause() &= ~uint64_t(CAUSE_IP7);
+            cpu_schedule_compare();
             break;
 
         // ignore cache stuff
@@ -564,6 +801,29 @@ void cpu_set_cop0_register(int index, uint64_t value)
     }
 }
 
+static CpuFault last_fault{};
+
+bool cpu_fault(const char* message, uint32_t address, uint32_t size)
+{
+    last_fault = { message, address, size, false };
+    printf("CPU: %s: %08X\n", message, address);
+
+    return false;
+}
+
+bool cpu_unknown_opcode(uint32_t opcode)
+{
+    cpu_fault("Unknown opcode", opcode, 4);
+    last_fault.unknown_opcode = true;
+
+    return false;
+}
+
+const CpuFault& cpu_get_fault()
+{
+    return last_fault;
+}
+
 bool logging_enabled{false};
 static bool stepping{false};
 static uint32_t breakpoint_address{0x80000000};
@@ -636,10 +896,43 @@ bool run_debugger()
     return false;
 }
 
-bool cpu_step()
+// Trace policies the step and run loops are instantiated with. NoTrace is what
+// normally runs and has none of the tracing compiled in, Trace (text logging,
+// cpu_set_tracing) and RecordTrace (binary trace file, cpu_start_recording)
+// are swapped in for debugging sessions.
+struct NoTrace
+{
+    static constexpr bool logging = false;
+    static constexpr bool recording = false;
+};
+
+struct Trace
+{
+    static constexpr bool logging = true;
+    static constexpr bool recording = false;
+};
+
+struct RecordTrace
+{
+    static constexpr bool logging = false;
+    static constexpr bool recording = true;
+};
+
+// A delay slot that faults is left pending again with the pc back on the
+// branch target, as before it ran, so resuming runs the delay slot again
+static bool cpu_fault_in_delay_slot(uint64_t delay_slot)
+{
+    branch_delay_slot_address = delay_slot;
+    cpu.pc += 4;
+    return false;
+}
+
+template<typename TracePolicy>
+static bool cpu_step_impl() noexcept
 {
     uint32_t opcode{};
     uint64_t program_counter{};
+    const uint64_t delay_slot = branch_delay_slot_address;
 
     // fill this execution with the delay slot address
     if (branch_delay_slot_address != 0)
@@ -658,77 +951,547 @@ bool cpu_step()
     // don't use the access members
     cpu.gpr[0] = 0;
 
-    // random register
-    cpu.cop0.random() = ((cpu.cop0.wired() + rand()) & 0x3F);
+    // instruction fetch, predecoded pages skip the memory bus entirely
+    const CachedInstruction* cached{};
+    uint32_t physical_address{};
+
+    if constexpr (TracePolicy::logging)
+        memory_enable_logging(false);
 
-    // count register is incremented every other cycle
-    cpu.cop0.count() += cycle_counter && (cycle_counter % 2) ? 1 : 0;
+    if (memory_translate(program_counter, physical_address))
+        cached = icache_lookup(physical_address);
 
-    memory_enable_logging(false);
-    if (!memory_read32(program_counter, opcode))
+    if (cached)
     {
-        printf("CPU: bad instruction memory read\n");
-        return false;
+        opcode = cached->ctx.opbits;
+    }
+    else if (!memory_read32(program_counter, opcode))
+    {
+        cpu_fault("bad instruction memory read", uint32_t(program_counter), 4);
+        return delay_slot ? cpu_fault_in_delay_slot(delay_slot) : false;
     }
-    memory_enable_logging(logging_enabled);
 
-    const auto* op = disassembler_decode_instruction(opcode);
-    ExecutionContext ctx{opcode};
+    if constexpr (TracePolicy::logging)
+    {
+        memory_enable_logging(logging_enabled);
+
+        if ((program_counter & 0xFFFFFFFF) == 0x80000000)
+        {
+            logging_enabled = true;
+            //stepping = true;
+        }
+
+        if (logging_enabled)
+        {
+            char parse_buffer[256]{};
+            disassembler_parse_instruction(opcode, disassembler_decode_instruction(opcode), parse_buffer, 0);
+            printf("0x%016llX: %08X: %s\n", program_counter, opcode, parse_buffer);
+        }
+
+        if (stepping)
+            getchar();
 
-    if ((program_counter & 0xFFFFFFFF) == 0x80000000)
+        //run_debugger();
+    }
+
+    if (cached && cached->func)
+    {
+        ExecutionContext ctx = cached->ctx;
+
+        if (!cached->func(ctx))
+            return delay_slot ? cpu_fault_in_delay_slot(delay_slot) : false;
+    }
+    else if (!cpu_execute(opcode))
     {
-        logging_enabled = true;
-        //stepping = true;
+        return delay_slot ? cpu_fault_in_delay_slot(delay_slot) : false;
     }
 
-    if (logging_enabled)
+    if constexpr (TracePolicy::logging)
     {
-        char parse_buffer[256]{};
-        disassembler_parse_instruction(opcode, op, parse_buffer, 0);
-        printf("0x%016llX: %08X: %s\n", program_counter, opcode, parse_buffer);
+        if (logging_enabled)
+        {
+            bool effected{};
+            for (int i = 0; i < 32; i++)
+            {
+                if (cpu.gpr[i] != previous_gpr_state[i])
+                {
+                    printf("\t$%s: 0x%016llX -> 0x%016llX\n", parser_get_symbolic_gpr_name(i), previous_gpr_state[i], cpu.gpr[i]);
+                    effected = true;
+                }
+            }
+
+            if (effected)
+                printf("\n");
+        }
+
+        memcpy(previous_gpr_state, cpu.gpr, 32 * 8);
     }
 
-    if (stepping)
-        getchar();
+    if constexpr (TracePolicy::recording)
+        trace_record(program_counter, opcode);
+
+    cycle_counter++;
+
+    return true;
+}
+
+static bool tracing{false};
+static bool recording{false};
+
+bool cpu_step() noexcept
+{
+    if (recording)
+        return cpu_step_impl<RecordTrace>();
+
+    return tracing ? cpu_step_impl<Trace>() : cpu_step_impl<NoTrace>();
+}
+
+static ExecutionMode execution_mode{ExecutionMode::Interpreter};
+
+static void cpu_update_run_next();
+
+void cpu_set_execution_mode(ExecutionMode mode)
+{
+    execution_mode = mode;
+    cpu_update_run_next();
+}
+
+ExecutionMode cpu_get_execution_mode()
+{
+    return execution_mode;
+}
+
+enum class BlockExit
+{
+    Taken,
+    NotTaken,
+    FallThrough,
 
-    //run_debugger();
+    // branch whose delay slot isn't part of the block, cpu_step() finishes it
+    DelaySlotPending,
+
+    Fault,
+};
+
+static BlockExit cpu_run_block(const BasicBlock* block, uint64_t& executed) noexcept
+{
+    const auto* instructions = block->instructions.data();
+    const int num_instructions = block->instructions.size();
+    const int branch_index = block->branch_index;
 
-    if (op)
+    for (int i = 0; i < num_instructions; i++)
     {
-        try {
-            // catch memory exceptions
-            op->func(ctx);
-        } catch (const MemException& mem_ex)
+        ExecutionContext ctx = instructions[i].ctx;
+
+        cpu.gpr[0] = 0;
+
+        if (!instructions[i].func(ctx))
+            return BlockExit::Fault;
+
+        executed++;
+
+        if (i != branch_index)
+            continue;
+
+        // not taken skips the delay slot entirely (see cpu_beq etc)
+        if (branch_delay_slot_address == 0)
+            return BlockExit::NotTaken;
+
+        if (i + 1 == num_instructions)
+            return BlockExit::DelaySlotPending;
+
+        // same as cpu_step: handler will bump the pc back up to the target
+        ExecutionContext delay_ctx = instructions[i + 1].ctx;
+        const uint64_t delay_slot = branch_delay_slot_address;
+
+        branch_delay_slot_address = 0;
+        cpu.pc -= 4;
+        cpu.gpr[0] = 0;
+
+        if (!instructions[i + 1].func(delay_ctx))
         {
-            printf("CPU: Memory Exception: %s\n", mem_ex.message);
-            return false;
+            cpu_fault_in_delay_slot(delay_slot);
+            return BlockExit::Fault;
         }
+
+        executed++;
+
+        return BlockExit::Taken;
+    }
+
+    return BlockExit::FallThrough;
+}
+
+// the cycle count is brought up to date once per block (or chain) rather than
+// per instruction, count and random follow from it
+static void cpu_retire(uint64_t executed)
+{
+    cycle_counter += executed;
+}
+
+template<typename TracePolicy>
+static bool cpu_step_block_impl() noexcept
+{
+    // anything the block engine can't run as a unit goes through the
+    // interpreter: a delay slot left pending, tracing, uncached memory
+    if (branch_delay_slot_address != 0 || TracePolicy::recording || (TracePolicy::logging && logging_enabled))
+        return cpu_step_impl<TracePolicy>();
+
+    const auto* block = block_lookup(cpu.pc);
+
+    if (!block)
+        return cpu_step_impl<TracePolicy>();
+
+    uint64_t executed{};
+    const auto exit = cpu_run_block(block, executed);
+
+    cpu_retire(executed);
+
+    return exit != BlockExit::Fault;
+}
+
+static DispatchStats dispatch_stats{};
+
+template<typename TracePolicy>
+static bool cpu_step_chained_impl() noexcept
+{
+    if (branch_delay_slot_address != 0 || TracePolicy::recording || (TracePolicy::logging && logging_enabled))
+        return cpu_step_impl<TracePolicy>();
+
+    auto* block = block_lookup(cpu.pc);
+
+    if (!block)
+        return cpu_step_impl<TracePolicy>();
+
+    // a chain stops early enough to let the next event run on time
+    const uint64_t budget = std::min<uint64_t>(CPU_CHAIN_MAX_INSTRUCTIONS,
+        scheduler_next_cycle > cycle_counter ? scheduler_next_cycle - cycle_counter : 1);
+
+    uint64_t executed{};
+    bool ok{true};
+
+    while (true)
+    {
+        const auto exit = cpu_run_block(block, executed);
+        dispatch_stats.blocks++;
+
+        if (exit == BlockExit::Fault)
+        {
+            ok = false;
+            break;
+        }
+
+        if (exit == BlockExit::DelaySlotPending || executed >= budget)
+            break;
+
+        // JR/JALR targets change from run to run, leave those to the dispatcher
+        if (exit == BlockExit::Taken && block->indirect)
+            break;
+
+        const auto link = exit == BlockExit::Taken ? BLOCK_LINK_TAKEN : BLOCK_LINK_FALLTHROUGH;
+        auto* next = block->links[link];
+
+        if (next && next->start_pc == cpu.pc)
+        {
+            dispatch_stats.links_followed++;
+            block = next;
+            continue;
+        }
+
+        // first time down this path, link it up for next time
+        next = block_lookup(cpu.pc);
+
+        if (!next)
+            break;
+
+        block_link(block, link, next);
+        dispatch_stats.links_created++;
+        block = next;
+    }
+
+    dispatch_stats.dispatcher_exits++;
+    cpu_retire(executed);
+
+    return ok;
+}
+
+const DispatchStats& cpu_get_dispatch_stats()
+{
+    return dispatch_stats;
+}
+
+template<typename TracePolicy>
+static bool cpu_step_recompiled_impl() noexcept
+{
+    if (branch_delay_slot_address != 0 || TracePolicy::recording || (TracePolicy::logging && logging_enabled))
+        return cpu_step_impl<TracePolicy>();
+
+    const auto code = jit_lookup(cpu.pc);
+
+    if (!code)
+        return cpu_step_block_impl<TracePolicy>();
+
+    const auto start_pc = cpu.pc;
+    const auto retired = code();
+
+    cpu_retire(retired & ~JIT_FAULTED);
+
+    if (!(retired & JIT_FAULTED))
+        return true;
+
+    // the faulting instruction's index is what retired before it
+    const auto* block = block_lookup(start_pc);
+    const int index = retired & ~JIT_FAULTED;
+
+    if (block && block->branch_index >= 0 && index == block->branch_index + 1)
+        cpu_fault_in_delay_slot(start_pc + index * 4);
+
+    return false;
+}
+
+bool cpu_step_block() noexcept
+{
+    if (recording)
+        return cpu_step_block_impl<RecordTrace>();
+
+    return tracing ? cpu_step_block_impl<Trace>() : cpu_step_block_impl<NoTrace>();
+}
+
+bool cpu_step_chained() noexcept
+{
+    if (recording)
+        return cpu_step_chained_impl<RecordTrace>();
+
+    return tracing ? cpu_step_chained_impl<Trace>() : cpu_step_chained_impl<NoTrace>();
+}
+
+bool cpu_step_recompiled() noexcept
+{
+    if (recording)
+        return cpu_step_recompiled_impl<RecordTrace>();
+
+    return tracing ? cpu_step_recompiled_impl<Trace>() : cpu_step_recompiled_impl<NoTrace>();
+}
+
+// Dispatches until the cycle count reaches `end` or one fails. Step is a
+// compile time constant, so the step itself is inlined into the loop.
+template<bool (*Step)() noexcept>
+static bool cpu_run_until(uint64_t end) noexcept
+{
+    while (cycle_counter < end)
+    {
+        if (cycle_counter >= scheduler_next_cycle)
+            scheduler_run_due(cycle_counter);
+
+        if (!Step())
+            return false;
+    }
+
+    return true;
+}
+
+struct Dispatch
+{
+    bool (*next)() noexcept;
+    bool (*run_until)(uint64_t end) noexcept;
+};
+
+template<bool (*Step)() noexcept>
+static constexpr Dispatch cpu_make_dispatch()
+{
+    return { Step, cpu_run_until<Step> };
+}
+
+template<typename TracePolicy>
+static Dispatch cpu_select_dispatch(ExecutionMode mode)
+{
+    switch (mode)
+    {
+        case ExecutionMode::CachedInterpreter:
+            return cpu_make_dispatch<cpu_step_block_impl<TracePolicy>>();
+
+        case ExecutionMode::ChainedBlocks:
+            return cpu_make_dispatch<cpu_step_chained_impl<TracePolicy>>();
+
+        case ExecutionMode::Recompiler:
+            return cpu_make_dispatch<cpu_step_recompiled_impl<TracePolicy>>();
+
+        case ExecutionMode::Interpreter:
+        default:
+            return cpu_make_dispatch<cpu_step_impl<TracePolicy>>();
     }
+}
+
+// picked whenever the execution mode or tracing changes, so cpu_run_next()
+// and cpu_run() don't re-decide it on every dispatch
+static Dispatch dispatch = cpu_make_dispatch<cpu_step_impl<NoTrace>>();
+
+static void cpu_update_run_next()
+{
+    if (recording)
+        dispatch = cpu_select_dispatch<RecordTrace>(execution_mode);
+    else if (tracing)
+        dispatch = cpu_select_dispatch<Trace>(execution_mode);
     else
+        dispatch = cpu_select_dispatch<NoTrace>(execution_mode);
+}
+
+bool cpu_run_next() noexcept
+{
+    if (cycle_counter >= scheduler_next_cycle)
+        scheduler_run_due(cycle_counter);
+
+    return dispatch.next();
+}
+
+// Execution breakpoints: one bit per 4 KB page of the (32 bit) pc space for
+// whether it holds any, and only for those pages a bit per instruction. Code
+// in pages without one runs a block at a time.
+#define BREAKPOINT_PAGE_SHIFT       ICACHE_PAGE_SHIFT
+#define BREAKPOINT_NUM_PAGES        (1ull << (32 - BREAKPOINT_PAGE_SHIFT))
+
+static uint64_t breakpoint_pages[BREAKPOINT_NUM_PAGES / 64]{};
+static std::unordered_map<uint32_t, std::bitset<ICACHE_PAGE_INSTRUCTIONS>> breakpoint_slots;
+
+// cycle count cpu_run() last stopped on a breakpoint at, so running again
+// steps over it instead of stopping straight away
+static uint64_t breakpoint_stop_cycle{UINT64_MAX};
+
+static bool cpu_page_has_breakpoint(uint32_t page)
+{
+    return (breakpoint_pages[page >> 6] >> (page & 63)) & 1;
+}
+
+void cpu_add_breakpoint(uint64_t pc)
+{
+    const auto page = uint32_t(pc) >> BREAKPOINT_PAGE_SHIFT;
+
+    breakpoint_slots[page].set((uint32_t(pc) & (ICACHE_PAGE_SIZE - 1)) >> 2);
+    breakpoint_pages[page >> 6] |= 1ull << (page & 63);
+}
+
+void cpu_remove_breakpoint(uint64_t pc)
+{
+    const auto page = uint32_t(pc) >> BREAKPOINT_PAGE_SHIFT;
+    auto it = breakpoint_slots.find(page);
+
+    if (it == breakpoint_slots.end())
+        return;
+
+    it->second.reset((uint32_t(pc) & (ICACHE_PAGE_SIZE - 1)) >> 2);
+
+    if (it->second.none())
     {
-        printf("CPU: Unknown opcode: %08X\n", opcode);
-        return false;
+        breakpoint_slots.erase(it);
+        breakpoint_pages[page >> 6] &= ~(1ull << (page & 63));
     }
+}
+
+static bool cpu_at_breakpoint()
+{
+    // a pending delay slot is the next instruction to run, not the pc
+    const uint32_t pc = branch_delay_slot_address != 0 ? branch_delay_slot_address : cpu.pc;
+    const auto page = pc >> BREAKPOINT_PAGE_SHIFT;
+
+    if (!cpu_page_has_breakpoint(page))
+        return false;
+
+    return breakpoint_slots[page].test((pc & (ICACHE_PAGE_SIZE - 1)) >> 2);
+}
 
-    if (logging_enabled)
+// a block never leaves the page it starts in except for a delay slot, so it
+// can run as a unit when neither page has a breakpoint
+static bool cpu_block_clear_of_breakpoints()
+{
+    const auto page = uint32_t(cpu.pc) >> BREAKPOINT_PAGE_SHIFT;
+
+    return branch_delay_slot_address == 0
+        && !cpu_page_has_breakpoint(page)
+        && !cpu_page_has_breakpoint((page + 1) & (BREAKPOINT_NUM_PAGES - 1));
+}
+
+RunResult cpu_run(uint64_t cycles) noexcept
+{
+    const auto start = cycle_counter;
+    const auto end = cycles > UINT64_MAX - start ? UINT64_MAX : start + cycles;
+    bool ok{true};
+
+    last_fault = {};
+    memory_clear_watchpoint_hit();
+
+    if (breakpoint_slots.empty() && !memory_has_watchpoints())
     {
-        bool effected{};
-        for (int i = 0; i < 32; i++)
+        ok = dispatch.run_until(end);
+    }
+    else
+    {
+        // Breakpoints are checked before every instruction in a page that has
+        // one, and watchpoint hits after every instruction, so this goes
+        // through the interpreter (or the block engine) whatever the
+        // execution mode.
+        const bool watching = memory_has_watchpoints();
+
+        while (ok && cycle_counter < end)
         {
-            if (cpu.gpr[i] != previous_gpr_state[i])
+            if (cycle_counter != breakpoint_stop_cycle && cpu_at_breakpoint())
             {
-                printf("\t$%s: 0x%016llX -> 0x%016llX\n", parser_get_symbolic_gpr_name(i), previous_gpr_state[i], cpu.gpr[i]);
-                effected = true;
+                breakpoint_stop_cycle = cycle_counter;
+                return { StopReason::Breakpoint, cycle_counter - start };
             }
-        }
 
-        if (effected)
-            printf("\n");
+            if (cycle_counter >= scheduler_next_cycle)
+                scheduler_run_due(cycle_counter);
+
+            ok = !watching && cpu_block_clear_of_breakpoints() ? cpu_step_block() : cpu_step();
+
+            // the access has been made, the instruction doing it has retired
+            if (memory_get_watchpoint_hit())
+                return { StopReason::Watchpoint, cycle_counter - start };
+        }
     }
 
-    memcpy(previous_gpr_state, cpu.gpr, 32 * 8);
+    if (!ok)
+        return { last_fault.unknown_opcode ? StopReason::UnknownOpcode : StopReason::Fault, cycle_counter - start };
 
-    cycle_counter++;
+    return { StopReason::BudgetExhausted, cycle_counter - start };
+}
 
-    return true;
-}
\ No newline at end of file
+RunResult cpu_run_frame() noexcept
+{
+    const auto frame_end = (cycle_counter / CPU_CYCLES_PER_FRAME + 1) * CPU_CYCLES_PER_FRAME;
+
+    return cpu_run(frame_end - cycle_counter);
+}
+
+void cpu_set_tracing(bool enabled)
+{
+    tracing = enabled;
+    logging_enabled = false;
+    memory_enable_logging(false);
+    cpu_update_run_next();
+}
+
+bool cpu_get_tracing()
+{
+    return tracing;
+}
+
+bool cpu_start_recording(const char* path)
+{
+    recording = trace_open(path);
+    cpu_update_run_next();
+
+    return recording;
+}
+
+void cpu_stop_recording()
+{
+    trace_close();
+    recording = false;
+    cpu_update_run_next();
+}
+
+uint64_t cpu_get_cycle_count()
+{
+    return cycle_counter;
+}
@@ -2,8 +2,110 @@
 
 #include <cstdint>
 
+enum class ExecutionMode
+{
+    // cpu_step(), fetch/decode/execute one instruction per dispatch
+    Interpreter,
+
+    // cpu_step_block(), run a predecoded basic block per dispatch
+    CachedInterpreter,
+
+    // cpu_step_chained(), like CachedInterpreter but blocks jump straight to
+    // their linked successors instead of returning to the caller each time
+    ChainedBlocks,
+
+    // cpu_step_recompiled(), run basic blocks translated to host code
+    Recompiler,
+};
+
+// most instructions cpu_step_chained() runs before returning
+#define CPU_CHAIN_MAX_INSTRUCTIONS      4096
+
+struct DispatchStats
+{
+    // blocks executed by cpu_step_chained()
+    uint64_t blocks;
+
+    // block to block transitions that went through a link
+    uint64_t links_followed;
+    uint64_t links_created;
+
+    // returns from cpu_step_chained() to its caller
+    uint64_t dispatcher_exits;
+};
+
 void cpu_init();
 void cpu_set_pc(uint64_t pc);
-bool cpu_step();
+bool cpu_step() noexcept;
+bool cpu_step_block() noexcept;
+bool cpu_step_chained() noexcept;
+bool cpu_step_recompiled() noexcept;
+
+void cpu_set_execution_mode(ExecutionMode mode);
+ExecutionMode cpu_get_execution_mode();
+
+// cpu_step(), cpu_step_block(), cpu_step_chained() or cpu_step_recompiled()
+// depending on the execution mode
+bool cpu_run_next() noexcept;
+
+// 93.75 MHz cpu clock, 60 Hz (NTSC) video
+#define CPU_CYCLES_PER_FRAME            (93750000 / 60)
+
+enum class StopReason
+{
+    // ran the requested cycles (or to the end of the frame)
+    BudgetExhausted,
+
+    // about to execute an instruction at a cpu_add_breakpoint() address
+    Breakpoint,
+
+    // the last instruction accessed a memory_add_watchpoint() range, see
+    // memory_get_watchpoint_hit()
+    Watchpoint,
+
+    // an instruction couldn't complete, see cpu_get_fault()
+    Fault,
+    UnknownOpcode,
+};
+
+struct RunResult
+{
+    StopReason reason;
+
+    // instructions retired by this run
+    uint64_t cycles;
+};
+
+// Runs in the current execution mode until `cycles` have been retired or
+// something stops it. Block based modes only check the budget between
+// dispatches, so they can overrun it by up to a block (or a chain).
+RunResult cpu_run(uint64_t cycles) noexcept;
+
+// cpu_run() up to the next frame boundary (every CPU_CYCLES_PER_FRAME cycles)
+RunResult cpu_run_frame() noexcept;
+
+// execution breakpoints on the low 32 bits of the pc, cpu_run() stops before
+// running the instruction and steps over it when called again. Only pages
+// with a breakpoint are run an instruction at a time.
+void cpu_add_breakpoint(uint64_t pc);
+void cpu_remove_breakpoint(uint64_t pc);
+
+// switches the step/run loops over to the variant with instruction and
+// register tracing compiled in. Logging starts once execution reaches
+// 0x80000000 (the game's entry point), the normal variant has none of it.
+void cpu_set_tracing(bool enabled);
+bool cpu_get_tracing();
+
+// streams every executed instruction to a binary trace file (see trace.h),
+// decoded offline with ultra-trace. Recording runs instruction by instruction
+// whatever the execution mode.
+bool cpu_start_recording(const char* path);
+void cpu_stop_recording();
+
+const DispatchStats& cpu_get_dispatch_stats();
+
+// instructions retired since cpu_init()
+uint64_t cpu_get_cycle_count();
 
-void cpu_run_tests();
\ No newline at end of file
+bool cpu_run_tests();
+void cpu_run_benchmarks();
@@ -4,8 +4,9 @@
 #include "platform.h"
 #include "disassembler.h"
 
+#include <array>
 #include <limits>
-#include <vector>
+#include <utility>
 
 #define RS             "sssss"
 #define OP            RS
@@ -16,18 +17,18 @@
 #define IMM16        "iiiiiiiiiiiiiiii"
 #define TARGET        "jjjjjjjjjjjjjjjjjjjjjjjjjj"
 
-#define R4300_IMPL(type, name, encoding, format_string, ...) \
-static void cpu_##name(ExecutionContext& ctx); \
-static const EncodingDescriptorRegistrar CONCAT(_, __COUNTER__){EncodingDescriptor(type, encoding, format_string, cpu_##name)};
+// Each R4300_IMPL specialises R4300Encoding<N> with its descriptor, N counting up
+// from encoding_counter_base. The full table and its decode tree are assembled
+// from those at compile time at the bottom of this file.
+template<int N>
+struct R4300Encoding;
 
-// This should be called before main and will populate our encodings buffer
-std::vector<EncodingDescriptor> encodings;
-struct EncodingDescriptorRegistrar
-{
-    constexpr EncodingDescriptorRegistrar(EncodingDescriptor&& desc)
-    {
-        encodings.push_back(std::move(desc));
-    }
+static constexpr int encoding_counter_base = __COUNTER__ + 1;
+
+#define R4300_IMPL(type, name, encoding, format_string, ...) \
+static bool cpu_##name(ExecutionContext& ctx); \
+template<> struct R4300Encoding<__COUNTER__ - encoding_counter_base> { \
+    static constexpr EncodingDescriptor value = make_encoding<encoding>(type, format_string, cpu_##name); \
 };
 
 // taken from project64
@@ -49,9 +50,10 @@ extern bool logging_enabled;
 R4300_IMPL(InstructionType::NOP, nop,
     "00000000000000000000000000000000",
     "");
-    void cpu_nop(ExecutionContext& ctx)
+    bool cpu_nop(ExecutionContext& ctx)
     {
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::MOVE, add,
@@ -60,7 +62,7 @@ R4300_IMPL(InstructionType::MOVE, add,
 R4300_IMPL(InstructionType::ADD, add,
     "000000" RS RT RD "00000" "100000",
     "RD, RS, RT");
-    void cpu_add(ExecutionContext& ctx)
+    bool cpu_add(ExecutionContext& ctx)
     {
         auto c
                 = scast<int32_t>(ctx.rs())
@@ -68,12 +70,13 @@ R4300_IMPL(InstructionType::ADD, add,
 
         ctx.rd() = c;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::ADDU, addu,
     "000000" RS RT RD "00000" "100001",
     "RD, RS, RT");
-    void cpu_addu(ExecutionContext& ctx)
+    bool cpu_addu(ExecutionContext& ctx)
     {
         auto c
                 = scast<uint32_t>(ctx.rs())
@@ -81,12 +84,13 @@ R4300_IMPL(InstructionType::ADDU, addu,
 
         ctx.rd() = c;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::ADDI, addi,
     "001000" RS RT IMM16,
     "RT, RS, IMM");
-    void cpu_addi(ExecutionContext& ctx)
+    bool cpu_addi(ExecutionContext& ctx)
     {
         auto c
             = static_cast<int32_t>(ctx.rs())
@@ -94,12 +98,13 @@ R4300_IMPL(InstructionType::ADDI, addi,
 
         ctx.rt() = c;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::ADDIU, addiu,
     "001001" RS RT IMM16,
     "RT, RS, IMM");
-    void cpu_addiu(ExecutionContext& ctx)
+    bool cpu_addiu(ExecutionContext& ctx)
     {
         auto c
             = static_cast<uint32_t>(ctx.rs())
@@ -107,173 +112,192 @@ R4300_IMPL(InstructionType::ADDIU, addiu,
 
         ctx.rt() = c;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SUB, sub,
     "000000" RS RT RD "00000" "100010",
     "RD, RS, RT");
-    void cpu_sub(ExecutionContext& ctx)
+    bool cpu_sub(ExecutionContext& ctx)
     {
         ctx.rd() = (int32_t)ctx.rs() - (int32_t)ctx.rt();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SUBU, subu,
     "000000" RS RT RD "00000" "100011",
     "RD, RS, RT");
-    void cpu_subu(ExecutionContext& ctx)
+    bool cpu_subu(ExecutionContext& ctx)
     {
         ctx.rd() = (uint32_t)ctx.rs() - (uint32_t)ctx.rt();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::MULT, mult,
     "000000" RS RT "0000000000" "011000",
     "RS, RT");
-    void cpu_mult(ExecutionContext& ctx)
+    bool cpu_mult(ExecutionContext& ctx)
     {
         cpu.hi_lo = (int64_t)ctx.rt() * (int64_t)ctx.rs();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::MULTU, multu,
     "000000" RS RT "0000000000" "011001",
     "RS, RT");
-    void cpu_multu(ExecutionContext& ctx)
+    bool cpu_multu(ExecutionContext& ctx)
     {
         cpu.hi_lo = ctx.rt() * ctx.rs();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::DIV, div,
     "000000" RS RT "0000000000" "011010",
     "RS, RT");
-    void cpu_div(ExecutionContext& ctx)
+    bool cpu_div(ExecutionContext& ctx)
     {
         cpu.hi = (int32_t)ctx.rs() % (int32_t)ctx.rt();
         cpu.lo = (int32_t)ctx.rs() / (int32_t)ctx.rt();
 
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::DIVU, divu,
     "000000" RS RT "0000000000" "011011",
     "RS, RT");
-    void cpu_divu(ExecutionContext& ctx)
+    bool cpu_divu(ExecutionContext& ctx)
     {
         cpu.hi = (uint32_t)ctx.rs() % (uint32_t)ctx.rt();
         cpu.lo = (uint32_t)ctx.rs() / (uint32_t)ctx.rt();
 
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::AND, and,
     "000000" RS RT RD "00000" "100100",
     "RD, RS, RT");
-    void cpu_and(ExecutionContext& ctx)
+    bool cpu_and(ExecutionContext& ctx)
     {
         ctx.rd() = ctx.rs() & ctx.rt();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::ANDI, andi,
     "001100" RS RT IMM16,
     "RT, RS, IMM");
-    void cpu_andi(ExecutionContext& ctx)
+    bool cpu_andi(ExecutionContext& ctx)
     {
         ctx.rt() = ctx.rs() & ctx.imm();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::LUI, lui,
     "001111" "00000" RT IMM16,
     "RT, IMM");
-    void cpu_lui(ExecutionContext& ctx)
+    bool cpu_lui(ExecutionContext& ctx)
     {
         uint32_t imm = ctx.imm() << 16;
         ctx.rt() = imm;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::NOR, nor,
     "000000" RS RT RD "00000" "100111",
     "RD, RS, RT");
-    void cpu_nor(ExecutionContext& ctx)
+    bool cpu_nor(ExecutionContext& ctx)
     {
         ctx.rd() = ~(ctx.rs() | ctx.rt());
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::MFLO, mflo,
     "000000" "0000000000" RD "00000" "010010",
     "RD");
-    void cpu_mflo(ExecutionContext& ctx)
+    bool cpu_mflo(ExecutionContext& ctx)
     {
         ctx.rd() = cpu.lo;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::MFHI, mfhi,
     "000000" "0000000000" RD "00000" "010000",
     "RD");
-    void cpu_mfhi(ExecutionContext& ctx)
+    bool cpu_mfhi(ExecutionContext& ctx)
     {
         ctx.rd() = cpu.hi;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::MTHI, mthi,
     "000000" RS "000000000000000" "010001",
     "RS");
-    void cpu_mthi(ExecutionContext& ctx)
+    bool cpu_mthi(ExecutionContext& ctx)
     {
         cpu.hi = ctx.rs();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::MTLO, mtlo,
     "000000" RS "000000000000000" "010011",
     "RS");
-    void cpu_mtlo(ExecutionContext& ctx)
+    bool cpu_mtlo(ExecutionContext& ctx)
     {
         cpu.lo = ctx.rs();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::OR, or,
     "000000" RS RT RD "00000" "100101",
     "RD, RS, RT");
-    void cpu_or(ExecutionContext& ctx)
+    bool cpu_or(ExecutionContext& ctx)
     {
         ctx.rd() = ctx.rs() | ctx.rt();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::ORI, ori,
     "001101" RS RT IMM16,
     "RT, RS, IMM");
-    void cpu_ori(ExecutionContext& ctx)
+    bool cpu_ori(ExecutionContext& ctx)
     {
         ctx.rt() = ctx.rs() | scast<uint16_t>(ctx.imm());
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::XOR, xor,
     "000000" RS RT RD "00000" "100110",
     "RD, RS, RT");
-    void cpu_xor(ExecutionContext& ctx)
+    bool cpu_xor(ExecutionContext& ctx)
     {
         ctx.rd() = ctx.rs() ^ ctx.rt();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::XORI, xori,
     "001110" RS RT IMM16,
     "RT, RS, IMM");
-    void cpu_xori(ExecutionContext& ctx)
+    bool cpu_xori(ExecutionContext& ctx)
     {
         ctx.rt() = ctx.rs() ^ scast<uint16_t>(ctx.imm());
         cpu.pc += 4;
+        return true;
     }
 
 /**************************************************************************/
@@ -282,19 +306,20 @@ R4300_IMPL(InstructionType::XORI, xori,
 R4300_IMPL(InstructionType::JR, jr,
     "000000" RS "0000000000" "00000" "001000" ,
     "RS");
-    void cpu_jr(ExecutionContext& ctx)
+    bool cpu_jr(ExecutionContext& ctx)
     {
         branch_delay_slot_address = cpu.pc + 4;
         cpu.pc = ctx.rs();
 
         if (logging_enabled)
             printf("\tBranch taken: 0x%016llX\n", cpu.pc);
+        return true;
     }
 
 R4300_IMPL(InstructionType::J, j,
     "000010" TARGET,
     "TARGET");
-    void cpu_j(ExecutionContext& ctx)
+    bool cpu_j(ExecutionContext& ctx)
     {
         branch_delay_slot_address = cpu.pc + 4;
 
@@ -302,12 +327,13 @@ R4300_IMPL(InstructionType::J, j,
 
         if (logging_enabled)
             printf("\tBranch taken: 0x%016llX\n", cpu.pc);
+        return true;
     }
 
 R4300_IMPL(InstructionType::JAL, jal,
     "000011" TARGET,
     "TARGET");
-    void cpu_jal(ExecutionContext& ctx)
+    bool cpu_jal(ExecutionContext& ctx)
     {
         branch_delay_slot_address = cpu.pc + 4;
 
@@ -316,12 +342,13 @@ R4300_IMPL(InstructionType::JAL, jal,
 
         if (logging_enabled)
             printf("\tBranch taken: 0x%016llX\n", cpu.pc);
+        return true;
     }
 
 R4300_IMPL(InstructionType::JALR, jalr,
     "000000" RS "00000" RD "00000" "001001",
     "RD, RS");
-    void cpu_jalr(ExecutionContext& ctx)
+    bool cpu_jalr(ExecutionContext& ctx)
     {
         branch_delay_slot_address = cpu.pc + 4;
         ctx.rd() = cpu.pc;
@@ -329,12 +356,13 @@ R4300_IMPL(InstructionType::JALR, jalr,
 
         if (logging_enabled)
             printf("\tBranch taken: 0x%016llX\n", cpu.pc);
+        return true;
     }
 
 R4300_IMPL(InstructionType::BAL, bal,
     "000001" "00000" "10001" IMM16,
     "OFFSET");
-    void cpu_bal(ExecutionContext& ctx)
+    bool cpu_bal(ExecutionContext& ctx)
     {
         branch_delay_slot_address = cpu.pc + 4;
 
@@ -344,6 +372,7 @@ R4300_IMPL(InstructionType::BAL, bal,
 
         if (logging_enabled)
             printf("\tBranch taken: 0x%016llX\n", cpu.pc);
+        return true;
     }
 
 R4300_IMPL(InstructionType::B, beq,
@@ -358,7 +387,7 @@ R4300_IMPL(InstructionType::BEQL, beq,
 R4300_IMPL(InstructionType::BEQ, beq,
     "000100" RS RT IMM16,
     "RS, RT, OFFSET");
-    void cpu_beq(ExecutionContext& ctx)
+    bool cpu_beq(ExecutionContext& ctx)
     {
         if (ctx.rs() == ctx.rt())
         {
@@ -373,12 +402,13 @@ R4300_IMPL(InstructionType::BEQ, beq,
         {
             cpu.pc += 8;
         }
+        return true;
     }
 
 R4300_IMPL(InstructionType::BGTZ, bgtz,
     "000111" RS "00000" IMM16,
     "RS, OFFSET");
-    void cpu_bgtz(ExecutionContext& ctx)
+    bool cpu_bgtz(ExecutionContext& ctx)
     {
         if (ctx.rs() > 0)
         {
@@ -393,6 +423,7 @@ R4300_IMPL(InstructionType::BGTZ, bgtz,
         {
             cpu.pc += 8;
         }
+        return true;
     }
 
 R4300_IMPL(InstructionType::BNEZ, bne,
@@ -404,7 +435,7 @@ R4300_IMPL(InstructionType::BNE, bne,
 R4300_IMPL(InstructionType::BNEL, bne,
     "010101" RS RT IMM16,
     "RS, RT, OFFSET");
-    void cpu_bne(ExecutionContext& ctx)
+    bool cpu_bne(ExecutionContext& ctx)
     {
         if (ctx.rs() != ctx.rt())
         {
@@ -419,6 +450,7 @@ R4300_IMPL(InstructionType::BNEL, bne,
         {
             cpu.pc += 8;
         }
+        return true;
     }
 
 R4300_IMPL(InstructionType::BGEZ, bgez,
@@ -427,7 +459,7 @@ R4300_IMPL(InstructionType::BGEZ, bgez,
 R4300_IMPL(InstructionType::BGEZL, bgez,
     "000001" RS "00011" IMM16,
     "RS, OFFSET");
-    void cpu_bgez(ExecutionContext& ctx)
+    bool cpu_bgez(ExecutionContext& ctx)
     {
         if (int32_t(ctx.rs()) >= 0)
         {
@@ -442,6 +474,7 @@ R4300_IMPL(InstructionType::BGEZL, bgez,
         {
             cpu.pc += 8;
         }
+        return true;
     }
 
 R4300_IMPL(InstructionType::BLEZ, blezl,
@@ -450,7 +483,7 @@ R4300_IMPL(InstructionType::BLEZ, blezl,
 R4300_IMPL(InstructionType::BLEZL, blezl,
     "010110" RS "00000" IMM16,
     "RS, OFFSET");
-    void cpu_blezl(ExecutionContext& ctx)
+    bool cpu_blezl(ExecutionContext& ctx)
     {
         if (int32_t(ctx.rs()) <= 0)
         {
@@ -465,12 +498,13 @@ R4300_IMPL(InstructionType::BLEZL, blezl,
         {
             cpu.pc += 8;
         }
+        return true;
     }
 
 R4300_IMPL(InstructionType::BLTZ, bltz,
     "000001" RS "00000" IMM16,
     "RS, OFFSET");
-    void cpu_bltz(ExecutionContext& ctx)
+    bool cpu_bltz(ExecutionContext& ctx)
     {
         if (int32_t(ctx.rs()) < 0)
         {
@@ -485,6 +519,7 @@ R4300_IMPL(InstructionType::BLTZ, bltz,
         {
             cpu.pc += 8;
         }
+        return true;
     }
 /**************************************************************************/
 
@@ -495,270 +530,391 @@ R4300_IMPL(InstructionType::BLTZ, bltz,
 R4300_IMPL(InstructionType::LB, lb,
     "100000" BASE RT IMM16,
     "RT, OFFSET(RS)");
-    void cpu_lb(ExecutionContext& ctx)
+    bool cpu_lb(ExecutionContext& ctx)
     {
         uint8_t v{};
         uint32_t addr = ctx.rs() + ctx.imm();
 
         if (!memory_read8(addr, v))
-            throw MemException{"bad mem read", addr, 1 };
+            return cpu_fault("bad mem read", addr, 1);
 
         ctx.rt() = (int8_t)v;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::LBU, lbu,
     "100100" BASE RT IMM16,
     "RT, OFFSET(RS)");
-    void cpu_lbu(ExecutionContext& ctx)
+    bool cpu_lbu(ExecutionContext& ctx)
     {
         uint8_t v{};
         uint32_t addr = ctx.rs() + ctx.imm();
 
         if (!memory_read8(addr, v))
-            throw MemException{"bad mem read", addr, 1 };
+            return cpu_fault("bad mem read", addr, 1);
 
         ctx.rt() = (uint8_t)v;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::LH, lh,
     "100001" BASE RT IMM16,
     "RT, OFFSET(RS)");
-    void cpu_lh(ExecutionContext& ctx)
+    bool cpu_lh(ExecutionContext& ctx)
     {
         uint16_t v{};
         uint32_t addr = ctx.rs() + ctx.imm();
 
         if (!memory_read16(addr, v))
-            throw MemException{"bad mem read", addr, 1 };
+            return cpu_fault("bad mem read", addr, 1);
 
-        //v = bswap_16(v);
         ctx.rt() = (int16_t)v;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::LHU, lhu,
     "100101" BASE RT IMM16,
     "RT, OFFSET(RS)");
-    void cpu_lhu(ExecutionContext& ctx)
+    bool cpu_lhu(ExecutionContext& ctx)
     {
         uint16_t v{};
         uint32_t addr = ctx.rs() + ctx.imm();
 
         if (!memory_read16(addr, v))
-            throw MemException{"bad mem read", addr, 1 };
+            return cpu_fault("bad mem read", addr, 1);
 
-        //v = bswap_16(v);
         ctx.rt() = v;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::LW, lw,
     "100011" RS RT IMM16,
     "RT, OFFSET(RS)");
-    void cpu_lw(ExecutionContext& ctx)
+    bool cpu_lw(ExecutionContext& ctx)
     {
         uint32_t v{};
         uint32_t address = ctx.rs() + ctx.offset();
 
         if ((address & 3) != 0)
-            throw MemException{"lw poop", address, 4 };
+            return cpu_fault("lw poop", address, 4);
 
         if (!memory_read32(address, v))
-            throw MemException{"bad mem read", address, 4 };
+            return cpu_fault("bad mem read", address, 4);
 
-        //v = bswap_32(v);
         ctx.rt() = (int32_t)v;
 
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::LWR, lwr,
     "100110" RS RT IMM16,
     "RT, OFFSET(RS)");
-    void cpu_lwr(ExecutionContext& ctx)
+    bool cpu_lwr(ExecutionContext& ctx)
     {
-        throw nullptr;
+        return cpu_fault("LWR not implemented", uint32_t(cpu.pc), 4);
     }
 
 R4300_IMPL(InstructionType::SB, sb,
     "101000" RS RT IMM16,
     "RT, OFFSET(RS)");
-    void cpu_sb(ExecutionContext& ctx)
+    bool cpu_sb(ExecutionContext& ctx)
     {
         auto addr = ctx.rs() + ctx.offset();
         if (!memory_write8(addr, ctx.rt()))
-            throw MemException{"bad mem write", uint32_t(addr), 1 };
+            return cpu_fault("bad mem write", uint32_t(addr), 1);
 
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SH, sh,
     "101001" RS RT IMM16,
     "RT, OFFSET(RS)");
-    void cpu_sh(ExecutionContext& ctx)
+    bool cpu_sh(ExecutionContext& ctx)
     {
         auto addr = ctx.rs() + ctx.offset();
         uint16_t val = ctx.rt();
 
-        //val = bswap_16(val);
         if (!memory_write16(addr, val))
-            throw MemException{"bad mem write", uint32_t(addr), 1 };
+            return cpu_fault("bad mem write", uint32_t(addr), 1);
 
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SW, sw,
     "101011" RS RT IMM16,
     "RT, OFFSET(RS)");
-    void cpu_sw(ExecutionContext& ctx)
+    bool cpu_sw(ExecutionContext& ctx)
     {
         auto addr = ctx.rs() + ctx.offset();
         uint32_t val = ctx.rt();
 
-        //val = bswap_32(val);
-
         if (!memory_write32(addr, val))
-            throw MemException{"bad mem write", uint32_t(addr), 4};
+            return cpu_fault("bad mem write", uint32_t(addr), 4);
 
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::CACHE, cache,
     "101111" BASE OP IMM16,
     "")
-    void cpu_cache(ExecutionContext& ctx)
+    bool cpu_cache(ExecutionContext& ctx)
     {
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::MFC0, mfc0,
     "010000" "00000" RT RD "00000000" "000",
     "RT, COP_RD");
-    void cpu_mfc0(ExecutionContext& ctx)
+    bool cpu_mfc0(ExecutionContext& ctx)
     {
         cpu_get_cop0_register(ctx.rd_bits(), ctx.rt());
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::MTC0, mtc0,
     "010000" "00100" RT RD "00000000" "000",
     "RT, COP_RD");
-    void cpu_mtc0(ExecutionContext& ctx)
+    bool cpu_mtc0(ExecutionContext& ctx)
     {
         cpu_set_cop0_register(ctx.rd_bits(), ctx.rt());
         cpu.pc += 4;
+        return true;
+    }
+
+static TlbEntry cpu_get_tlb_entry()
+{
+    return {
+        uint32_t(cpu.cop0.pagemask()),
+        uint32_t(cpu.cop0.entry_hi()),
+        uint32_t(cpu.cop0.entry_lo0()),
+        uint32_t(cpu.cop0.entry_lo1()),
+    };
+}
+
+R4300_IMPL(InstructionType::TLBR, tlbr,
+    "010000" "1" "0000000000000000000" "000001",
+    "")
+    bool cpu_tlbr(ExecutionContext& ctx)
+    {
+        const auto entry = memory_tlb_read(cpu.cop0.index() & 0x3F);
+
+        // EntryHi comes back with the entry's ASID, which then applies
+        cpu.cop0.pagemask() = entry.page_mask;
+        cpu.cop0.entry_hi() = int64_t(int32_t(entry.entry_hi));
+        cpu.cop0.entry_lo0() = entry.entry_lo0;
+        cpu.cop0.entry_lo1() = entry.entry_lo1;
+        memory_tlb_set_asid(uint8_t(entry.entry_hi));
+
+        cpu.pc += 4;
+        return true;
+    }
+
+R4300_IMPL(InstructionType::TLBWI, tlbwi,
+    "010000" "1" "0000000000000000000" "000010",
+    "")
+    bool cpu_tlbwi(ExecutionContext& ctx)
+    {
+        memory_tlb_write(cpu.cop0.index() & 0x3F, cpu_get_tlb_entry());
+        cpu.pc += 4;
+        return true;
+    }
+
+R4300_IMPL(InstructionType::TLBWR, tlbwr,
+    "010000" "1" "0000000000000000000" "000110",
+    "")
+    bool cpu_tlbwr(ExecutionContext& ctx)
+    {
+        uint64_t random{};
+        cpu_get_cop0_register(1, random);
+
+        memory_tlb_write(int(random), cpu_get_tlb_entry());
+        cpu.pc += 4;
+        return true;
+    }
+
+R4300_IMPL(InstructionType::TLBP, tlbp,
+    "010000" "1" "0000000000000000000" "001000",
+    "")
+    bool cpu_tlbp(ExecutionContext& ctx)
+    {
+        const auto index = memory_tlb_probe(uint32_t(cpu.cop0.entry_hi()));
+
+        // bit 31 flags a miss, the rest of Index is then undefined
+        cpu.cop0.index() = index < 0 ? 0x80000000 : index;
+        cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::CTC1, ctc1,
     "010001" "00110" RT RD "000" "00000" "000",
     "RT, RD");
-    void cpu_ctc1(ExecutionContext& ctx)
+    bool cpu_ctc1(ExecutionContext& ctx)
     {
         ctx.fs() = float(ctx.rt() & 0xFFFFFFFF);
         cpu.pc += 4;
+        return true;
     }
 /**************************************************************************/
 
 R4300_IMPL(InstructionType::SLL, sll,
     "000000" RS RT RD SHIFT "000000",
     "RD, RT, SA");
-    void cpu_sll(ExecutionContext& ctx)
+    bool cpu_sll(ExecutionContext& ctx)
     {
         ctx.rd() = ctx.rt() << ctx.shift_bits();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SLLV, sllv,
     "000000" RS RT RD "00000" "000100",
     "RD, RT, RS");
-    void cpu_sllv(ExecutionContext& ctx)
+    bool cpu_sllv(ExecutionContext& ctx)
     {
         ctx.rd() = ctx.rt() << ctx.rs();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SRA, sra,
     "000000" "00000" RT RD SHIFT "000011",
     "RD, RT, SA");
-    void cpu_sra(ExecutionContext& ctx)
+    bool cpu_sra(ExecutionContext& ctx)
     {
         ctx.rd() = ctx.rt() >> ctx.shift_bits();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SRAV, srav,
     "000000" RS RT RD "00000" "000111",
     "RD, RT, RS");
-    void cpu_srav(ExecutionContext& ctx)
+    bool cpu_srav(ExecutionContext& ctx)
     {
         ctx.rd() = ctx.rt() >> ctx.rs();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SRL, srl,
     "000000" "00000" RT RD SHIFT "000010",
     "RD, RT, SA");
-    void cpu_srl(ExecutionContext& ctx)
+    bool cpu_srl(ExecutionContext& ctx)
     {
         uint32_t rt = ctx.rt();
         ctx.rd() = rt >> ctx.shift_bits();
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SRLV, srlv,
     "000000" RS RT RD "00000" "000110",
     "RD, RT, RS");
-    void cpu_srlv(ExecutionContext& ctx)
+    bool cpu_srlv(ExecutionContext& ctx)
     {
         uint32_t rt = ctx.rt();
         ctx.rd() = rt >> (ctx.rs() & 0x1F);
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SLT, slt,
     "000000" RS RT RD "00000" "101010",
     "RD, RS, RT");
-    void cpu_slt(ExecutionContext& ctx)
+    bool cpu_slt(ExecutionContext& ctx)
     {
         ctx.rd() = int64_t(ctx.rs()) < int64_t(ctx.rt()) ? 1 : 0;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SLTU, sltu,
     "000000" RS RT RD "00000" "101011",
     "RD, RS, RT")
-    void cpu_sltu(ExecutionContext& ctx)
+    bool cpu_sltu(ExecutionContext& ctx)
     {
         ctx.rd() = ctx.rs() < ctx.rt() ? 1 : 0;
         cpu.pc += 4;
+        return true;
     }
 
 
 R4300_IMPL(InstructionType::SLTI, slti,
     "001010" RS RT IMM16,
     "RT, RS, IMM");
-    void cpu_slti(ExecutionContext& ctx)
+    bool cpu_slti(ExecutionContext& ctx)
     {
         ctx.rt() = int64_t(ctx.rs()) < ctx.imm() ? 1 : 0;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::SLTIU, sltiu,
     "001011" RS RT IMM16,
     "RS, RT, IMM");
-    void cpu_sltiu(ExecutionContext& ctx)
+    bool cpu_sltiu(ExecutionContext& ctx)
     {
         ctx.rt() = ctx.rs() < uint16_t(ctx.imm()) ? 1 : 0;
         cpu.pc += 4;
+        return true;
     }
 
 R4300_IMPL(InstructionType::EXT, ext,
     "011111" RS RT RD SHIFT "000000",
     "RT, RS, SHIFT, RD");
-    void cpu_ext(ExecutionContext& ctx)
+    bool cpu_ext(ExecutionContext& ctx)
     {
         ctx.rt() = extract_bits<uint32_t>(ctx.rs(), ctx.shift_bits(), ctx.rd_bits());
         cpu.pc +=4;
-    }
\ No newline at end of file
+        return true;
+    }
+
+/**************************************************************************/
+// Encoding table / dispatch
+/**************************************************************************/
+static constexpr int num_encoding_entries = __COUNTER__ - encoding_counter_base;
+
+template<size_t... I>
+static consteval auto make_encoding_table(std::index_sequence<I...>)
+{
+    return std::array<EncodingDescriptor, sizeof...(I)>{ R4300Encoding<I>::value... };
+}
+
+static constexpr auto encoding_table = make_encoding_table(std::make_index_sequence<num_encoding_entries>());
+static constexpr DecodeTree encoding_decode_tree = build_decode_tree(encoding_table);
+
+extern constexpr const EncodingDescriptor* encodings = encoding_table.data();
+extern constexpr int num_encodings = num_encoding_entries;
+extern constexpr const DecodeTree* decode_tree = &encoding_decode_tree;
+
+// every handler is a compile time constant here, so the compiler can inline
+// them into the dispatch instead of calling through EncodingDescriptor::func
+template<size_t... I>
+static inline bool cpu_dispatch(int index, ExecutionContext& ctx, std::index_sequence<I...>)
+{
+    bool ok{};
+
+    // no handler: report the unknown opcode the same way handlers report faults
+    if (!((index == int(I) ? (ok = encoding_table[I].func(ctx), true) : false) || ...))
+        return cpu_unknown_opcode(ctx.opbits);
+
+    return ok;
+}
+
+bool cpu_execute(uint32_t opcode)
+{
+    ExecutionContext ctx{opcode};
+    const auto index = encoding_decode_tree.lookup(encoding_table.data(), opcode);
+
+    return cpu_dispatch(index, ctx, std::make_index_sequence<num_encoding_entries>());
+}
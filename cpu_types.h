@@ -6,6 +6,7 @@
 #include <functional>
 
 #include "instruction_types.h"
+#include "platform.h"
 
 #define INST_ENCODING_BITMASK           0xFC000000
 #define RS_ENCODING_BITMASK             0x3E00000
@@ -34,36 +35,84 @@
 #define SET_JMP_BITS(value)            (value & 0x3FFFFFF)
 #define SET_OFFSET_BITS(value)        SET_IMM_BITS(value)
 
-using cpu_func_t = void(*)(struct ExecutionContext&);
+// handlers return false when the instruction couldn't complete, after
+// recording why with cpu_fault(). The pc is left on the faulting instruction.
+using cpu_func_t = bool(*)(struct ExecutionContext&);
 
-struct MemException
+struct CpuFault
 {
     const char* message;
+
+    // data address for memory faults, the opcode for unknown opcodes
     uint32_t address;
     uint32_t size;
+
+    bool unknown_opcode;
 };
 
+// records (and reports) the fault, returns false so handlers can `return cpu_fault(...)`
+bool cpu_fault(const char* message, uint32_t address, uint32_t size);
+bool cpu_unknown_opcode(uint32_t opcode);
+
+// the most recent fault, message is nullptr when nothing has faulted
+const CpuFault& cpu_get_fault();
+
+// value is kept in host order for the callback
 template<typename T>
 struct MemoryMappedRegister
 {
+    static_assert(sizeof(T) == 4, "registers are 32 bits on the bus");
+
     T value{};
-    std::function<void(T&, bool)> rw_callback;
+    void(*rw_callback)(T&, bool);
 
-    MemoryMappedRegister(decltype(rw_callback)&& cb) :
+    MemoryMappedRegister(decltype(rw_callback) cb) :
         rw_callback(cb)
     {
     }
 
-    void read(uint32_t addr, uint32_t size, void* dst)
+    // bus handlers (see memory_make_handlers), narrower accesses see the
+    // byte lanes of the big endian register at their offset
+    template<typename U>
+    static bool read(void* ctx, uint32_t offset, U& out)
     {
-        rw_callback(value, false);
-        memcpy(dst, &value, size);
+        if constexpr (sizeof(U) > sizeof(T))
+        {
+            return false;
+        }
+        else
+        {
+            auto* reg = (MemoryMappedRegister*)ctx;
+            reg->rw_callback(reg->value, false);
+
+            out = U(reg->value >> lane_shift<U>(offset));
+            return true;
+        }
     }
 
-    void write(uint32_t addr, uint32_t size, const void* src)
+    template<typename U>
+    static bool write(void* ctx, uint32_t offset, U in)
     {
-        memcpy(&value, src, size);
-        rw_callback(value, true);
+        if constexpr (sizeof(U) > sizeof(T))
+        {
+            return false;
+        }
+        else
+        {
+            auto* reg = (MemoryMappedRegister*)ctx;
+            const auto shift = lane_shift<U>(offset);
+            const auto mask = T(U(~U{})) << shift;
+
+            reg->value = (reg->value & ~mask) | (T(in) << shift);
+            reg->rw_callback(reg->value, true);
+            return true;
+        }
+    }
+
+    template<typename U>
+    static constexpr int lane_shift(uint32_t offset)
+    {
+        return int(sizeof(T) - sizeof(U) - (offset & (sizeof(T) - sizeof(U)))) * 8;
     }
 };
 
@@ -113,7 +162,7 @@ struct CPU
         auto& index()        { return r[0]; }
         auto& random()         { return r[1]; }
         auto& entry_lo0()     { return r[2]; }
-        auto& entry_hi0()    { return r[3]; }
+        auto& entry_lo1()    { return r[3]; }
         auto& context()     { return r[4]; }
         auto& pagemask()     { return r[5]; }
         auto& wired()         { return r[6]; }
@@ -183,17 +232,39 @@ extern CPU cpu;
 extern uint64_t branch_delay_slot_address;
 void cpu_link(uint64_t);
 
+// decode and execute a single opcode, false if it is unknown or faulted (cpu_instructions.cpp)
+bool cpu_execute(uint32_t opcode);
+
 struct ExecutionContext
 {
-    const uint32_t opbits;
+    uint32_t opbits{};
+
+    // register indices and immediate are extracted once up front, so cached
+    // copies of the context (see icache.h) don't redo the shifting every run
+    uint8_t rs_index{};
+    uint8_t rt_index{};
+    uint8_t rd_index{};
+    uint8_t sa{};
+    int16_t immediate{};
+
+    constexpr ExecutionContext() = default;
+    constexpr ExecutionContext(uint32_t op) :
+        opbits(op),
+        rs_index(GET_RS_BITS(op)),
+        rt_index(GET_RT_BITS(op)),
+        rd_index(GET_RD_BITS(op)),
+        sa(GET_SHIFT_BITS(op)),
+        immediate(GET_IMM_BITS(op))
+    {
+    }
 
-    constexpr uint8_t rd_bits() const { return GET_RD_BITS(opbits); }
+    constexpr uint8_t rd_bits() const { return rd_index; }
     constexpr uint8_t fs_bits() const { return rd_bits(); }
-    constexpr uint8_t rs_bits() const { return GET_RS_BITS(opbits); }
-    constexpr uint8_t rt_bits() const { return GET_RT_BITS(opbits); }
-    constexpr uint8_t shift_bits() const { return GET_SHIFT_BITS(opbits); }
+    constexpr uint8_t rs_bits() const { return rs_index; }
+    constexpr uint8_t rt_bits() const { return rt_index; }
+    constexpr uint8_t shift_bits() const { return sa; }
 
-    constexpr int16_t imm_bits() const { return GET_IMM_BITS(opbits); }
+    constexpr int16_t imm_bits() const { return immediate; }
     constexpr int32_t jmp_bits() const { return GET_JMP_BITS(opbits); }
 
     auto& rd() { return cpu.gpr[rd_bits()]; }
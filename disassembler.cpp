@@ -3,14 +3,15 @@
 #include "cpu_types.h"
 #include "magic_enum.hpp"
 
-#include <vector>
 #include <cstring>
 
 const char* parser_get_symbolic_cop0_name(int i);
 const char* parser_get_symbolic_gpr_name(int i);
 
-// implemented in cpu_instructions.cpp
-extern std::vector<EncodingDescriptor> encodings;
+// implemented in cpu_instructions.cpp, generated at compile time
+extern const EncodingDescriptor* const encodings;
+extern const int num_encodings;
+extern const DecodeTree* const decode_tree;
 
 // string compare that is limited to the length of the second string
 constexpr bool str_find(const char* s1, const char* s2)
@@ -67,12 +68,44 @@ void disassembler_init()
     return nullptr;
 }*/
 
+bool disassembler_is_branch(InstructionType type)
+{
+    switch (type)
+    {
+        case InstructionType::B:
+        case InstructionType::BAL:
+        case InstructionType::BEQ:
+        case InstructionType::BEQZ:
+        case InstructionType::BEQL:
+        case InstructionType::BGEZ:
+        case InstructionType::BGEZL:
+        case InstructionType::BGEZAL:
+        case InstructionType::BGTZ:
+        case InstructionType::BLEZ:
+        case InstructionType::BLEZL:
+        case InstructionType::BLTZ:
+        case InstructionType::BLTZAL:
+        case InstructionType::BNEZ:
+        case InstructionType::BNEZL:
+        case InstructionType::BNE:
+        case InstructionType::BNEL:
+        case InstructionType::J:
+        case InstructionType::JAL:
+        case InstructionType::JALR:
+        case InstructionType::JR:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
 const EncodingDescriptor* disassembler_find_descriptor(InstructionType type)
 {
-    for (const auto& encoding : encodings)
+    for (int i = 0; i < num_encodings; i++)
     {
-        if (encoding.type == type)
-            return &encoding;
+        if (encodings[i].type == type)
+            return &encodings[i];
     }
 
     return nullptr;
@@ -80,10 +113,16 @@ const EncodingDescriptor* disassembler_find_descriptor(InstructionType type)
 
 const EncodingDescriptor* disassembler_decode_instruction(uint32_t opcode)
 {
-    for (const auto& encoding : encodings)
+    const auto index = decode_tree->lookup(encodings, opcode);
+    return index >= 0 ? &encodings[index] : nullptr;
+}
+
+const EncodingDescriptor* disassembler_decode_instruction_linear(uint32_t opcode)
+{
+    for (int i = 0; i < num_encodings; i++)
     {
-        if (encoding.match(opcode))
-            return &encoding;
+        if (encodings[i].match(opcode))
+            return &encodings[i];
     }
 
     return nullptr;
@@ -166,7 +205,7 @@ const char* parser_get_symbolic_cop0_name(int i)
         case 0: return "index";
         case 1: return "random";
         case 2: return "entry_lo0";
-        case 3: return "entry_hi0";
+        case 3: return "entry_lo1";
         case 4: return "context";
         case 5: return "pagemask";
         case 6: return "wired";
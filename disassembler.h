@@ -4,105 +4,224 @@
 #include "instruction_types.h"
 #include "cpu_types.h"
 
+#include <array>
 #include <cstring>
-#include "magic_enum.hpp"
+#include <iterator>
 
 struct EncodingDescriptor
 {
     InstructionType type{};
     const char* debug_format{};
-    cpu_func_t func;
-
-    uint32_t mask;
-    uint32_t value;
-
-    EncodingDescriptor() = default;
-    constexpr EncodingDescriptor(InstructionType inst, const char* descriptor, const char* debug_format_string, cpu_func_t _func) :
-        type(inst),
-        debug_format(debug_format_string),
-        func(_func),
-        mask(gen_mask(descriptor)),
-        value(gen_value(descriptor))
-    {
-        if (strlen(descriptor) != 32)
-        {
-            printf("Invalid bit count for opcode descriptor '%s'\n", magic_enum::enum_name(inst).data());
-            assert(false);
-        }
-    }
+    cpu_func_t func{};
+
+    uint32_t mask{};
+    uint32_t value{};
 
     constexpr bool match(uint32_t op) const
     {
         return (op & mask) == value;
     }
+};
+
+// opcode descriptor string ("000000sssssttttt..."), usable as a template argument
+// so malformed descriptors can be rejected with a static_assert
+template<size_t N>
+struct EncodingString
+{
+    char bits[N]{};
 
-    constexpr uint32_t gen_mask(const char* str)
+    consteval EncodingString(const char (&str)[N])
     {
-        uint32_t mask{};
-        uint32_t bit_index{31};
+        for (size_t i = 0; i < N; i++)
+            bits[i] = str[i];
+    }
 
-        while (*str)
+    consteval size_t length() const { return N - 1; }
+
+    consteval bool valid() const
+    {
+        for (size_t i = 0; i < length(); i++)
         {
-            switch (*str)
+            switch (bits[i])
             {
-                case '0':
-                case '1':
-                    mask |= 1 << bit_index;
-                    break;
-
-                case 's':
-                case 't':
-                case 'd':
-                case 'j':
-                case 'i':
-                case 'a':
+                case '0': case '1':
+                case 's': case 't': case 'd':
+                case 'j': case 'i': case 'a':
                     break;
 
                 default:
-                    printf("unknown opcode bit type '%c'\n", *str);
-                    assert(false);
-                    break;
+                    return false;
             }
-
-            str++;
-            bit_index--;
         }
 
+        return true;
+    }
+
+    consteval uint32_t mask() const
+    {
+        uint32_t mask{};
+
+        for (size_t i = 0; i < length() && i < 32; i++)
+            if (bits[i] == '0' || bits[i] == '1')
+                mask |= 1u << (31 - i);
+
         return mask;
     }
 
-    constexpr uint32_t gen_value(const char* str)
+    consteval uint32_t value() const
     {
         uint32_t value{};
-        uint32_t bit_index{31};
 
-        while (*str)
-        {
-            switch (*str)
-            {
-                case '0':
-                    break;
+        for (size_t i = 0; i < length() && i < 32; i++)
+            if (bits[i] == '1')
+                value |= 1u << (31 - i);
 
-                case '1':
-                    value |= 1 << bit_index;
-                    break;
+        return value;
+    }
+};
 
-                default:
-                    break;
-            }
+template<EncodingString Encoding>
+consteval EncodingDescriptor make_encoding(InstructionType type, const char* debug_format, cpu_func_t func)
+{
+    static_assert(Encoding.length() == 32, "Invalid bit count for opcode descriptor");
+    static_assert(Encoding.valid(), "Unknown opcode bit type in opcode descriptor");
+
+    return { type, debug_format, func, Encoding.mask(), Encoding.value() };
+}
+
+// Multi-level decode table: the primary opcode selects either a slot directly
+// or a SPECIAL/REGIMM/COPz sub table keyed on the function/rt/rs field.
+// Each slot lists (in registration order) the descriptors that can match an
+// opcode landing in it, so the first-match semantics of a linear scan are kept.
+struct DecodeSlot
+{
+    uint16_t first{};
+    uint8_t count{};
+
+    // single candidate whose fixed bits are fully covered by the slot key
+    bool exact{};
+};
+
+struct DecodeTable
+{
+    uint8_t shift{};
+    uint8_t mask{};
+    DecodeSlot slots[64]{};
+};
+
+struct DecodeTree
+{
+    static constexpr int max_candidates = 512;
+
+    DecodeSlot primary[64]{};
+    int8_t primary_subtable[64]{};
+    DecodeTable subtables[5]{};
+
+    // indices into the encoding table
+    uint8_t candidates[max_candidates]{};
+    int num_candidates{};
+
+    // returns the encoding index, or -1 for an unknown opcode
+    constexpr int lookup(const EncodingDescriptor* encodings, uint32_t opcode) const
+    {
+        const auto op = GET_INST_BITS(opcode);
+        const auto sub = primary_subtable[op];
+
+        const auto& slot = sub >= 0
+            ? subtables[sub].slots[(opcode >> subtables[sub].shift) & subtables[sub].mask]
+            : primary[op];
+
+        const auto* c = candidates + slot.first;
+
+        if (slot.exact)
+            return c[0];
 
-            str++;
-            bit_index--;
+        for (int i = 0; i < slot.count; i++)
+        {
+            if (encodings[c[i]].match(opcode))
+                return c[i];
         }
 
-        return value;
+        return -1;
     }
 };
 
+template<size_t N>
+consteval DecodeTree build_decode_tree(const std::array<EncodingDescriptor, N>& encodings)
+{
+    static_assert(N < 256, "encoding indices are stored as uint8_t");
+
+    struct SubTableDesc { uint8_t opcode, shift, mask; };
+
+    constexpr SubTableDesc subtable_descs[] = {
+        { 0x00, 0,  0x3F },     // SPECIAL  -> function
+        { 0x01, 16, 0x1F },     // REGIMM   -> rt
+        { 0x10, 21, 0x1F },     // COP0     -> rs
+        { 0x11, 21, 0x1F },     // COP1     -> rs
+        { 0x12, 21, 0x1F },     // COP2     -> rs
+    };
+
+    DecodeTree tree{};
+
+    auto build_slot = [&](DecodeSlot& slot, uint32_t key_mask, uint32_t key_value)
+    {
+        slot.first = tree.num_candidates;
+
+        for (size_t i = 0; i < N; i++)
+        {
+            const auto& encoding = encodings[i];
+
+            if ((encoding.mask & key_mask & (encoding.value ^ key_value)) != 0)
+                continue;
+
+            if (tree.num_candidates == DecodeTree::max_candidates)
+                throw "DecodeTree::max_candidates is too small";
+
+            tree.candidates[tree.num_candidates++] = i;
+        }
+
+        slot.count = tree.num_candidates - slot.first;
+        slot.exact = slot.count == 1 && (encodings[tree.candidates[slot.first]].mask & ~key_mask) == 0;
+    };
+
+    for (auto& sub : tree.primary_subtable)
+        sub = -1;
+
+    for (size_t i = 0; i < std::size(subtable_descs); i++)
+    {
+        const auto& desc = subtable_descs[i];
+        auto& table = tree.subtables[i];
+
+        table.shift = desc.shift;
+        table.mask = desc.mask;
+
+        const uint32_t key_mask = INST_ENCODING_BITMASK | (uint32_t(desc.mask) << desc.shift);
+
+        for (uint32_t field = 0; field <= desc.mask; field++)
+            build_slot(table.slots[field], key_mask, SET_INST_BITS(desc.opcode) | (field << desc.shift));
+
+        tree.primary_subtable[desc.opcode] = i;
+    }
+
+    for (uint32_t op = 0; op < 64; op++)
+    {
+        if (tree.primary_subtable[op] < 0)
+            build_slot(tree.primary[op], INST_ENCODING_BITMASK, SET_INST_BITS(op));
+    }
+
+    return tree;
+}
+
 void disassembler_init();
 
+// branches and jumps, i.e. instructions followed by a delay slot
+bool disassembler_is_branch(InstructionType type);
+
 const EncodingDescriptor* disassembler_find_descriptor(InstructionType type);
 const EncodingDescriptor* disassembler_decode_instruction(uint32_t opcode);
 
+// reference decoder, walks every registered encoding in order
+const EncodingDescriptor* disassembler_decode_instruction_linear(uint32_t opcode);
+
 // dissasemble a single instruction into text form using symbolic register names
 bool disassembler_parse_instruction(uint32_t opcode, const EncodingDescriptor* desc, char* dst_buf, int);
\ No newline at end of file
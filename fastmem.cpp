@@ -0,0 +1,284 @@
+#include "fastmem.h"
+
+#include "platform.h"
+
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define FASTMEM_X64 1
+#include <signal.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#else
+#define FASTMEM_X64 0
+#endif
+
+#define FASTMEM_WINDOW_SIZE         (1ull << 32)
+#define FASTMEM_PAGE_SIZE           KB(4)
+
+// Implemented in memory.cpp, the bus without fastmem
+bool memory_read_paged(uint32_t address, uint32_t size, void* data);
+
+// a buffer moved into shared memory, it keeps its backing once moved so it
+// can be mapped in and out of the window without copying again
+struct FastmemBacking
+{
+    uint8_t* buffer;
+    uint32_t size;
+    int fd;
+};
+
+// a buffer's views in the window
+struct FastmemRegion
+{
+    uint32_t physical_address;
+    uint32_t size;
+};
+
+// physical, KSEG0 and KSEG1. USEG isn't translated yet so it shares the
+// physical view, KSSEG and KSEG3 go through the TLB and always fault.
+static constexpr uint32_t segment_bases[] = { 0x00000000, 0x80000000, 0xA0000000 };
+
+static uint8_t* window{};
+static std::vector<FastmemBacking> backings;
+static std::vector<FastmemRegion> regions;
+
+#if FASTMEM_X64
+// Loads from the window only ever happen in these stubs (rdi = host address,
+// rsi = destination), so a fault can only come from a handful of known
+// instructions. The handler finishes the access on the bus, sets eax to the
+// result and resumes at the ret.
+extern "C"
+{
+    bool fastmem_load8(const uint8_t* host, void* dst);
+    bool fastmem_load16(const uint8_t* host, void* dst);
+    bool fastmem_load32(const uint8_t* host, void* dst);
+    bool fastmem_load64(const uint8_t* host, void* dst);
+
+    extern const uint8_t fastmem_load8_fault[], fastmem_load8_resume[];
+    extern const uint8_t fastmem_load16_fault[], fastmem_load16_resume[];
+    extern const uint8_t fastmem_load32_fault[], fastmem_load32_resume[];
+    extern const uint8_t fastmem_load64_fault[], fastmem_load64_resume[];
+}
+
+#define FASTMEM_LOAD_STUB(name, load, store) \
+    "    .p2align 4\n" \
+    "    .globl " #name "\n" \
+    "    .globl " #name "_fault\n" \
+    "    .globl " #name "_resume\n" \
+    #name ":\n" \
+    #name "_fault:\n" \
+    "    " load "\n" \
+    "    " store "\n" \
+    "    movl $1, %eax\n" \
+    #name "_resume:\n" \
+    "    ret\n"
+
+asm(
+    "    .text\n"
+    FASTMEM_LOAD_STUB(fastmem_load8,  "movzbl (%rdi), %eax", "movb %al, (%rsi)")
+    FASTMEM_LOAD_STUB(fastmem_load16, "movzwl (%rdi), %eax", "movw %ax, (%rsi)")
+    FASTMEM_LOAD_STUB(fastmem_load32, "movl (%rdi), %eax",   "movl %eax, (%rsi)")
+    FASTMEM_LOAD_STUB(fastmem_load64, "movq (%rdi), %rax",   "movq %rax, (%rsi)")
+);
+
+struct FaultSite
+{
+    const uint8_t* fault;
+    const uint8_t* resume;
+    uint32_t size;
+};
+
+static const FaultSite fault_sites[] = {
+    { fastmem_load8_fault, fastmem_load8_resume, 1 },
+    { fastmem_load16_fault, fastmem_load16_resume, 2 },
+    { fastmem_load32_fault, fastmem_load32_resume, 4 },
+    { fastmem_load64_fault, fastmem_load64_resume, 8 },
+};
+
+static struct sigaction previous_action{};
+
+static void fastmem_fault_handler(int signal, siginfo_t* info, void* raw_context)
+{
+    auto& regs = ((ucontext_t*)raw_context)->uc_mcontext.gregs;
+    const auto* rip = (const uint8_t*)regs[REG_RIP];
+
+    for (const auto& site : fault_sites)
+    {
+        if (rip != site.fault)
+            continue;
+
+        const auto address = uint32_t((const uint8_t*)regs[REG_RDI] - window);
+
+        regs[REG_RAX] = memory_read_paged(address, site.size, (void*)regs[REG_RSI]);
+        regs[REG_RIP] = (greg_t)site.resume;
+        return;
+    }
+
+    // not ours, pass it down (the cartridge converts its pages on faults). A
+    // default action can only happen with the handler out of the way, the
+    // instruction then faults again.
+    if (previous_action.sa_flags & SA_SIGINFO)
+        previous_action.sa_sigaction(signal, info, raw_context);
+    else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN)
+        previous_action.sa_handler(signal);
+    else
+        sigaction(SIGSEGV, &previous_action, nullptr);
+}
+
+static bool fastmem_map_views(const FastmemBacking& backing, uint32_t physical_address)
+{
+    for (auto base : segment_bases)
+    {
+        const uint64_t address = uint64_t(base) + physical_address;
+
+        // only the low 512 MB has KSEG0/KSEG1 mirrors
+        if (base && uint64_t(physical_address) + backing.size > 0x20000000)
+            continue;
+
+        if (mmap(window + address, backing.size, PROT_READ, MAP_SHARED | MAP_FIXED, backing.fd, 0) == MAP_FAILED)
+            return false;
+    }
+
+    return true;
+}
+
+static void fastmem_unmap_views(const FastmemRegion& region)
+{
+    for (auto base : segment_bases)
+    {
+        const uint64_t address = uint64_t(base) + region.physical_address;
+
+        if (base && uint64_t(region.physical_address) + region.size > 0x20000000)
+            continue;
+
+        mmap(window + address, region.size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    }
+}
+
+static const FastmemBacking* fastmem_get_backing(uint8_t* buffer, uint32_t size)
+{
+    for (const auto& backing : backings)
+    {
+        if (backing.buffer == buffer)
+            return backing.size == size ? &backing : nullptr;
+    }
+
+    const int fd = memfd_create("ultra-fastmem", MFD_CLOEXEC);
+
+    if (fd < 0)
+        return nullptr;
+
+    // the shared memory replaces the buffer's pages in place, so everything
+    // already pointing at the buffer keeps working
+    if (ftruncate(fd, size) != 0
+        || pwrite(fd, buffer, size, 0) != ssize_t(size)
+        || mmap(buffer, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    backings.push_back({ buffer, size, fd });
+    return &backings.back();
+}
+#endif
+
+bool fastmem_is_supported()
+{
+    return FASTMEM_X64;
+}
+
+bool fastmem_init()
+{
+#if FASTMEM_X64
+    if (window)
+        return true;
+
+    void* base = mmap(nullptr, FASTMEM_WINDOW_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (base == MAP_FAILED)
+        return false;
+
+    struct sigaction action{};
+    action.sa_sigaction = fastmem_fault_handler;
+    // SA_NODEFER: finishing an access on the bus can fault again, on a
+    // cartridge page that hasn't been converted yet
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGSEGV, &action, &previous_action) != 0)
+    {
+        munmap(base, FASTMEM_WINDOW_SIZE);
+        return false;
+    }
+
+    window = (uint8_t*)base;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool fastmem_map(uint32_t physical_address, uint32_t size, uint8_t* buffer)
+{
+#if FASTMEM_X64
+    if (!window || size == 0 || ((uintptr_t(buffer) | physical_address | size) & (FASTMEM_PAGE_SIZE - 1)))
+        return false;
+
+    const auto* backing = fastmem_get_backing(buffer, size);
+
+    if (!backing)
+        return false;
+
+    if (!fastmem_map_views(*backing, physical_address))
+    {
+        fastmem_unmap_views({ physical_address, size });
+        return false;
+    }
+
+    regions.push_back({ physical_address, size });
+    return true;
+#else
+    return false;
+#endif
+}
+
+void fastmem_unmap_all()
+{
+#if FASTMEM_X64
+    for (const auto& region : regions)
+        fastmem_unmap_views(region);
+#endif
+
+    regions.clear();
+}
+
+bool fastmem_is_mapped(uint32_t physical_address)
+{
+    for (const auto& region : regions)
+    {
+        if (physical_address - region.physical_address < region.size)
+            return true;
+    }
+
+    return false;
+}
+
+bool fastmem_read(uint32_t address, uint32_t size, void* data)
+{
+#if FASTMEM_X64
+    const auto* host = window + address;
+
+    switch (size)
+    {
+        case 1: return fastmem_load8(host, data);
+        case 2: return fastmem_load16(host, data);
+        case 4: return fastmem_load32(host, data);
+        case 8: return fastmem_load64(host, data);
+    }
+#endif
+
+    return memory_read_paged(address, size, data);
+}
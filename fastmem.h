@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+// Host virtual memory fastmem (Linux x86-64 only).
+//
+// A 4 GB range of host address space stands in for the guest's 32 bit
+// address space. Plain memory is backed by shared memory and mapped read only
+// into it at its physical address and again at its KSEG0 and KSEG1 mirrors,
+// so a guest load is one host load from base + address. Everything else is
+// left PROT_NONE: the SIGSEGV handler catches loads that land there (MMIO,
+// TLB mapped segments) and emulates them through the regular memory bus.
+//
+// Only loads use the window. Stores keep going through the page table, they
+// have to report to dirty tracking and the icache.
+
+// reserves the window and installs the fault handler, false if the host
+// can't do it. Safe to call again once it's up.
+bool fastmem_init();
+bool fastmem_is_supported();
+
+// moves a page aligned host buffer into shared memory (its address and
+// contents stay the same) and maps it into the window. False if the buffer
+// can't be mapped, it's then left on the page table.
+bool fastmem_map(uint32_t physical_address, uint32_t size, uint8_t* buffer);
+
+// takes every buffer back out of the window
+void fastmem_unmap_all();
+
+// whether a buffer covering this physical address is mapped into the window
+bool fastmem_is_mapped(uint32_t physical_address);
+
+// loads `size` (1, 2, 4 or 8) raw bytes from a guest virtual address, falling
+// back to the memory bus for anything not mapped. fastmem_init() first.
+bool fastmem_read(uint32_t address, uint32_t size, void* data);
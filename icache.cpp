@@ -0,0 +1,140 @@
+#include "icache.h"
+
+#include "memory.h"
+#include "platform.h"
+#include "disassembler.h"
+
+#include <iterator>
+
+struct CachedPage
+{
+    bool valid;
+    CachedInstruction instructions[ICACHE_PAGE_INSTRUCTIONS];
+};
+
+// one slot per 4 KB page of the 512 MB physical address space
+static constexpr uint32_t num_pages = 0x20000000 >> ICACHE_PAGE_SHIFT;
+static CachedPage* pages[num_pages]{};
+static uint64_t invalidation_count{};
+static void(*invalidation_listener)(uint32_t){};
+
+// physical ranges backed by plain memory, anything else is MMIO and is
+// fetched through the bus on every step
+struct CacheableRange
+{
+    uint32_t begin;
+    uint32_t end;
+};
+
+static constexpr CacheableRange cacheable_ranges[] = {
+    { 0x00000000, 0x007FFFFF },     // RDRAM
+    { 0x04000000, 0x04001FFF },     // RSP DMEM/IMEM
+    { 0x10000000, 0x1FBFFFFF },     // Cartridge ROM
+};
+
+static bool icache_is_cacheable(uint32_t physical_address)
+{
+    for (const auto& range : cacheable_ranges)
+    {
+        if (physical_address >= range.begin && physical_address <= range.end)
+            return true;
+    }
+
+    return false;
+}
+
+static bool icache_fill_page(CachedPage* page, uint32_t page_address)
+{
+    // a whole page of reads would drown out a trace, and aren't data reads
+    // for watchpoints either
+    const bool logging = memory_logging_enabled();
+    const bool watch_hit = memory_get_watchpoint_hit();
+    memory_enable_logging(false);
+
+    for (uint32_t i = 0; i < ICACHE_PAGE_INSTRUCTIONS; i++)
+    {
+        uint32_t opcode{};
+
+        if (!memory_read32(page_address + i * 4, opcode))
+        {
+            memory_enable_logging(logging);
+
+            if (!watch_hit)
+                memory_clear_watchpoint_hit();
+
+            return false;
+        }
+
+        const auto* desc = disassembler_decode_instruction(opcode);
+
+        page->instructions[i].func = desc ? desc->func : nullptr;
+        page->instructions[i].ctx = ExecutionContext{opcode};
+    }
+
+    memory_enable_logging(logging);
+
+    if (!watch_hit)
+        memory_clear_watchpoint_hit();
+
+    page->valid = true;
+    return true;
+}
+
+void icache_init()
+{
+    for (auto& page : pages)
+    {
+        if (page)
+            page->valid = false;
+    }
+}
+
+const CachedInstruction* icache_lookup(uint32_t physical_address)
+{
+    const auto index = (physical_address >> ICACHE_PAGE_SHIFT) & (num_pages - 1);
+    auto* page = pages[index];
+
+    if (!page || !page->valid)
+    {
+        if (!icache_is_cacheable(physical_address))
+            return nullptr;
+
+        if (!page)
+            page = pages[index] = new CachedPage{};
+
+        if (!icache_fill_page(page, index << ICACHE_PAGE_SHIFT))
+            return nullptr;
+    }
+
+    return &page->instructions[(physical_address & (ICACHE_PAGE_SIZE - 1)) >> 2];
+}
+
+void icache_invalidate(uint32_t physical_address, uint32_t size)
+{
+    const auto first = (physical_address >> ICACHE_PAGE_SHIFT) & (num_pages - 1);
+    const auto last = ((physical_address + size - 1) >> ICACHE_PAGE_SHIFT) & (num_pages - 1);
+
+    for (auto index = first; index <= last; index++)
+    {
+        auto* page = pages[index];
+
+        if (page && page->valid)
+        {
+            page->valid = false;
+            invalidation_count++;
+
+            if (invalidation_listener)
+                invalidation_listener(index << ICACHE_PAGE_SHIFT);
+        }
+    }
+}
+
+void icache_set_invalidation_listener(void(*listener)(uint32_t page_address))
+{
+    invalidation_listener = listener;
+}
+
+uint64_t icache_get_invalidation_count()
+{
+    return invalidation_count;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+#include "cpu_types.h"
+
+#define ICACHE_PAGE_SHIFT           12
+#define ICACHE_PAGE_SIZE            (1 << ICACHE_PAGE_SHIFT)
+#define ICACHE_PAGE_INSTRUCTIONS    (ICACHE_PAGE_SIZE / 4)
+
+// An opcode decoded once, with its handler and the fields pulled out of it
+struct CachedInstruction
+{
+    // nullptr for an unknown opcode
+    cpu_func_t func;
+    ExecutionContext ctx;
+};
+
+void icache_init();
+
+// predecoded instruction at a physical address, decoding the whole 4 KB page on
+// a miss. Returns nullptr for addresses that aren't plain memory (MMIO etc),
+// those have to be fetched through the memory bus every time.
+const CachedInstruction* icache_lookup(uint32_t physical_address);
+
+// drop any decoded pages overlapping a write to guest memory
+void icache_invalidate(uint32_t physical_address, uint32_t size);
+
+// called with the page address whenever a decoded page is thrown away, so
+// anything built from its instructions (blocks) can be dropped too
+void icache_set_invalidation_listener(void(*listener)(uint32_t page_address));
+
+// decoded pages that had to be thrown away because their memory was written
+uint64_t icache_get_invalidation_count();
@@ -22,6 +22,7 @@ enum class InstructionType : unsigned char
     Break,
     J, JAL, JALR, JR,
     MFC0, MTC0,
+    TLBR, TLBWI, TLBWR, TLBP,
     CTC1,
     CACHE,
     SYSCALL,
@@ -0,0 +1,516 @@
+#include "jit.h"
+
+#include "cpu_types.h"
+#include "disassembler.h"
+
+#include <cstddef>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_X64 1
+#include <sys/mman.h>
+#else
+#define JIT_X64 0
+#endif
+
+#define JIT_CODE_BUFFER_SIZE        MB(32)
+
+struct JitBlock
+{
+    jit_block_fn code;
+
+    // BasicBlock::id the code was generated from
+    uint64_t source_id;
+};
+
+static std::unordered_map<uint64_t, JitBlock> jit_blocks;
+static uint64_t compile_count{};
+static uint64_t flush_count{};
+
+/**************************************************************************/
+// Code buffer
+/**************************************************************************/
+struct CodeBuffer
+{
+    uint8_t* base;
+    size_t size;
+    size_t used;
+
+    void* alloc(size_t bytes, size_t alignment)
+    {
+        const auto offset = (used + alignment - 1) & ~(alignment - 1);
+
+        if (!base || offset + bytes > size)
+            return nullptr;
+
+        used = offset + bytes;
+        return base + offset;
+    }
+};
+
+static CodeBuffer code_buffer{};
+
+static void jit_flush()
+{
+    jit_blocks.clear();
+    code_buffer.used = 0;
+    flush_count++;
+}
+
+#if JIT_X64
+/**************************************************************************/
+// x86-64 emitter
+/**************************************************************************/
+// Guest registers are accessed through rbx = &cpu and r12 = &branch_delay_slot_address,
+// rax is scratch. Everything else is left to the handlers we call.
+struct Emitter
+{
+    std::vector<uint8_t> code;
+
+    void u8(uint8_t v) { code.push_back(v); }
+    void u32(uint32_t v) { for (int i = 0; i < 4; i++) u8(v >> (i * 8)); }
+    void u64(uint64_t v) { for (int i = 0; i < 8; i++) u8(v >> (i * 8)); }
+
+    // <op> r/m, reg with rm = [rbx + disp32], reg = rax/eax
+    void rbx_mem(uint8_t opcode, bool wide, int32_t disp, uint8_t reg = 0)
+    {
+        if (wide)
+            u8(0x48);
+
+        u8(opcode);
+        u8(0x83 | (reg << 3));
+        u32(disp);
+    }
+
+    void load64(int32_t disp)           { rbx_mem(0x8B, true, disp); }      // mov rax, [rbx+disp]
+    void load32(int32_t disp)           { rbx_mem(0x8B, false, disp); }     // mov eax, [rbx+disp]
+    void store64(int32_t disp)          { rbx_mem(0x89, true, disp); }      // mov [rbx+disp], rax
+    void store32(int32_t disp)          { rbx_mem(0x89, false, disp); }     // mov [rbx+disp], eax
+
+    // add/or/and/sub/xor/cmp rax|eax, [rbx+disp]
+    void alu_mem(uint8_t opcode, bool wide, int32_t disp) { rbx_mem(opcode, wide, disp); }
+
+    // 81 /ext rax|eax, imm32
+    void alu_imm(uint8_t ext, bool wide, int32_t imm)
+    {
+        if (wide)
+            u8(0x48);
+
+        u8(0x81);
+        u8(0xC0 | (ext << 3));
+        u32(imm);
+    }
+
+    // mov qword [rbx+disp], imm32 (sign extended)
+    void store_imm64(int32_t disp, int32_t imm)
+    {
+        rbx_mem(0xC7, true, disp);
+        u32(imm);
+    }
+
+    // add/sub qword [rbx+disp], imm32
+    void add_mem_imm64(int32_t disp, int32_t imm)
+    {
+        rbx_mem(0x81, true, disp, imm < 0 ? 5 : 0);
+        u32(imm < 0 ? -imm : imm);
+    }
+
+    void mov_eax_imm(uint32_t imm)      { u8(0xB8); u32(imm); }
+    void movsxd_rax_eax()               { u8(0x48); u8(0x63); u8(0xC0); }
+    void not_rax()                      { u8(0x48); u8(0xF7); u8(0xD0); }
+    void shl_rax(uint8_t sa)            { u8(0x48); u8(0xC1); u8(0xE0); u8(sa); }
+    void shr_rax(uint8_t sa)            { u8(0x48); u8(0xC1); u8(0xE8); u8(sa); }
+    void shr_eax(uint8_t sa)            { u8(0xC1); u8(0xE8); u8(sa); }
+
+    // setcc al; movzx eax, al
+    void setcc_rax(uint8_t cc)          { u8(0x0F); u8(0x90 | cc); u8(0xC0); u8(0x0F); u8(0xB6); u8(0xC0); }
+
+    void movabs(uint8_t reg, uint64_t imm)
+    {
+        u8(reg >= 8 ? 0x49 : 0x48);
+        u8(0xB8 | (reg & 7));
+        u64(imm);
+    }
+
+    void call_rax()                     { u8(0xFF); u8(0xD0); }
+    void test_al()                      { u8(0x84); u8(0xC0); }
+
+    // cmp qword [r12], 0 / mov qword [r12], 0
+    void cmp_delay_slot_zero()          { u8(0x49); u8(0x83); u8(0x3C); u8(0x24); u8(0x00); }
+    void clear_delay_slot()             { u8(0x49); u8(0xC7); u8(0x04); u8(0x24); u32(0); }
+
+    // jz/jmp rel32, returns the offset of the rel32 to patch
+    size_t jz()                         { u8(0x0F); u8(0x84); u32(0); return code.size() - 4; }
+    size_t jmp()                        { u8(0xE9); u32(0); return code.size() - 4; }
+
+    void patch(size_t at, size_t target)
+    {
+        const int32_t rel = int32_t(target) - int32_t(at + 4);
+        memcpy(&code[at], &rel, 4);
+    }
+};
+
+enum : uint8_t { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+enum : uint8_t { CC_B = 0x2, CC_L = 0xC };
+enum : uint8_t { REG_RAX = 0, REG_RBX = 3, REG_RDI = 7, REG_R12 = 12 };
+
+static constexpr int32_t gpr_offset(int index) { return offsetof(CPU, gpr) + index * 8; }
+static constexpr int32_t pc_offset = offsetof(CPU, pc);
+static constexpr int32_t lo_offset = offsetof(CPU, hi_lo);
+static constexpr int32_t hi_offset = offsetof(CPU, hi_lo) + 4;
+
+// Emit host code doing exactly what the handler for this instruction does,
+// false if it isn't one we recompile.
+static bool jit_emit_native(Emitter& e, InstructionType type, const ExecutionContext& ctx)
+{
+    const auto rs = gpr_offset(ctx.rs_bits());
+    const auto rt = gpr_offset(ctx.rt_bits());
+    const auto rd = gpr_offset(ctx.rd_bits());
+    const int32_t imm = ctx.imm();
+
+    switch (type)
+    {
+        case InstructionType::NOP:
+            return true;
+
+        case InstructionType::LUI:
+            e.mov_eax_imm(uint32_t(imm << 16));
+            e.store64(rt);
+            return true;
+
+        case InstructionType::ORI:
+        case InstructionType::XORI:
+            e.load64(rs);
+            e.alu_imm(type == InstructionType::ORI ? ALU_OR : ALU_XOR, true, uint16_t(imm));
+            e.store64(rt);
+            return true;
+
+        case InstructionType::ANDI:
+            e.load64(rs);
+            e.alu_imm(ALU_AND, true, imm);
+            e.store64(rt);
+            return true;
+
+        case InstructionType::ADDIU:
+        case InstructionType::ADDI:
+            e.load32(rs);
+            e.alu_imm(ALU_ADD, false, imm);
+            if (type == InstructionType::ADDI)
+                e.movsxd_rax_eax();
+            e.store64(rt);
+            return true;
+
+        case InstructionType::ADDU:
+        case InstructionType::SUBU:
+        case InstructionType::ADD:
+        case InstructionType::SUB:
+        case InstructionType::MOVE:
+        {
+            const bool sub = type == InstructionType::SUB || type == InstructionType::SUBU;
+            const bool sign_extend = type == InstructionType::ADD || type == InstructionType::SUB || type == InstructionType::MOVE;
+
+            e.load32(rs);
+            e.alu_mem(sub ? 0x2B : 0x03, false, rt);
+            if (sign_extend)
+                e.movsxd_rax_eax();
+            e.store64(rd);
+            return true;
+        }
+
+        case InstructionType::AND:
+        case InstructionType::OR:
+        case InstructionType::XOR:
+        case InstructionType::NOR:
+        {
+            const uint8_t opcode =
+                type == InstructionType::AND ? 0x23 :
+                type == InstructionType::XOR ? 0x33 : 0x0B;
+
+            e.load64(rs);
+            e.alu_mem(opcode, true, rt);
+            if (type == InstructionType::NOR)
+                e.not_rax();
+            e.store64(rd);
+            return true;
+        }
+
+        case InstructionType::SLL:
+        case InstructionType::SRA:
+            // both operate on the full 64 bit register in the interpreter
+            e.load64(rt);
+            if (type == InstructionType::SLL)
+                e.shl_rax(ctx.shift_bits());
+            else
+                e.shr_rax(ctx.shift_bits());
+            e.store64(rd);
+            return true;
+
+        case InstructionType::SRL:
+            e.load32(rt);
+            e.shr_eax(ctx.shift_bits());
+            e.store64(rd);
+            return true;
+
+        case InstructionType::SLT:
+        case InstructionType::SLTU:
+            e.load64(rs);
+            e.alu_mem(0x3B, true, rt);
+            e.setcc_rax(type == InstructionType::SLT ? CC_L : CC_B);
+            e.store64(rd);
+            return true;
+
+        case InstructionType::SLTI:
+        case InstructionType::SLTIU:
+            e.load64(rs);
+            e.alu_imm(ALU_CMP, true, type == InstructionType::SLTI ? imm : uint16_t(imm));
+            e.setcc_rax(type == InstructionType::SLTI ? CC_L : CC_B);
+            e.store64(rt);
+            return true;
+
+        case InstructionType::MFHI:
+        case InstructionType::MFLO:
+            e.load32(type == InstructionType::MFHI ? hi_offset : lo_offset);
+            e.store64(rd);
+            return true;
+
+        case InstructionType::MTHI:
+        case InstructionType::MTLO:
+            e.load32(rs);
+            e.store32(type == InstructionType::MTHI ? hi_offset : lo_offset);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// which register a natively emitted instruction writes, so we know when r0 needs resetting
+static bool jit_writes_r0(InstructionType type, const ExecutionContext& ctx)
+{
+    switch (type)
+    {
+        case InstructionType::NOP:
+        case InstructionType::MTHI:
+        case InstructionType::MTLO:
+            return false;
+
+        case InstructionType::LUI:
+        case InstructionType::ORI:
+        case InstructionType::XORI:
+        case InstructionType::ANDI:
+        case InstructionType::ADDIU:
+        case InstructionType::ADDI:
+        case InstructionType::SLTI:
+        case InstructionType::SLTIU:
+            return ctx.rt_bits() == 0;
+
+        default:
+            return ctx.rd_bits() == 0;
+    }
+}
+
+static jit_block_fn jit_compile(const BasicBlock& block)
+{
+    const int count = block.instructions.size();
+
+    // the contexts handed to fallback handlers live alongside the code
+    auto* contexts = (ExecutionContext*)code_buffer.alloc(count * sizeof(ExecutionContext), alignof(ExecutionContext));
+
+    if (!contexts)
+        return nullptr;
+
+    for (int i = 0; i < count; i++)
+        contexts[i] = block.instructions[i].ctx;
+
+    Emitter e;
+    std::vector<size_t> exits;
+    int32_t pending_pc{};
+    bool reset_r0{true};
+
+    // prologue, keeps the stack 16 byte aligned for the handler calls
+    e.u8(0x53);                                 // push rbx
+    e.u8(0x41); e.u8(0x54);                     // push r12
+    e.u8(0x48); e.u8(0x83); e.u8(0xEC); e.u8(8);// sub rsp, 8
+    e.movabs(REG_RBX, (uint64_t)&cpu);
+    e.movabs(REG_R12, (uint64_t)&branch_delay_slot_address);
+
+    auto flush_pc = [&]()
+    {
+        if (pending_pc)
+            e.add_mem_imm64(pc_offset, pending_pc);
+
+        pending_pc = 0;
+    };
+
+    // leave with `retired` instructions executed
+    auto emit_exit = [&](uint32_t retired)
+    {
+        flush_pc();
+        e.mov_eax_imm(retired);
+        exits.push_back(e.jmp());
+    };
+
+    auto emit_instruction = [&](int i)
+    {
+        const auto& instruction = block.instructions[i];
+        const auto* desc = disassembler_decode_instruction(instruction.ctx.opbits);
+
+        // same as cpu_step, r0 is forced back to 0 before every instruction
+        if (reset_r0)
+            e.store_imm64(gpr_offset(0), 0);
+
+        if (jit_emit_native(e, desc->type, instruction.ctx))
+        {
+            pending_pc += 4;
+            reset_r0 = jit_writes_r0(desc->type, instruction.ctx);
+            return;
+        }
+
+        // fall back to the interpreter handler, which owns the pc from here
+        flush_pc();
+        e.movabs(REG_RDI, (uint64_t)&contexts[i]);
+        e.movabs(REG_RAX, (uint64_t)instruction.func);
+        e.call_rax();
+        e.test_al();
+
+        // faulted, the faulting instruction doesn't count as retired
+        const auto failed = e.jz();
+        const auto ok = e.jmp();
+        e.patch(failed, e.code.size());
+        e.mov_eax_imm(i | JIT_FAULTED);
+        exits.push_back(e.jmp());
+        e.patch(ok, e.code.size());
+
+        reset_r0 = true;
+    };
+
+    for (int i = 0; i < count; i++)
+    {
+        emit_instruction(i);
+
+        if (i != block.branch_index)
+            continue;
+
+        // not taken skips the delay slot entirely (see cpu_beq etc)
+        if (i + 1 == count)
+            break;
+
+        e.cmp_delay_slot_zero();
+        const auto not_taken = e.jz();
+        const auto taken = e.jmp();
+        e.patch(not_taken, e.code.size());
+        emit_exit(i + 1);
+        e.patch(taken, e.code.size());
+
+        // same as cpu_step: handler will bump the pc back up to the target
+        e.clear_delay_slot();
+        e.add_mem_imm64(pc_offset, -4);
+        emit_instruction(i + 1);
+        emit_exit(i + 2);
+        break;
+    }
+
+    if (block.branch_index < 0)
+        emit_exit(count);
+
+    // epilogue, every exit lands here with the retired count in eax
+    const auto epilogue = e.code.size();
+    e.u8(0x48); e.u8(0x83); e.u8(0xC4); e.u8(8);// add rsp, 8
+    e.u8(0x41); e.u8(0x5C);                     // pop r12
+    e.u8(0x5B);                                 // pop rbx
+    e.u8(0xC3);                                 // ret
+
+    for (auto exit : exits)
+        e.patch(exit, epilogue);
+
+    auto* code = (uint8_t*)code_buffer.alloc(e.code.size(), 16);
+
+    if (!code)
+        return nullptr;
+
+    memcpy(code, e.code.data(), e.code.size());
+    compile_count++;
+
+    return (jit_block_fn)code;
+}
+#endif
+
+void jit_init()
+{
+#if JIT_X64
+    if (!code_buffer.base)
+    {
+        int flags = MAP_PRIVATE | MAP_ANON;
+
+#ifdef MAP_JIT
+        flags |= MAP_JIT;
+#endif
+
+        void* base = mmap(nullptr, JIT_CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+
+        if (base == MAP_FAILED)
+        {
+            printf("JIT: unable to allocate code buffer, recompiler disabled\n");
+            return;
+        }
+
+        code_buffer.base = (uint8_t*)base;
+        code_buffer.size = JIT_CODE_BUFFER_SIZE;
+    }
+
+    jit_flush();
+    flush_count = 0;
+#endif
+}
+
+bool jit_is_supported()
+{
+    return code_buffer.base != nullptr;
+}
+
+jit_block_fn jit_lookup(uint64_t pc)
+{
+#if JIT_X64
+    if (!code_buffer.base)
+        return nullptr;
+
+    const auto* block = block_lookup(pc);
+
+    if (!block)
+        return nullptr;
+
+    auto it = jit_blocks.find(pc);
+
+    if (it != jit_blocks.end() && it->second.source_id == block->id)
+        return it->second.code;
+
+    auto code = jit_compile(*block);
+
+    // out of space, start again with an empty buffer
+    if (!code)
+    {
+        jit_flush();
+        code = jit_compile(*block);
+
+        if (!code)
+            return nullptr;
+    }
+
+    jit_blocks[pc] = { code, block->id };
+    return code;
+#else
+    return nullptr;
+#endif
+}
+
+uint64_t jit_get_compile_count()
+{
+    return compile_count;
+}
+
+uint64_t jit_get_flush_count()
+{
+    return flush_count;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+#include "block.h"
+
+// Compiled host code for a BasicBlock, returns the number of guest
+// instructions it retired, with JIT_FAULTED set when a handler faulted.
+using jit_block_fn = uint32_t(*)();
+
+#define JIT_FAULTED                 0x80000000u
+
+void jit_init();
+
+// true when the host can run recompiled code (x86-64 only for now)
+bool jit_is_supported();
+
+// host code for the block starting at pc, compiling it on a miss or when the
+// guest code was overwritten. nullptr when the block can't be recompiled.
+jit_block_fn jit_lookup(uint64_t pc);
+
+uint64_t jit_get_compile_count();
+uint64_t jit_get_flush_count();
@@ -5,12 +5,14 @@
 #include "disassembler.h"
 
 #include <thread>
+#include <chrono>
+#include <cstring>
 
 // Implemented in parser.cpp
 const char* parser_get_symbolic_gpr_name(int i);
 const char* parser_get_symbolic_cop0_name(int i);
 
-int main(int, const char**)
+int main(int argc, const char** argv)
 {
     printf("Ultra alpha v0.1\n");
 
@@ -18,7 +20,62 @@ int main(int, const char**)
 
     cpu_init();
 
-    while (cpu_step()) {}
+    if (argc > 1 && strcmp(argv[1], "--test") == 0)
+        return cpu_run_tests() ? 0 : 1;
+
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    {
+        cpu_run_benchmarks();
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--cached") == 0)
+        cpu_set_execution_mode(ExecutionMode::CachedInterpreter);
+
+    if (argc > 1 && strcmp(argv[1], "--chained") == 0)
+        cpu_set_execution_mode(ExecutionMode::ChainedBlocks);
+
+    if (argc > 1 && strcmp(argv[1], "--jit") == 0)
+        cpu_set_execution_mode(ExecutionMode::Recompiler);
+
+    if (argc > 1 && strcmp(argv[1], "--fastmem") == 0 && !memory_enable_fastmem(true))
+        printf("fastmem isn't supported here, using the page table\n");
+
+    if (argc > 1 && strcmp(argv[1], "--trace") == 0)
+        cpu_set_tracing(true);
+
+    if (argc > 2 && strcmp(argv[1], "--record") == 0 && !cpu_start_recording(argv[2]))
+    {
+        printf("unable to record to %s\n", argv[2]);
+        return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    RunResult result{};
+
+    do
+    {
+        result = cpu_run_frame();
+    } while (result.reason == StopReason::BudgetExhausted);
+
+    cpu_stop_recording();
+
+    const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const auto instructions = cpu_get_cycle_count();
+
+    printf("stopped: %s\n", magic_enum::enum_name(result.reason).data());
+    printf("%llu instructions in %.3fs (%.2f MIPS)\n",
+        (unsigned long long)instructions, seconds, instructions / seconds / 1e6);
+
+    if (cpu_get_execution_mode() == ExecutionMode::ChainedBlocks)
+    {
+        const auto& stats = cpu_get_dispatch_stats();
+
+        printf("%llu dispatcher exits (%.2f M/s), %llu links followed\n",
+            (unsigned long long)stats.dispatcher_exits, stats.dispatcher_exits / seconds / 1e6,
+            (unsigned long long)stats.links_followed);
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -1,9 +1,17 @@
 
 #include "memory.h"
+#include "fastmem.h"
+#include "icache.h"
 #include "platform.h"
+#include "rom.h"
 
-#include <functional>
+#include <algorithm>
+#include <condition_variable>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 struct Range {
@@ -27,128 +35,875 @@ struct Range {
 struct MemoryMapping {
     Range range;
     const char* name;
-    std::function<void(uint32_t, uint32_t, void*)> read;
-    std::function<void(uint32_t, uint32_t, const void*)> write;
+    MemoryHandlers handlers;
+};
+
+// Guest values to and from a buffer in the memory layout (see
+// MEMORY_NATIVE_WORDS), offset is from the buffer's 4 byte aligned start
+template<typename T>
+static T memory_load(const uint8_t* buffer, uint32_t offset) {
+    T value{};
+
+#if MEMORY_NATIVE_WORDS
+    // misaligned, the bytes aren't next to each other
+    if (offset & (sizeof(T) - 1)) {
+        for (uint32_t i = 0; i < sizeof(T); i++)
+            value = T(value << 8) | buffer[memory_byte_offset(offset + i)];
+
+        return value;
+    }
+
+    if constexpr (sizeof(T) < 4)
+        offset ^= 4 - sizeof(T);
+
+    memcpy(&value, buffer + offset, sizeof(T));
+
+    if constexpr (sizeof(T) == 8)
+        value = value << 32 | value >> 32;
+#else
+    memcpy(&value, buffer + offset, sizeof(T));
+    value = byteswap(value);
+#endif
+
+    return value;
+}
+
+template<typename T>
+static void memory_store(uint8_t* buffer, uint32_t offset, T value) {
+#if MEMORY_NATIVE_WORDS
+    if (offset & (sizeof(T) - 1)) {
+        for (uint32_t i = 0; i < sizeof(T); i++)
+            buffer[memory_byte_offset(offset + i)] = uint8_t(value >> ((sizeof(T) - 1 - i) * 8));
+
+        return;
+    }
+
+    if constexpr (sizeof(T) < 4)
+        offset ^= 4 - sizeof(T);
+
+    if constexpr (sizeof(T) == 8)
+        value = value << 32 | value >> 32;
+#else
+    value = byteswap(value);
+#endif
+
+    memcpy(buffer + offset, &value, sizeof(T));
+}
+
+// address a naturally aligned access of `size` bytes is stored at
+static constexpr uint32_t memory_lane(uint32_t address, uint32_t size) {
+    return MEMORY_NATIVE_WORDS && size < 4 ? address ^ (4 - size) : address;
+}
+
+// a value as it's stored at its lane, and back again
+template<typename T>
+static constexpr T memory_to_layout(T value) {
+#if MEMORY_NATIVE_WORDS
+    if constexpr (sizeof(T) == 8)
+        return value << 32 | value >> 32;
+    else
+        return value;
+#else
+    return byteswap(value);
+#endif
+}
+
+// copies guest bytes from one buffer to another
+static void memory_copy(uint8_t* dst, uint32_t dst_offset, const uint8_t* src, uint32_t src_offset, uint32_t size) {
+#if MEMORY_NATIVE_WORDS
+    auto copy_bytes = [&](uint32_t count) {
+        for (; count; count--, size--)
+            dst[memory_byte_offset(dst_offset++)] = src[memory_byte_offset(src_offset++)];
+    };
+
+    // whole words only line up when both sides are at the same place in one
+    if ((dst_offset ^ src_offset) & 3) {
+        copy_bytes(size);
+        return;
+    }
+
+    copy_bytes(std::min(size, (4 - dst_offset) & 3));
+
+    const auto words = size & ~3u;
+    memmove(dst + dst_offset, src + src_offset, words);
+    dst_offset += words;
+    src_offset += words;
+    size -= words;
+
+    copy_bytes(size);
+#else
+    memmove(dst + dst_offset, src + src_offset, size);
+#endif
+}
+
+// plain memory, behind the page table except on the slow path
+struct BufferDevice {
+    uint8_t* buffer;
+    uint32_t start;
+    memory_write_notify_t on_write;
+    bool writable;
+
+    template<typename T>
+    static bool read(void* ctx, uint32_t offset, T& value) {
+        value = memory_load<T>(((BufferDevice*)ctx)->buffer, offset);
+        return true;
+    }
+
+    template<typename T>
+    static bool write(void* ctx, uint32_t offset, T value) {
+        auto* device = (BufferDevice*)ctx;
+
+        if (!device->writable) {
+            memory_bus_error("Write attempt to read only memory");
+            return false;
+        }
+
+        memory_store(device->buffer, offset, value);
+
+        if (device->on_write)
+            device->on_write(device->start + offset, sizeof(T));
+
+        return true;
+    }
+};
+
+struct OpenBusDevice {
+    uint8_t fill;
+    bool read_only;
+
+    template<typename T>
+    static bool read(void* ctx, uint32_t, T& value) {
+        memset(&value, ((OpenBusDevice*)ctx)->fill, sizeof(T));
+        return true;
+    }
+
+    template<typename T>
+    static bool write(void* ctx, uint32_t, T) {
+        if (((OpenBusDevice*)ctx)->read_only) {
+            memory_bus_error("Write attempt to read only memory");
+            return false;
+        }
+
+        return true;
+    }
+};
+
+struct MemoryPage {
+    uint8_t* read;
+    uint8_t* write;
+    memory_write_notify_t on_write;
 };
 
 static bool logging_enabled{};
+// sorted by address and never overlapping, see memory_install_handlers()
 static std::vector<MemoryMapping> mmu_map;
 
-void default_buffer_read(const void* buffer, uint32_t addr, uint32_t size, void* dst) {
-    memcpy((uint8_t*)dst, (const uint8_t*)buffer + addr, size);
+// Address decode: the mappings touching each 64 KB granule of the physical
+// address space, as a run of mmu_map. Most granules hold one mapping (or a
+// slice of a big one), MMIO granules hold a register file.
+#define MEMORY_GRANULE_SHIFT        16
+#define MEMORY_NUM_GRANULES         (0x20000000 >> MEMORY_GRANULE_SHIFT)
+
+struct MemoryGranule {
+    uint32_t first;
+    uint32_t count;
+};
+
+static MemoryGranule granules[MEMORY_NUM_GRANULES]{};
+
+// devices memory.cpp creates itself, their handlers point at them
+static std::vector<std::unique_ptr<BufferDevice>> buffer_devices;
+static std::vector<std::unique_ptr<OpenBusDevice>> open_bus_devices;
+static const char* bus_error{};
+
+// physical page -> host memory, null entries go through mmu_map
+static MemoryPage pages[MEMORY_NUM_PAGES]{};
+
+struct MemoryBuffer {
+    uint32_t start;
+    uint32_t end;
+    uint8_t* buffer;
+    bool writable;
+    memory_write_notify_t on_write;
+};
+
+// everything installed with memory_install_buffer(), for fastmem to map and
+// DMA to copy between directly
+static std::vector<MemoryBuffer> buffers;
+static bool fastmem_enabled{};
+
+// the cartridge image when it's mapped from its file, cartridge_rom is on the
+// bus otherwise. It stays out of the fastmem window: moving it into shared
+// memory would read (and convert) the whole file.
+static RomImage rom_image{};
+static bool rom_mapping_enabled{true};
+
+// logging needs every access to go through memory_map()
+static bool fast_path_enabled{true};
+static bool fastmem_active{};
+
+bool memory_logging_enabled() {
+    return logging_enabled;
 }
 
-void default_buffer_write(void* buffer, uint32_t addr, uint32_t size, const void* src) {
-    memcpy((uint8_t*)buffer + addr, (const uint8_t*)src, size);
+void memory_bus_error(const char* reason) {
+    bus_error = reason;
 }
 
-void memory_init() {
-    mmu_map.clear();
+struct MemoryWatchpoint {
+    uint32_t start;
+    uint32_t end;
+    int kind;
+};
+
+// Data watchpoints. Every page one touches is parked (see below) so only
+// accesses to those pages reach memory_map(), which checks the page bitmap
+// before the exact ranges. Pages without a watchpoint keep their fast path.
+static std::vector<MemoryWatchpoint> watchpoints;
+static uint64_t watch_page_bits[MEMORY_NUM_PAGES / 64]{};
+static MemoryWatchpointHit watch_hit{};
+static bool watch_hit_pending{};
+
+// An asynchronous DMA copying on the worker thread. Its destination pages are
+// parked until it's finished, so nothing on the cpu thread can see them half
+// written (or write under the worker).
+struct AsyncDmaClaim {
+    uint32_t first_page;
+    uint32_t last_page;
+    bool active;
+};
+
+static AsyncDmaClaim async_claim{};
+
+// Pages taken out of the page table (and fastmem) for watchpoints or an async
+// DMA, with the entries they'll get back
+static std::unordered_map<uint32_t, MemoryPage> parked_pages;
+
+static void memory_update_fast_path() {
+    fast_path_enabled = !logging_enabled;
+
+    // the fastmem window maps whole buffers and can't leave pages out
+    fastmem_active = fast_path_enabled && fastmem_enabled && parked_pages.empty();
+}
+
+static bool memory_page_is_watched(uint32_t page) {
+    return (watch_page_bits[page >> 6] >> (page & 63)) & 1;
+}
+
+static bool memory_page_is_claimed(uint32_t page) {
+    return async_claim.active && page >= async_claim.first_page && page <= async_claim.last_page;
+}
+
+static bool memory_page_is_parked(uint32_t page) {
+    return memory_page_is_watched(page) || memory_page_is_claimed(page);
+}
+
+static void memory_park_page(uint32_t page) {
+    if (parked_pages.count(page))
+        return;
+
+    parked_pages[page] = pages[page];
+    pages[page] = {};
+}
+
+static void memory_update_parked_pages() {
+    memset(watch_page_bits, 0, sizeof(watch_page_bits));
+
+    for (const auto& w : watchpoints) {
+        for (auto page = w.start >> MEMORY_PAGE_SHIFT; page <= w.end >> MEMORY_PAGE_SHIFT; page++)
+            watch_page_bits[page >> 6] |= 1ull << (page & 63);
+    }
+
+    // hand back pages nothing needs parked any more, then park new ones
+    for (auto it = parked_pages.begin(); it != parked_pages.end();) {
+        if (memory_page_is_parked(it->first)) {
+            ++it;
+            continue;
+        }
+
+        pages[it->first] = it->second;
+        it = parked_pages.erase(it);
+    }
+
+    for (const auto& w : watchpoints) {
+        for (auto page = w.start >> MEMORY_PAGE_SHIFT; page <= w.end >> MEMORY_PAGE_SHIFT; page++)
+            memory_park_page(page);
+    }
+
+    if (async_claim.active) {
+        for (auto page = async_claim.first_page; page <= async_claim.last_page; page++)
+            memory_park_page(page);
+    }
+
+    memory_update_fast_path();
 }
 
-std::vector<uint64_t> breakpoints;
+bool memory_add_watchpoint(uint32_t address, uint32_t size, int kind) {
+    uint32_t physical_address{};
+
+    if (!size || !memory_translate(address, physical_address) || physical_address >= 0x20000000)
+        return false;
+
+    const auto end = uint32_t(std::min<uint64_t>(uint64_t(physical_address) + size, 0x20000000) - 1);
 
-void memory_add_breakpoint(uint64_t address) {
-    breakpoints.push_back(address);
+    watchpoints.push_back({ physical_address, end, kind });
+    memory_update_parked_pages();
+    return true;
 }
 
-void memory_remove_breakpoint(uint64_t address) {
-    breakpoints.erase(
-        std::remove(breakpoints.begin(), breakpoints.end(), address),
-        breakpoints.end()
+void memory_remove_watchpoint(uint32_t address) {
+    uint32_t physical_address{};
+
+    if (!memory_translate(address, physical_address))
+        return;
+
+    watchpoints.erase(
+        std::remove_if(watchpoints.begin(), watchpoints.end(), [physical_address](const MemoryWatchpoint& w) {
+            return w.start == physical_address;
+        }),
+        watchpoints.end()
     );
+
+    memory_update_parked_pages();
+}
+
+bool memory_has_watchpoints() {
+    return !watchpoints.empty();
+}
+
+const MemoryWatchpointHit* memory_get_watchpoint_hit() {
+    return watch_hit_pending ? &watch_hit : nullptr;
+}
+
+void memory_clear_watchpoint_hit() {
+    watch_hit_pending = false;
+}
+
+static void memory_check_watchpoints(uint32_t address, uint32_t size, bool write) {
+    const auto end = address + size - 1;
+
+    for (const auto& w : watchpoints) {
+        if (!(w.kind & (write ? MEMORY_WATCH_WRITE : MEMORY_WATCH_READ)) || end < w.start || address > w.end)
+            continue;
+
+        // the first hit is the one reported
+        if (!watch_hit_pending)
+            watch_hit = { address, size, write };
+
+        watch_hit_pending = true;
+        return;
+    }
+}
+
+void memory_init() {
+    // nothing may still be copying into the old buffers
+    memory_finish_async_dma();
+
+    mmu_map.clear();
+    memset(granules, 0, sizeof(granules));
+    buffer_devices.clear();
+    open_bus_devices.clear();
+    memset(pages, 0, sizeof(pages));
+
+    buffers.clear();
+    fastmem_unmap_all();
+    rom_unmap(rom_image);
+
+    watchpoints.clear();
+    parked_pages.clear();
+    memset(watch_page_bits, 0, sizeof(watch_page_bits));
+    watch_hit_pending = false;
+    memory_update_fast_path();
+
+    memory_tlb_reset();
 }
 
 void memory_enable_logging(bool enabled) {
     logging_enabled = enabled;
+    memory_update_fast_path();
+}
+
+static uint64_t rdram_dirty_bits[RDRAM_NUM_PAGES / 64]{};
+static uint64_t rdram_page_generation[RDRAM_NUM_PAGES]{};
+static uint64_t rdram_generation{};
+
+template<typename Func>
+static void rdram_for_each_page(uint32_t address, uint32_t size, Func&& func) {
+    if (size == 0 || address >= RDRAM_SIZE)
+        return;
+
+    const auto last_address = std::min<uint64_t>(uint64_t(address) + size, RDRAM_SIZE) - 1;
+
+    for (auto page = address >> RDRAM_PAGE_SHIFT; page <= last_address >> RDRAM_PAGE_SHIFT; page++) {
+        if (!func(page))
+            break;
+    }
+}
+
+void memory_rdram_written(uint32_t address, uint32_t size) {
+    const auto generation = ++rdram_generation;
+    const auto page = address >> RDRAM_PAGE_SHIFT;
+
+    // CPU stores never cross a page, only DMA needs the loop
+    if (size && page == (address + size - 1) >> RDRAM_PAGE_SHIFT && page < RDRAM_NUM_PAGES) {
+        rdram_dirty_bits[page >> 6] |= 1ull << (page & 63);
+        rdram_page_generation[page] = generation;
+        return;
+    }
+
+    rdram_for_each_page(address, size, [generation](uint32_t page) {
+        rdram_dirty_bits[page >> 6] |= 1ull << (page & 63);
+        rdram_page_generation[page] = generation;
+        return true;
+    });
+}
+
+bool memory_rdram_is_dirty(uint32_t address, uint32_t size) {
+    bool dirty{};
+
+    rdram_for_each_page(address, size, [&dirty](uint32_t page) {
+        dirty = (rdram_dirty_bits[page >> 6] >> (page & 63)) & 1;
+        return !dirty;
+    });
+
+    return dirty;
+}
+
+void memory_rdram_clear_dirty(uint32_t address, uint32_t size) {
+    rdram_for_each_page(address, size, [](uint32_t page) {
+        rdram_dirty_bits[page >> 6] &= ~(1ull << (page & 63));
+        return true;
+    });
+}
+
+int memory_rdram_collect_dirty(uint32_t address, uint32_t size, uint32_t* pages, int max_pages) {
+    int count{};
+
+    if (max_pages <= 0)
+        return 0;
+
+    rdram_for_each_page(address, size, [&](uint32_t page) {
+        if ((rdram_dirty_bits[page >> 6] >> (page & 63)) & 1)
+            pages[count++] = page << RDRAM_PAGE_SHIFT;
+
+        return count < max_pages;
+    });
+
+    return count;
+}
+
+uint64_t memory_rdram_get_generation() {
+    return rdram_generation;
+}
+
+uint64_t memory_rdram_get_page_generation(uint32_t address) {
+    return address < RDRAM_SIZE ? rdram_page_generation[address >> RDRAM_PAGE_SHIFT] : 0;
+}
+
+bool memory_rdram_written_since(uint32_t address, uint32_t size, uint64_t generation) {
+    bool written{};
+
+    rdram_for_each_page(address, size, [&](uint32_t page) {
+        written = rdram_page_generation[page] > generation;
+        return !written;
+    });
+
+    return written;
 }
 
 extern uint8_t cartridge_rom[MB(64)];
 
+static uint8_t* memory_get_rom_data() {
+    return rom_image.data ? rom_image.data : cartridge_rom;
+}
+
 CartHeader* memory_get_rom_header() {
-    return (CartHeader*)cartridge_rom;
+    return (CartHeader*)memory_get_rom_data();
 }
 
-void memory_load_rom(const char* path, bool swap) {
-    if (auto* file = fopen(path, "rb")) {
-        fread(cartridge_rom, 1, sizeof(cartridge_rom), file);
+// bytes of cartridge_rom the last image filled
+static size_t rom_loaded_size{};
 
-        if (swap) {
-            for (int i = 0; i < sizeof(cartridge_rom); i += 4) {
-                auto& u32 = *(uint32_t*)&cartridge_rom[i];
-                u32 = bswap_32(u32);
-            }
+static void memory_rebase_buffer(const uint8_t* old_buffer, uint8_t* buffer);
+
+static size_t memory_get_rom_size() {
+    return rom_image.data ? rom_image.size : rom_loaded_size;
+}
+
+// the cartridge is cacheable, code decoded (and compiled) from the image that
+// was there before must not keep running
+static void memory_rom_changed(size_t old_size) {
+    const auto size = std::max(old_size, memory_get_rom_size());
+
+    if (size)
+        icache_invalidate(0x10000000, uint32_t(size));
+}
+
+// puts an image (or cartridge_rom for none) on the bus and drops the old one
+static void memory_set_rom_image(const RomImage& image) {
+    // the worker may still be copying out of the old image
+    memory_finish_async_dma();
+
+    auto old_image = rom_image;
+    auto* old_data = memory_get_rom_data();
+
+    rom_image = image;
+    memory_rebase_buffer(old_data, memory_get_rom_data());
+    rom_unmap(old_image);
+}
+
+void memory_enable_rom_mapping(bool enabled) {
+    rom_mapping_enabled = enabled;
+}
+
+void memory_unload_rom() {
+    const auto old_size = memory_get_rom_size();
+
+    memory_set_rom_image({});
+    memset(cartridge_rom, 0, rom_loaded_size);
+    rom_loaded_size = 0;
+
+    memory_rom_changed(old_size);
+}
+
+size_t memory_get_rom_converted_pages() {
+    return rom_converted_pages(rom_image);
+}
+
+bool memory_load_rom(const char* path) {
+    RomImage image{};
+    const auto old_size = memory_get_rom_size();
+
+    if (rom_mapping_enabled && rom_map(path, sizeof(cartridge_rom), image)) {
+        if (image.format == RomFormat::Unknown)
+            printf("%s: unrecognised header, loading as z64\n", path);
+
+        memory_set_rom_image(image);
+        memory_rom_changed(old_size);
+        return true;
+    }
+
+    auto* file = fopen(path, "rb");
+
+    if (!file)
+        return false;
+
+    const auto size = fread(cartridge_rom, 1, sizeof(cartridge_rom), file);
+    fclose(file);
+
+    const auto format = rom_detect_format(cartridge_rom, size);
+
+    // homebrew doesn't always bother with the header, take it as it is
+    if (format == RomFormat::Unknown)
+        printf("%s: unrecognised header, loading as z64\n", path);
+
+    // only what a bigger image left behind needs clearing, the rest is still zero
+    if (rom_loaded_size > size)
+        memset(cartridge_rom + size, 0, rom_loaded_size - size);
+
+    rom_loaded_size = size;
+    rom_convert(cartridge_rom, size, format);
+
+    if (rom_image.data)
+        memory_set_rom_image({});
+
+    memory_rom_changed(old_size);
+    return true;
+}
+
+static void memory_build_granules() {
+    memset(granules, 0, sizeof(granules));
+
+    for (uint32_t i = 0; i < mmu_map.size(); i++) {
+        const auto& range = mmu_map[i].range;
+
+        for (auto g = range.begin >> MEMORY_GRANULE_SHIFT; g <= range.end >> MEMORY_GRANULE_SHIFT; g++) {
+            if (!granules[g].count)
+                granules[g].first = i;
+
+            granules[g].count++;
         }
+    }
+}
 
-        fclose(file);
+bool memory_install_handlers(uint32_t start, uint32_t end, const MemoryHandlers& handlers, const char* name) {
+    if (start > end || end >= 0x20000000) {
+        printf("memory map: %s [0x%08X, 0x%08X] is outside the physical address space\n", name, start, end);
+        return false;
+    }
+
+    // first mapping starting after this one, the one before it and this one
+    // must not reach each other
+    auto next = std::upper_bound(mmu_map.begin(), mmu_map.end(), start, [](uint32_t address, const MemoryMapping& m) {
+        return address < m.range.begin;
+    });
+
+    const MemoryMapping* overlap{};
+
+    if (next != mmu_map.end() && next->range.begin <= end)
+        overlap = &*next;
+    else if (next != mmu_map.begin() && std::prev(next)->range.end >= start)
+        overlap = &*std::prev(next);
+
+    if (overlap) {
+        printf("memory map: %s [0x%08X, 0x%08X] overlaps %s [0x%08X, 0x%08X]\n",
+            name, start, end, overlap->name, overlap->range.begin, overlap->range.end);
+        return false;
+    }
+
+    mmu_map.insert(next, { { start, end }, name, handlers });
+    memory_build_granules();
+    return true;
+}
+
+bool memory_install_open_bus(uint32_t start, uint32_t end, uint8_t fill, bool read_only, const char* name) {
+    auto& device = open_bus_devices.emplace_back(new OpenBusDevice{ fill, read_only });
+
+    return memory_install_handlers(start, end, memory_make_handlers(device.get()), name);
+}
+
+static void memory_map_buffer_pages(const MemoryBuffer& b) {
+    // only whole pages, a partial one would let accesses run off the buffer
+    const uint64_t first_page = (uint64_t(b.start) + MEMORY_PAGE_SIZE - 1) >> MEMORY_PAGE_SHIFT;
+    const uint64_t end_page = std::min<uint64_t>((uint64_t(b.end) + 1) >> MEMORY_PAGE_SHIFT, MEMORY_NUM_PAGES);
+
+    for (auto page = first_page; page < end_page; page++) {
+        auto* host = b.buffer + ((page << MEMORY_PAGE_SHIFT) - b.start);
+
+        const MemoryPage entry{ host, b.writable ? host : nullptr, b.on_write };
+
+        if (memory_page_is_parked(page))
+            parked_pages[page] = entry;
+        else
+            pages[page] = entry;
     }
 }
 
-void memory_install_rw_callback(
+// a buffer that can't go into the window stays on the page table, its loads
+// then take the fault handler
+static void memory_fastmem_map(const MemoryBuffer& b) {
+    if (!fastmem_map(b.start, b.end - b.start + 1, b.buffer))
+        printf("fastmem: [0x%08X, 0x%08X] isn't mapped, loads go through the fault handler\n", b.start, b.end);
+}
+
+bool memory_install_buffer(
     uint32_t start, uint32_t end,
-    std::function<void(uint32_t, uint32_t, void*)>&& read,
-    std::function<void(uint32_t, uint32_t, const void*)>&& write,
+    uint8_t* buffer, bool writable,
+    memory_write_notify_t on_write,
     const char* name) {
-    MemoryMapping mr {
-        { start, end },
-        name,
-        std::move(read), std::move(write)
-    };
+    // the slow path still needs it for logging, watchpoints and accesses
+    // straddling a page
+    auto& device = buffer_devices.emplace_back(new BufferDevice{ buffer, start, on_write, writable });
+
+    if (!memory_install_handlers(start, end, memory_make_handlers(device.get()), name))
+        return false;
+
+    buffers.push_back({ start, end, buffer, writable, on_write });
+
+    if (fastmem_enabled)
+        memory_fastmem_map(buffers.back());
+
+    memory_map_buffer_pages(buffers.back());
+    return true;
+}
+
+static void memory_rebase_buffer(const uint8_t* old_buffer, uint8_t* buffer) {
+    for (auto& device : buffer_devices) {
+        if (device->buffer == old_buffer)
+            device->buffer = buffer;
+    }
+
+    for (auto& b : buffers) {
+        if (b.buffer == old_buffer) {
+            b.buffer = buffer;
+            memory_map_buffer_pages(b);
+        }
+    }
+
+    // the window still has the old buffer's memory in it
+    if (fastmem_enabled) {
+        memory_enable_fastmem(false);
+        memory_enable_fastmem(true);
+    }
+}
+
+bool memory_enable_fastmem(bool enabled) {
+    if (enabled == fastmem_enabled)
+        return true;
+
+    if (enabled && !fastmem_init())
+        return false;
+
+    fastmem_unmap_all();
+
+    if (enabled) {
+        for (const auto& b : buffers) {
+            if (b.buffer != rom_image.data)
+                memory_fastmem_map(b);
+        }
+    }
+
+    fastmem_enabled = enabled;
+    memory_update_fast_path();
+    return true;
+}
+
+bool memory_fastmem_enabled() {
+    return fastmem_enabled;
+}
+
+const uint8_t* memory_get_host_pointer(uint32_t physical_address) {
+    if (physical_address >= 0x20000000)
+        return nullptr;
 
-    mmu_map.push_back(std::move(mr));
+    const auto page = physical_address >> MEMORY_PAGE_SHIFT;
+    const auto* host = memory_page_is_parked(page) ? parked_pages[page].read : pages[page].read;
+    return host ? host + (physical_address & (MEMORY_PAGE_SIZE - 1)) : nullptr;
 }
 
-struct TLBEntry {
-    uint32_t entry_lo0;
-    uint32_t entry_lo1;
-    uint32_t page_mask;
-    uint32_t entry_hi0;
+// The R4300 TLB proper, only ever scanned on a micro-TLB miss
+static TlbEntry tlb_entries[TLB_NUM_ENTRIES]{};
+static uint8_t tlb_asid{};
+
+// Direct mapped cache of 4 KB virtual page -> physical page lookups that went
+// through the TLB. Entries are filled on a miss and are only good for the
+// generation they were filled in, so anything that changes how the TLB
+// translates (an entry written, the ASID switched) drops all of them at once
+// by bumping the generation.
+#define MICRO_TLB_SIZE              4096
+
+struct MicroTlbEntry {
+    uint32_t virtual_page;
+    uint32_t physical_page;
+    uint32_t generation;
 };
 
-static TLBEntry tlb_entries[64]{};
+static MicroTlbEntry micro_tlb[MICRO_TLB_SIZE]{};
+static uint32_t micro_tlb_generation{1};
+static TlbStats tlb_stats{};
+static void(*tlb_listener)(){};
 
-static bool memory_do_tlb_translation(uint32_t& virtual_address) {
-    //https://gist.github.com/parasyte/6547020
-    for (const auto& entry : tlb_entries) {
-        const auto mask = (entry.page_mask >> 1) & 0x0FFF;
-        const auto page_size = mask + 1;
-        const auto vpn = entry.entry_hi0 & ~(entry.page_mask & 0x1FFF);
+static void memory_tlb_flush() {
+    // entries from before a wrap would look current again
+    if (++micro_tlb_generation == 0) {
+        memset(micro_tlb, 0, sizeof(micro_tlb));
+        micro_tlb_generation = 1;
+    }
 
-        if ((virtual_address & vpn) == vpn) {
-            uint32_t phys_frame_number{};
+    tlb_stats.flushes++;
 
-            const auto odd = virtual_address & page_size;
-            const auto even = !odd;
+    if (tlb_listener)
+        tlb_listener();
+}
 
-            if (even) {
-                if (!(entry.entry_lo0 & 0x02))
-                    continue;
+static bool memory_tlb_match(const TlbEntry& entry, uint32_t virtual_address, uint8_t asid) {
+    const auto mask = entry.page_mask | 0x1FFF;
 
-                phys_frame_number = (entry.entry_lo0 >> 6) & 0x00FFFFFF;
-            }
-            else {
-                if (!(entry.entry_lo1 & 0x02))
-                    continue;
+    if ((virtual_address & ~mask) != (entry.entry_hi & ~mask))
+        return false;
 
-                phys_frame_number = (entry.entry_lo1 >> 6) & 0x00FFFFFF;
-            }
+    return (entry.entry_lo0 & TLB_ENTRY_GLOBAL) || (entry.entry_hi & 0xFF) == asid;
+}
 
-            auto phys_address =
-                (0x80000000 | (phys_frame_number * page_size) | (virtual_address & mask));
+//https://gist.github.com/parasyte/6547020
+static bool memory_tlb_lookup(uint32_t virtual_address, uint32_t& physical_address) {
+    for (const auto& entry : tlb_entries) {
+        if (!memory_tlb_match(entry, virtual_address, tlb_asid))
+            continue;
 
-            virtual_address = phys_address;
-            return true;
-        }
+        // each entry maps an even/odd pair of pages
+        const auto offset_mask = (entry.page_mask | 0x1FFF) >> 1;
+        const auto lo = (virtual_address & (offset_mask + 1)) ? entry.entry_lo1 : entry.entry_lo0;
+
+        if (!(lo & TLB_ENTRY_VALID))
+            return false;
+
+        const auto frame = ((lo >> 6) & 0xFFFFF) << 12;
+        physical_address = (frame & ~offset_mask) | (virtual_address & offset_mask);
+        return true;
     }
 
     return false;
 }
 
-enum class ReadWrite { Read, Write };
-bool memory_map(ReadWrite rw, uint32_t address, uint32_t size, void* data) {
-    uint32_t virtual_address{address};
-    bool valid{};
+static bool memory_do_tlb_translation(uint32_t& virtual_address) {
+    const auto virtual_page = virtual_address >> MEMORY_PAGE_SHIFT;
+    auto& cached = micro_tlb[virtual_page & (MICRO_TLB_SIZE - 1)];
+
+    if (cached.generation == micro_tlb_generation && cached.virtual_page == virtual_page) {
+        tlb_stats.hits++;
+        virtual_address = cached.physical_page | (virtual_address & (MEMORY_PAGE_SIZE - 1));
+        return true;
+    }
+
+    tlb_stats.misses++;
+
+    uint32_t physical_address{};
+
+    if (!memory_tlb_lookup(virtual_address, physical_address)) {
+        tlb_stats.faults++;
+        return false;
+    }
+
+    cached = { virtual_page, physical_address & ~(MEMORY_PAGE_SIZE - 1), micro_tlb_generation };
+    virtual_address = physical_address;
+    return true;
+}
+
+void memory_tlb_write(int index, const TlbEntry& entry) {
+    // the low 13 bits of EntryHi (other than the ASID) and the PageMask bits
+    // outside 24:13 read back as zero
+    auto& slot = tlb_entries[index & (TLB_NUM_ENTRIES - 1)];
+    slot.page_mask = entry.page_mask & 0x01FFE000;
+    slot.entry_hi = entry.entry_hi & ~(slot.page_mask | 0x1F00);
+    slot.entry_lo0 = entry.entry_lo0 & 0x3FFFFFFF;
+    slot.entry_lo1 = entry.entry_lo1 & 0x3FFFFFFF;
+
+    // there's one G bit per entry, set only if both halves had it
+    if (!(slot.entry_lo0 & slot.entry_lo1 & TLB_ENTRY_GLOBAL)) {
+        slot.entry_lo0 &= ~TLB_ENTRY_GLOBAL;
+        slot.entry_lo1 &= ~TLB_ENTRY_GLOBAL;
+    }
+
+    memory_tlb_flush();
+}
+
+TlbEntry memory_tlb_read(int index) {
+    return tlb_entries[index & (TLB_NUM_ENTRIES - 1)];
+}
+
+int memory_tlb_probe(uint32_t entry_hi) {
+    for (int i = 0; i < TLB_NUM_ENTRIES; i++) {
+        if (memory_tlb_match(tlb_entries[i], entry_hi, entry_hi & 0xFF))
+            return i;
+    }
+
+    return -1;
+}
+
+void memory_tlb_set_asid(uint8_t asid) {
+    if (asid == tlb_asid)
+        return;
 
+    tlb_asid = asid;
+    memory_tlb_flush();
+}
+
+void memory_tlb_reset() {
+    memset(tlb_entries, 0, sizeof(tlb_entries));
+    tlb_asid = 0;
+    memory_tlb_flush();
+}
+
+void memory_set_tlb_listener(void(*listener)()) {
+    tlb_listener = listener;
+}
+
+TlbStats memory_get_tlb_stats() {
+    return tlb_stats;
+}
+
+bool memory_translate(uint32_t address, uint32_t& physical_address) {
     switch (address) {
         // USEG  TLB mapped
         case 0x00000000 ... 0x7FFFFFFF: {
@@ -160,19 +915,11 @@ bool memory_map(ReadWrite rw, uint32_t address, uint32_t size, void* data) {
         } break;
 
         // KSSEG  TLB mapped
-        case 0xC0000000 ... 0xDFFFFFFF: {
-            if (!memory_do_tlb_translation(address)) {
-                printf("\nUnsupported TLB access: KSSEG (0x%08X)\n", address);
-                return false;
-            }
-        } break;
-
         // KSEG3  TLB mapped
+        case 0xC0000000 ... 0xDFFFFFFF:
         case 0xE0000000 ... 0xFFFFFFFF: {
-            if (!memory_do_tlb_translation(address)) {
-                printf("\nUnsupported TLB access: KSEG3 (0x%08X)\n", address);
+            if (!memory_do_tlb_translation(address))
                 return false;
-            }
         } break;
 
         // KSEG0  Direct map, cache
@@ -186,106 +933,410 @@ bool memory_map(ReadWrite rw, uint32_t address, uint32_t size, void* data) {
             break;
     }
 
-    auto match = std::find_if(mmu_map.begin(), mmu_map.end(), [address](const auto& e) {
-        return e.range.contains(address);
+    physical_address = address;
+    return true;
+}
+
+static bool memory_translate_or_report(uint32_t virtual_address, uint32_t& physical_address) {
+    if (!memory_translate(virtual_address, physical_address)) {
+        printf("\nUnsupported TLB access: %s (0x%08X)\n", virtual_address >= 0xE0000000 ? "KSEG3" : "KSSEG", virtual_address);
+        return false;
+    }
+
+    return true;
+}
+
+// page table entry for an access that fits in one page, nullptr otherwise
+static const MemoryPage* memory_fast_page(uint32_t physical_address, uint32_t size) {
+    if (!fast_path_enabled || physical_address >= 0x20000000)
+        return nullptr;
+
+    if ((physical_address & (MEMORY_PAGE_SIZE - 1)) + size > MEMORY_PAGE_SIZE)
+        return nullptr;
+
+    return &pages[physical_address >> MEMORY_PAGE_SHIFT];
+}
+
+template<typename T>
+static constexpr auto memory_get_read_handler(const MemoryHandlers& handlers) {
+    if constexpr (sizeof(T) == 1) return handlers.read8;
+    else if constexpr (sizeof(T) == 2) return handlers.read16;
+    else if constexpr (sizeof(T) == 4) return handlers.read32;
+    else return handlers.read64;
+}
+
+template<typename T>
+static constexpr auto memory_get_write_handler(const MemoryHandlers& handlers) {
+    if constexpr (sizeof(T) == 1) return handlers.write8;
+    else if constexpr (sizeof(T) == 2) return handlers.write16;
+    else if constexpr (sizeof(T) == 4) return handlers.write32;
+    else return handlers.write64;
+}
+
+// the handlers, for everything the page table doesn't cover
+static const MemoryMapping* memory_find_mapping(uint32_t address) {
+    if (address >= 0x20000000)
+        return nullptr;
+
+    const auto& granule = granules[address >> MEMORY_GRANULE_SHIFT];
+    const auto* first = mmu_map.data() + granule.first;
+    const auto* last = first + granule.count;
+
+    // the last mapping starting at or before the address
+    const auto* match = std::upper_bound(first, last, address, [](uint32_t a, const MemoryMapping& m) {
+        return a < m.range.begin;
     });
 
-    for (auto bp : breakpoints) {
-        if (bp == address) {
-            printf("hit breakpoint 0x%08X\n", address);
-            getchar();
-        }
+    if (match == first || !match[-1].range.contains(address))
+        return nullptr;
+
+    return match - 1;
+}
+
+template<typename T, bool Write>
+static bool memory_map(uint32_t address, T& value) {
+    const auto* match = memory_find_mapping(address);
+
+    // the page is being written by an async DMA, let it finish first
+    if (memory_page_is_claimed(address >> MEMORY_PAGE_SHIFT))
+        memory_finish_async_dma();
+
+    if (!watchpoints.empty() && memory_page_is_watched(address >> MEMORY_PAGE_SHIFT))
+        memory_check_watchpoints(address, sizeof(T), Write);
+
+    if (!match) {
+        printf("\nUnmapped memory access: 0x%08X::0x%08X\n", address, uint32_t(sizeof(T)));
+        return false;
     }
 
-    if (match != mmu_map.end()) {
-        switch (rw) {
-        case ReadWrite::Read:
-            match->read(match->range.map(address), size, data);
+    const auto& handlers = match->handlers;
+    const auto offset = match->range.map(address);
+    bool ok{};
 
-            if (logging_enabled)
-                printf("\t(%s) Read 0x%08X[0x%08X]\n\n", match->name, address, *(uint32_t*)data);
+    if constexpr (Write)
+        ok = memory_get_write_handler<T>(handlers)(handlers.ctx, offset, value);
+    else
+        ok = memory_get_read_handler<T>(handlers)(handlers.ctx, offset, value);
 
-            valid = true;
-            break;
+    if (logging_enabled)
+        printf("\t(%s) %s 0x%08X[0x%0*llX]\n\n", match->name, Write ? "Write" : "Read", address,
+            int(sizeof(T) * 2), (unsigned long long)value);
 
-        case ReadWrite::Write:
-            match->write(match->range.map(address), size, data);
+    if (bus_error || !ok) {
+        printf("\n(%s) %s: 0x%08X::0x%08X\n", match->name, bus_error ? bus_error : "bus error", address, uint32_t(sizeof(T)));
+        bus_error = nullptr;
+        return false;
+    }
 
-            if (logging_enabled)
-                printf("\t(%s) Write 0x%08X[0x%08X]\n\n", match->name, address, *(uint32_t*)data);
+    return true;
+}
 
-            valid = true;
-            break;
-        }
+template<typename T>
+static bool memory_read_paged(uint32_t address, T& value) {
+    uint32_t physical_address{};
+
+    if (!memory_translate_or_report(address, physical_address))
+        return false;
+
+    if (auto* page = memory_fast_page(physical_address, sizeof(T)); page && page->read) {
+        value = memory_load<T>(page->read, physical_address & (MEMORY_PAGE_SIZE - 1));
+        return true;
     }
 
-    if (valid) {
+    return memory_map<T, false>(physical_address, value);
+}
+
+// bytes as they're stored, for the fastmem fault handler. The address is the
+// one the stub loaded from, which is the access's lane.
+bool memory_read_paged(uint32_t address, uint32_t size, void* data) {
+    auto read = [address = memory_lane(address, size), data](auto value) {
+        if (!memory_read_paged(address, value))
+            return false;
+
+        value = memory_to_layout(value);
+        memcpy(data, &value, sizeof(value));
         return true;
+    };
+
+    switch (size) {
+        case 1: return read(uint8_t{});
+        case 2: return read(uint16_t{});
+        case 4: return read(uint32_t{});
+        case 8: return read(uint64_t{});
     }
 
-    printf("\nUnmapped memory access: 0x%08X::0x%08X\n", address, size);
     return false;
 }
 
-bool memory_read(uint32_t address, uint32_t size, void* data) {
-    return memory_map(ReadWrite::Read, address, size, data);
+template<typename T>
+bool memory_read(uint32_t address, T& value) {
+    // word swapped memory only has misaligned values in pieces
+    if (fastmem_active && !(MEMORY_NATIVE_WORDS && (address & (sizeof(T) - 1)))) {
+        if (!fastmem_read(memory_lane(address, sizeof(T)), sizeof(T), &value))
+            return false;
+
+        value = memory_to_layout(value);
+        return true;
+    }
+
+    return memory_read_paged(address, value);
+}
+
+template<typename T>
+bool memory_write(uint32_t address, T value) {
+    uint32_t physical_address{};
+
+    if (!memory_translate_or_report(address, physical_address))
+        return false;
+
+    if (auto* page = memory_fast_page(physical_address, sizeof(T)); page && page->write) {
+        memory_store(page->write, physical_address & (MEMORY_PAGE_SIZE - 1), value);
+
+        if (page->on_write)
+            page->on_write(physical_address, sizeof(T));
+
+        return true;
+    }
+
+    return memory_map<T, true>(physical_address, value);
 }
 
-bool memory_write(uint32_t address, uint32_t size, const void* data) {
-    return memory_map(ReadWrite::Write, address, size, (void*)data);
+template bool memory_read<uint8_t>(uint32_t, uint8_t&);
+template bool memory_read<uint16_t>(uint32_t, uint16_t&);
+template bool memory_read<uint32_t>(uint32_t, uint32_t&);
+template bool memory_read<uint64_t>(uint32_t, uint64_t&);
+
+template bool memory_write<uint8_t>(uint32_t, uint8_t);
+template bool memory_write<uint16_t>(uint32_t, uint16_t);
+template bool memory_write<uint32_t>(uint32_t, uint32_t);
+template bool memory_write<uint64_t>(uint32_t, uint64_t);
+
+// the buffer behind a physical address, nullptr if it's MMIO or unmapped
+static const MemoryBuffer* memory_find_buffer(uint32_t physical_address) {
+    for (const auto& b : buffers) {
+        if (physical_address >= b.start && physical_address <= b.end)
+            return &b;
+    }
+
+    return nullptr;
 }
 
-bool memory_do_dma(uint32_t dst, uint32_t src, uint32_t size) {
-    printf("\nmemory_do_dma 0x%08X -> 0x%08X::0x%X\n", src, dst, size);
+// one access at a time through the bus, for MMIO (and anything being logged
+// or watched). Words while both sides are aligned, bytes otherwise.
+static bool memory_dma_slow(uint32_t dst, uint32_t src, uint32_t size) {
+    while (size) {
+        if (size >= 4 && !((dst | src) & 3)) {
+            uint32_t word{};
 
-    for (uint32_t i = 0; i < size; i++) {
-        uint8_t b{};
+            if (!memory_read32(0xA0000000 | src, word) || !memory_write32(0xA0000000 | dst, word))
+                return false;
 
-        if (!memory_read8(src, b))
-            return false;
+            dst += 4;
+            src += 4;
+            size -= 4;
+            continue;
+        }
 
-        if (!memory_write8(dst, b))
+        uint8_t b{};
+
+        if (!memory_read8(0xA0000000 | src, b) || !memory_write8(0xA0000000 | dst, b))
             return false;
 
         dst++;
         src++;
+        size--;
     }
 
     return true;
 }
 
-bool memory_read8(uint32_t address, uint8_t& value) {
-    return memory_read(address, 1, &value);
+// Copies in spans: each step resolves the source and destination to the
+// buffers behind them and copies as far as both reach in one go. Both sides
+// are in the same layout, so that's a memmove unless word swapped buffers are
+// misaligned to each other.
+bool memory_do_dma(uint32_t dst, uint32_t src, uint32_t size) {
+    if (logging_enabled)
+        printf("\nmemory_do_dma 0x%08X -> 0x%08X::0x%X\n", src, dst, size);
+
+    uint32_t physical_dst{}, physical_src{};
+
+    if (!memory_translate_or_report(dst, physical_dst) || !memory_translate_or_report(src, physical_src))
+        return false;
+
+    // copies between buffers don't look at the page table
+    memory_finish_async_dma();
+
+    const bool direct = fast_path_enabled && watchpoints.empty();
+
+    while (size) {
+        const auto* from = direct ? memory_find_buffer(physical_src) : nullptr;
+        const auto* to = direct ? memory_find_buffer(physical_dst) : nullptr;
+
+        if (!from || !to || !to->writable) {
+            // MMIO (or read only memory being written) on one side, the bus
+            // takes it as far as the other side's buffer goes
+            uint64_t span = size;
+
+            if (from)
+                span = std::min<uint64_t>(span, uint64_t(from->end) - physical_src + 1);
+
+            if (to)
+                span = std::min<uint64_t>(span, uint64_t(to->end) - physical_dst + 1);
+
+            if (!memory_dma_slow(physical_dst, physical_src, uint32_t(span)))
+                return false;
+
+            physical_dst += span;
+            physical_src += span;
+            size -= span;
+            continue;
+        }
+
+        const auto span = uint32_t(std::min<uint64_t>({
+            size,
+            uint64_t(from->end) - physical_src + 1,
+            uint64_t(to->end) - physical_dst + 1,
+        }));
+
+        memory_copy(to->buffer, physical_dst - to->start, from->buffer, physical_src - from->start, span);
+
+        if (to->on_write)
+            to->on_write(physical_dst, span);
+
+        physical_dst += span;
+        physical_src += span;
+        size -= span;
+    }
+
+    return true;
 }
 
-bool memory_read16(uint32_t address, uint16_t& value) {
-    if (memory_read(address, 2, &value)) {
-        value = bswap_16(value);
-        return true;
+// One transfer at a time is handed to the worker, which only ever sees the
+// two buffers. Everything else (parking pages, write notifications)
+// happens on the cpu thread.
+struct AsyncDmaWorker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    uint8_t* dst;
+    const uint8_t* src;
+    uint32_t dst_offset;
+    uint32_t src_offset;
+    uint32_t size;
+
+    // posted and not copied yet
+    bool pending;
+    bool stopping;
+
+    ~AsyncDmaWorker() {
+        if (!thread.joinable())
+            return;
+
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+
+        cv.notify_all();
+        thread.join();
     }
+};
 
-    return false;
+static AsyncDmaWorker async_worker{};
+
+// where the claimed transfer landed, reported to the buffer once it's done
+static uint32_t async_dst{};
+static uint32_t async_size{};
+static memory_write_notify_t async_on_write{};
+static AsyncDmaStats async_stats{};
+
+static void memory_async_dma_main() {
+    std::unique_lock lock(async_worker.mutex);
+
+    while (true) {
+        async_worker.cv.wait(lock, []() { return async_worker.pending || async_worker.stopping; });
+
+        if (!async_worker.pending)
+            break;
+
+        memory_copy(async_worker.dst, async_worker.dst_offset, async_worker.src, async_worker.src_offset, async_worker.size);
+
+        async_worker.pending = false;
+        async_worker.cv.notify_all();
+    }
 }
 
-bool memory_read32(uint32_t address, uint32_t& value) {
-    if (memory_read(address, 4, &value)) {
-        value = bswap_32(value);
-        return true;
+bool memory_do_dma_async(uint32_t dst, uint32_t src, uint32_t size) {
+    memory_finish_async_dma();
+
+    uint32_t physical_dst{}, physical_src{};
+
+    if (size < MEMORY_ASYNC_DMA_MIN_SIZE || !fast_path_enabled || !watchpoints.empty()
+        || !memory_translate(dst, physical_dst) || !memory_translate(src, physical_src))
+        return memory_do_dma(dst, src, size);
+
+    // both ends in one buffer each, and a source nothing can write meanwhile
+    const auto* from = memory_find_buffer(physical_src);
+    const auto* to = memory_find_buffer(physical_dst);
+
+    if (!from || !to || from->writable || !to->writable
+        || uint64_t(physical_src) + size - 1 > from->end || uint64_t(physical_dst) + size - 1 > to->end)
+        return memory_do_dma(dst, src, size);
+
+    async_claim = { physical_dst >> MEMORY_PAGE_SHIFT, (physical_dst + size - 1) >> MEMORY_PAGE_SHIFT, true };
+    async_dst = physical_dst;
+    async_size = size;
+    async_on_write = to->on_write;
+    memory_update_parked_pages();
+
+    // fetches go through the icache and compiled blocks, not the page table,
+    // so drop those now and let the next fill wait for the copy
+    icache_invalidate(physical_dst, size);
+
+    {
+        std::lock_guard lock(async_worker.mutex);
+
+        async_worker.dst = to->buffer;
+        async_worker.src = from->buffer;
+        async_worker.dst_offset = physical_dst - to->start;
+        async_worker.src_offset = physical_src - from->start;
+        async_worker.size = size;
+        async_worker.pending = true;
+
+        if (!async_worker.thread.joinable())
+            async_worker.thread = std::thread(memory_async_dma_main);
     }
 
-    return false;
+    async_worker.cv.notify_all();
+    async_stats.transfers++;
+    return true;
 }
 
-bool memory_write8(uint32_t address, uint8_t data) {
-    return memory_write(address, 1, &data);
+void memory_finish_async_dma() {
+    if (!async_claim.active)
+        return;
+
+    {
+        std::unique_lock lock(async_worker.mutex);
+
+        if (async_worker.pending)
+            async_stats.waits++;
+
+        async_worker.cv.wait(lock, []() { return !async_worker.pending; });
+    }
+
+    async_claim.active = false;
+    memory_update_parked_pages();
+
+    if (async_on_write)
+        async_on_write(async_dst, async_size);
 }
 
-bool memory_write16(uint32_t address, uint16_t data) {
-    data = bswap_16(data);
-    return memory_write(address, 2, &data);
+bool memory_async_dma_pending() {
+    return async_claim.active;
 }
 
-bool memory_write32(uint32_t address, uint32_t data) {
-    data = bswap_32(data);
-    return memory_write(address, 4, &data);
-}
\ No newline at end of file
+AsyncDmaStats memory_get_async_dma_stats() {
+    return async_stats;
+}
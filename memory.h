@@ -1,38 +1,274 @@
 #pragma once
 
 #include <cstdint>
-#include <functional>
 
 #include "cartridge.h"
+#include "platform.h"
 
 void memory_init();
 
-void memory_add_breakpoint(uint64_t address);
-void memory_remove_breakpoint(uint64_t address);
+// Data watchpoints on `size` bytes from a KSEG0/KSEG1 (or physical) address.
+// An access overlapping one still completes, then cpu_run() returns
+// StopReason::Watchpoint. Only pages holding a watchpoint leave the fast path.
+#define MEMORY_WATCH_READ           0x01
+#define MEMORY_WATCH_WRITE          0x02
+
+struct MemoryWatchpointHit {
+    // physical address and width of the access
+    uint32_t address;
+    uint32_t size;
+    bool write;
+};
+
+bool memory_add_watchpoint(uint32_t address, uint32_t size, int kind);
+
+// removes every watchpoint starting at address
+void memory_remove_watchpoint(uint32_t address);
+bool memory_has_watchpoints();
+
+// the first access to hit a watchpoint since it was last cleared, nullptr if none
+const MemoryWatchpointHit* memory_get_watchpoint_hit();
+void memory_clear_watchpoint_hit();
 
 void memory_enable_logging(bool);
+bool memory_logging_enabled();
+
+// called from inside a handler when the access can't be serviced, the
+// memory_read/memory_write call then returns false
+void memory_bus_error(const char* reason);
+
+// Bus handlers, one per access width. Values are in host byte order and the
+// offset is from the start of the installed range; ctx is passed through from
+// install time. Returning false fails the access (with memory_bus_error()'s
+// reason if one was given).
+template<typename T>
+using memory_read_fn = bool(*)(void* ctx, uint32_t offset, T& value);
+
+template<typename T>
+using memory_write_fn = bool(*)(void* ctx, uint32_t offset, T value);
+
+struct MemoryHandlers {
+    void* ctx;
+
+    memory_read_fn<uint8_t> read8;
+    memory_read_fn<uint16_t> read16;
+    memory_read_fn<uint32_t> read32;
+    memory_read_fn<uint64_t> read64;
+
+    memory_write_fn<uint8_t> write8;
+    memory_write_fn<uint16_t> write16;
+    memory_write_fn<uint32_t> write32;
+    memory_write_fn<uint64_t> write64;
+};
+
+// handlers from a device type with static `template<typename T> read/write`
+// functions matching memory_read_fn/memory_write_fn
+template<typename Device>
+constexpr MemoryHandlers memory_make_handlers(Device* device) {
+    return {
+        device,
+        &Device::template read<uint8_t>, &Device::template read<uint16_t>,
+        &Device::template read<uint32_t>, &Device::template read<uint64_t>,
+        &Device::template write<uint8_t>, &Device::template write<uint16_t>,
+        &Device::template write<uint32_t>, &Device::template write<uint64_t>,
+    };
+}
+
+// Ranges are physical and inclusive, and can't overlap anything already
+// installed: those are rejected (and reported) and the call returns false.
+// Finding the mapping for an address doesn't depend on how many there are.
+bool memory_install_handlers(uint32_t start, uint32_t end, const MemoryHandlers& handlers, const char* name);
+
+// reads as `fill` in every byte, writes are dropped (or fail when read_only)
+bool memory_install_open_bus(uint32_t start, uint32_t end, uint8_t fill, bool read_only, const char* name);
 
-void memory_install_rw_callback(
+// Plain memory (RDRAM, RSP memory, cartridge ROM) is installed as a buffer
+// rather than callbacks. Every page it fully covers goes in the physical page
+// table and is accessed directly, everything else goes through the callbacks.
+// on_write, when set, is told about every write with its physical address.
+#define MEMORY_PAGE_SHIFT           12
+#define MEMORY_PAGE_SIZE            (1 << MEMORY_PAGE_SHIFT)
+#define MEMORY_NUM_PAGES            (0x20000000 >> MEMORY_PAGE_SHIFT)
+
+using memory_write_notify_t = void(*)(uint32_t physical_address, uint32_t size);
+
+// How guest memory is laid out in buffers (build with ULTRA_NATIVE_WORDS):
+//   0  guest (big endian) byte order, every halfword/word/doubleword access
+//      is byteswapped.
+//   1  host native 32 bit words (little endian hosts), word accesses need no
+//      swap. Bytes and halfwords are found by XORing the offset with 3 and 2,
+//      a doubleword is its two words with the halves exchanged.
+// Buffers have to start on a 4 byte boundary either way.
+#ifndef MEMORY_NATIVE_WORDS
+#define MEMORY_NATIVE_WORDS         0
+#endif
+
+// where the guest byte at `offset` into a buffer actually is
+constexpr uint32_t memory_byte_offset(uint32_t offset) {
+    return MEMORY_NATIVE_WORDS ? offset ^ 3 : offset;
+}
+
+bool memory_install_buffer(
     uint32_t start, uint32_t end,
-    std::function<void(uint32_t, uint32_t, void*)>&& read,
-    std::function<void(uint32_t, uint32_t, const void*)>&& write,
+    uint8_t* buffer, bool writable,
+    memory_write_notify_t on_write,
     const char* name
 );
 
-bool memory_read(uint32_t address, uint32_t size, void* data);
-bool memory_write(uint32_t address, uint32_t size, const void* data);
+// host memory behind a physical address, nullptr if it isn't in the page table
+const uint8_t* memory_get_host_pointer(uint32_t physical_address);
+
+// Optional host virtual memory fastmem for loads (see fastmem.h), buffers
+// have to be page aligned to take part. False if the host doesn't support it.
+bool memory_enable_fastmem(bool enabled);
+bool memory_fastmem_enabled();
+
+// virtual -> physical, false on a TLB miss
+bool memory_translate(uint32_t address, uint32_t& physical_address);
+
+// The 32 entry joint TLB behind KSSEG and KSEG3. Lookups go through a direct
+// mapped micro-TLB of 4 KB pages first, which is dropped whenever an entry is
+// written or the current ASID changes.
+#define TLB_NUM_ENTRIES             32
+
+#define TLB_ENTRY_GLOBAL            0x01
+#define TLB_ENTRY_VALID             0x02
+#define TLB_ENTRY_DIRTY             0x04
+
+// laid out like the COP0 registers it's loaded from
+struct TlbEntry {
+    uint32_t page_mask;
+    uint32_t entry_hi;
+    uint32_t entry_lo0;
+    uint32_t entry_lo1;
+};
+
+struct TlbStats {
+    // translations answered by the micro-TLB
+    uint64_t hits;
+
+    // translations that had to search the TLB, and those that found nothing
+    uint64_t misses;
+    uint64_t faults;
+
+    // times the micro-TLB was dropped
+    uint64_t flushes;
+};
+
+void memory_tlb_write(int index, const TlbEntry& entry);
+TlbEntry memory_tlb_read(int index);
+
+// index of the entry matching EntryHi's VPN2 and ASID, -1 if there's none
+int memory_tlb_probe(uint32_t entry_hi);
+
+// ASID from COP0 EntryHi that non global entries have to match
+void memory_tlb_set_asid(uint8_t asid);
+
+// clears every entry
+void memory_tlb_reset();
+
+// called after anything that changes how virtual addresses translate, so
+// code cached by virtual address can be dropped
+void memory_set_tlb_listener(void(*listener)());
+
+TlbStats memory_get_tlb_stats();
+
+// T is uint8_t, uint16_t, uint32_t or uint64_t. Guest memory is big endian,
+// values are converted to and from host order.
+template<typename T>
+bool memory_read(uint32_t address, T& value);
+
+template<typename T>
+bool memory_write(uint32_t address, T value);
+
+extern template bool memory_read<uint8_t>(uint32_t, uint8_t&);
+extern template bool memory_read<uint16_t>(uint32_t, uint16_t&);
+extern template bool memory_read<uint32_t>(uint32_t, uint32_t&);
+extern template bool memory_read<uint64_t>(uint32_t, uint64_t&);
+
+extern template bool memory_write<uint8_t>(uint32_t, uint8_t);
+extern template bool memory_write<uint16_t>(uint32_t, uint16_t);
+extern template bool memory_write<uint32_t>(uint32_t, uint32_t);
+extern template bool memory_write<uint64_t>(uint32_t, uint64_t);
+
 bool memory_do_dma(uint32_t dst, uint32_t src, uint32_t size);
 
-bool memory_read8(uint32_t address, uint8_t&);
-bool memory_read16(uint32_t address, uint16_t&);
-bool memory_read32(uint32_t address, uint32_t&);
+// DMA copied on a worker thread, for transfers the guest only sees the end
+// of. Until memory_finish_async_dma() its destination pages are off the page
+// table, so the first access (or other DMA) touching them waits for the copy.
+// Only used from read only memory into a single buffer; anything else, and
+// anything under MEMORY_ASYNC_DMA_MIN_SIZE, is copied straight away with
+// memory_do_dma(). A new transfer finishes the previous one first.
+#define MEMORY_ASYNC_DMA_MIN_SIZE   KB(4)
 
-bool memory_write8(uint32_t address, uint8_t data);
-bool memory_write16(uint32_t address, uint16_t data);
-bool memory_write32(uint32_t address, uint32_t data);
+struct AsyncDmaStats {
+    // transfers handed to the worker
+    uint64_t transfers;
 
-void memory_load_rom(const char* path, bool swap);
-CartHeader* memory_get_rom_header();
+    // times the cpu thread had to wait for one to finish copying
+    uint64_t waits;
+};
+
+bool memory_do_dma_async(uint32_t dst, uint32_t src, uint32_t size);
+
+// waits for the transfer in flight, if any, and makes its pages accessible
+void memory_finish_async_dma();
+bool memory_async_dma_pending();
 
-void default_buffer_read(const void* buffer, uint32_t addr, uint32_t size, void* dst);
-void default_buffer_write(void* buffer, uint32_t addr, uint32_t size, const void* src);
\ No newline at end of file
+AsyncDmaStats memory_get_async_dma_stats();
+
+inline bool memory_read8(uint32_t address, uint8_t& value) { return memory_read(address, value); }
+inline bool memory_read16(uint32_t address, uint16_t& value) { return memory_read(address, value); }
+inline bool memory_read32(uint32_t address, uint32_t& value) { return memory_read(address, value); }
+inline bool memory_read64(uint32_t address, uint64_t& value) { return memory_read(address, value); }
+
+inline bool memory_write8(uint32_t address, uint8_t data) { return memory_write(address, data); }
+inline bool memory_write16(uint32_t address, uint16_t data) { return memory_write(address, data); }
+inline bool memory_write32(uint32_t address, uint32_t data) { return memory_write(address, data); }
+inline bool memory_write64(uint32_t address, uint64_t data) { return memory_write(address, data); }
+
+// RDRAM dirty page tracking. Every write path into RDRAM (CPU stores, DMA)
+// reports through memory_rdram_written(), which sets the page's dirty bit and
+// stamps it with a new write generation. Dirty bits are cleared by whoever
+// consumes them (savestates, framebuffer change detection); generations never
+// go backwards so several consumers can each remember where they got up to.
+#define RDRAM_SIZE                  MB(8)
+#define RDRAM_PAGE_SHIFT            12
+#define RDRAM_PAGE_SIZE             (1 << RDRAM_PAGE_SHIFT)
+#define RDRAM_NUM_PAGES             (RDRAM_SIZE >> RDRAM_PAGE_SHIFT)
+
+void memory_rdram_written(uint32_t address, uint32_t size);
+
+bool memory_rdram_is_dirty(uint32_t address, uint32_t size);
+void memory_rdram_clear_dirty(uint32_t address, uint32_t size);
+
+// writes the address of each dirty page in the range to pages, up to
+// max_pages of them, returns how many
+int memory_rdram_collect_dirty(uint32_t address, uint32_t size, uint32_t* pages, int max_pages);
+
+// generation of the most recent write anywhere / to the page holding address
+uint64_t memory_rdram_get_generation();
+uint64_t memory_rdram_get_page_generation(uint32_t address);
+
+// any page in the range written after `generation`
+bool memory_rdram_written_since(uint32_t address, uint32_t size, uint64_t generation);
+
+// Puts an image on the cartridge bus in the memory layout, its byte order
+// (z64/v64/n64) is picked up from the header. False if it can't be read.
+// Where the host can, the file is mapped rather than read (see rom_map()):
+// nothing is loaded until the guest touches it, and on Linux byteswapped
+// pages are converted as they're touched (optionally into memory shared by
+// every process running the same image, see rom_set_shared_dir()). Otherwise,
+// or with mapping disabled, it's copied into the cartridge buffer. cpu_init()
+// unloads it.
+bool memory_load_rom(const char* path);
+void memory_enable_rom_mapping(bool enabled);
+
+// back to an empty cartridge
+void memory_unload_rom();
+
+// host pages of a mapped byteswapped image this load converted itself
+size_t memory_get_rom_converted_pages();
+
+// straight over the cartridge image, so also in the memory layout
+CartHeader* memory_get_rom_header();
@@ -10,6 +10,19 @@
 #define bswap_32(x)             OSSwapInt32(x)
 #define bswap_64(x)             OSSwapInt64(x)
 
+// bswap_16/32/64 picked by width, bytes are left alone
+template<typename T>
+constexpr T byteswap(T value) {
+    if constexpr (sizeof(T) == 2)
+        return bswap_16(value);
+    else if constexpr (sizeof(T) == 4)
+        return bswap_32(value);
+    else if constexpr (sizeof(T) == 8)
+        return bswap_64(value);
+    else
+        return value;
+}
+
 #define KB(value)                (value * 1024)
 #define MB(value)                (KB(value) * 1024)
 
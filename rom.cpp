@@ -0,0 +1,586 @@
+#include "rom.h"
+
+#include "memory.h"
+#include "platform.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ROM_X86 1
+#include <immintrin.h>
+#else
+#define ROM_X86 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ROM_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define ROM_MMAP 0
+#endif
+
+// converting on touch needs memfd_create
+#if defined(__linux__)
+#define ROM_LAZY 1
+#include <atomic>
+#include <mutex>
+#include <signal.h>
+#else
+#define ROM_LAZY 0
+#endif
+
+// the guest starts by DMAing its boot code from the first megabyte
+#define ROM_BOOT_SIZE               MB(1)
+#define ROM_MAX_LAZY_IMAGES         8
+// pages converted and opened per fault, an aligned 64 KB with 4 KB pages
+#define ROM_FAULT_AROUND            16
+
+// where each byte of a 4 byte group comes from, out[i] = in[pattern[i]]
+using RomShuffle = uint8_t[4];
+
+static constexpr RomShuffle shuffle_none = { 0, 1, 2, 3 };
+static constexpr RomShuffle shuffle_bytes = { 1, 0, 3, 2 };
+static constexpr RomShuffle shuffle_words = { 3, 2, 1, 0 };
+static constexpr RomShuffle shuffle_halves = { 2, 3, 0, 1 };
+
+static const uint8_t* rom_get_shuffle(RomFormat format)
+{
+#if MEMORY_NATIVE_WORDS
+    switch (format)
+    {
+        case RomFormat::Z64: return shuffle_words;
+        case RomFormat::V64: return shuffle_halves;
+        default: return shuffle_none;
+    }
+#else
+    switch (format)
+    {
+        case RomFormat::V64: return shuffle_bytes;
+        case RomFormat::N64: return shuffle_words;
+        default: return shuffle_none;
+    }
+#endif
+}
+
+RomFormat rom_detect_format(const uint8_t* data, size_t size)
+{
+    if (size < 4)
+        return RomFormat::Unknown;
+
+    const uint32_t magic = uint32_t(data[0]) << 24 | data[1] << 16 | data[2] << 8 | data[3];
+
+    switch (magic)
+    {
+        case 0x80371240: return RomFormat::Z64;
+        case 0x37804012: return RomFormat::V64;
+        case 0x40123780: return RomFormat::N64;
+    }
+
+    return RomFormat::Unknown;
+}
+
+const char* rom_format_name(RomFormat format)
+{
+    switch (format)
+    {
+        case RomFormat::Z64: return "z64";
+        case RomFormat::V64: return "v64";
+        case RomFormat::N64: return "n64";
+        default: return "unknown";
+    }
+}
+
+static void rom_shuffle_scalar(uint8_t* data, size_t words, const uint8_t* shuffle)
+{
+    auto* end = data + words * 4;
+
+    if (shuffle == shuffle_words)
+    {
+        for (; data != end; data += 4)
+        {
+            uint32_t word;
+            memcpy(&word, data, 4);
+            word = bswap_32(word);
+            memcpy(data, &word, 4);
+        }
+    }
+    else if (shuffle == shuffle_bytes)
+    {
+        for (; data != end; data += 4)
+        {
+            uint32_t word;
+            memcpy(&word, data, 4);
+            word = (word & 0x00FF00FF) << 8 | (word >> 8 & 0x00FF00FF);
+            memcpy(data, &word, 4);
+        }
+    }
+    else if (shuffle == shuffle_halves)
+    {
+        for (; data != end; data += 4)
+        {
+            uint32_t word;
+            memcpy(&word, data, 4);
+            word = word << 16 | word >> 16;
+            memcpy(data, &word, 4);
+        }
+    }
+}
+
+#if ROM_X86
+__attribute__((target("ssse3")))
+static size_t rom_shuffle_ssse3(uint8_t* data, size_t words, const uint8_t* s)
+{
+    const auto mask = _mm_setr_epi8(
+        s[0], s[1], s[2], s[3], 4 + s[0], 4 + s[1], 4 + s[2], 4 + s[3],
+        8 + s[0], 8 + s[1], 8 + s[2], 8 + s[3], 12 + s[0], 12 + s[1], 12 + s[2], 12 + s[3]);
+
+    const size_t blocks = words / 4;
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        auto* p = (__m128i*)(data + i * 16);
+        _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), mask));
+    }
+
+    return blocks * 4;
+}
+
+__attribute__((target("avx2")))
+static size_t rom_shuffle_avx2(uint8_t* data, size_t words, const uint8_t* s)
+{
+    // the shuffle stays within each 128 bit lane, so both lanes get the same mask
+    const auto mask = _mm256_setr_epi8(
+        s[0], s[1], s[2], s[3], 4 + s[0], 4 + s[1], 4 + s[2], 4 + s[3],
+        8 + s[0], 8 + s[1], 8 + s[2], 8 + s[3], 12 + s[0], 12 + s[1], 12 + s[2], 12 + s[3],
+        s[0], s[1], s[2], s[3], 4 + s[0], 4 + s[1], 4 + s[2], 4 + s[3],
+        8 + s[0], 8 + s[1], 8 + s[2], 8 + s[3], 12 + s[0], 12 + s[1], 12 + s[2], 12 + s[3]);
+
+    const size_t blocks = words / 8;
+
+    // two registers a go to keep the load and store ports busy
+    size_t i = 0;
+
+    for (; i + 2 <= blocks; i += 2)
+    {
+        auto* p = (__m256i*)(data + i * 32);
+        const auto a = _mm256_loadu_si256(p);
+        const auto b = _mm256_loadu_si256(p + 1);
+        _mm256_storeu_si256(p, _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256(p + 1, _mm256_shuffle_epi8(b, mask));
+    }
+
+    for (; i < blocks; i++)
+    {
+        auto* p = (__m256i*)(data + i * 32);
+        _mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), mask));
+    }
+
+    return blocks * 8;
+}
+#endif
+
+void rom_convert_scalar(uint8_t* data, size_t size, RomFormat format)
+{
+    rom_shuffle_scalar(data, size / 4, rom_get_shuffle(format));
+}
+
+void rom_convert(uint8_t* data, size_t size, RomFormat format)
+{
+    const auto* shuffle = rom_get_shuffle(format);
+    size_t words = size / 4;
+
+    if (shuffle == shuffle_none)
+        return;
+
+#if ROM_X86
+    size_t done{};
+
+    if (__builtin_cpu_supports("avx2"))
+        done = rom_shuffle_avx2(data, words, shuffle);
+    else if (__builtin_cpu_supports("ssse3"))
+        done = rom_shuffle_ssse3(data, words, shuffle);
+
+    data += done * 4;
+    words -= done;
+#endif
+
+    rom_shuffle_scalar(data, words, shuffle);
+}
+
+#if ROM_MMAP
+static size_t host_page_size;
+#endif
+
+#if ROM_LAZY
+// A lazily converted image. The view everyone reads is a PROT_NONE mapping of
+// shared memory: a page is converted into it through a second, writable
+// mapping (the alias) and only then opened up. After the image the memory
+// holds a ready byte per page.
+//
+// With a shared directory the memory is a file there named after the image's
+// contents, so every process mapping the same image converts into, and holds,
+// the same pages. Two converting the same page at once write the same bytes,
+// so there's nothing to lock.
+struct LazyRom
+{
+    std::atomic<uint8_t*> view;
+    uint8_t* alias;
+    const uint8_t* source;      // the file itself
+    size_t size;                // whole pages of the file
+    RomFormat format;
+    std::atomic<uint8_t>* ready;
+    std::atomic<size_t> converted;
+};
+
+static LazyRom lazy_roms[ROM_MAX_LAZY_IMAGES];
+static std::mutex lazy_mutex;
+static struct sigaction previous_action{};
+static bool handler_installed{};
+// empty for no sharing, see rom_set_shared_dir()
+static std::string shared_dir;
+
+// the faulting page's group of ROM_FAULT_AROUND
+static void rom_open_pages(LazyRom& rom, size_t page)
+{
+    const auto first = page & ~size_t(ROM_FAULT_AROUND - 1);
+    const auto last = std::min(first + ROM_FAULT_AROUND, rom.size / host_page_size);
+
+    for (page = first; page < last; page++)
+    {
+        if (rom.ready[page].load(std::memory_order_acquire))
+            continue;
+
+        // converted off to the side a chunk at a time, the page never holds
+        // anything but converted bytes
+        alignas(32) uint8_t chunk[KB(4)];
+        const auto offset = page * host_page_size;
+
+        for (size_t done = 0; done < host_page_size; done += sizeof(chunk))
+        {
+            memcpy(chunk, rom.source + offset + done, sizeof(chunk));
+            rom_convert(chunk, sizeof(chunk), rom.format);
+            memcpy(rom.alias + offset + done, chunk, sizeof(chunk));
+        }
+
+        rom.ready[page].store(1, std::memory_order_release);
+        rom.converted++;
+    }
+
+    mprotect(rom.view.load() + first * host_page_size, (last - first) * host_page_size, PROT_READ);
+}
+
+static void rom_fault_handler(int signal, siginfo_t* info, void* context)
+{
+    const auto* address = (const uint8_t*)info->si_addr;
+
+    for (auto& rom : lazy_roms)
+    {
+        const auto* view = rom.view.load();
+
+        if (view && address >= view && address < view + rom.size)
+        {
+            rom_open_pages(rom, size_t(address - view) / host_page_size);
+            return;
+        }
+    }
+
+    // not ours, pass it down. A default action can only happen with the
+    // handler out of the way, the instruction then faults again.
+    if (previous_action.sa_flags & SA_SIGINFO)
+        previous_action.sa_sigaction(signal, info, context);
+    else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN)
+        previous_action.sa_handler(signal);
+    else
+        sigaction(SIGSEGV, &previous_action, nullptr);
+}
+
+static bool rom_install_handler()
+{
+    if (handler_installed)
+        return true;
+
+    // SA_NODEFER: other fault handlers (fastmem) read the cartridge from
+    // inside their own SIGSEGV
+    struct sigaction action{};
+    action.sa_sigaction = rom_fault_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+
+    handler_installed = sigaction(SIGSEGV, &action, &previous_action) == 0;
+    return handler_installed;
+}
+
+static LazyRom* rom_find_lazy(const uint8_t* data)
+{
+    for (auto& rom : lazy_roms)
+    {
+        if (rom.view.load() == data)
+            return &rom;
+    }
+
+    return nullptr;
+}
+
+static uint64_t rom_rotl(uint64_t value, int bits)
+{
+    return value << bits | value >> (64 - bits);
+}
+
+// content hash naming the shared conversions, four lanes of xxHash64's round
+static uint64_t rom_hash(const uint8_t* data, size_t size)
+{
+    constexpr uint64_t p1 = 0x9E3779B185EBCA87;
+    constexpr uint64_t p2 = 0xC2B2AE3D27D4EB4F;
+
+    uint64_t lanes[4] = { p1 + p2, p2, 0, 0 - p1 };
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        for (int lane = 0; lane < 4; lane++)
+        {
+            uint64_t word;
+            memcpy(&word, data + i + lane * 8, 8);
+            lanes[lane] = rom_rotl(lanes[lane] + word * p2, 31) * p1;
+        }
+    }
+
+    uint64_t hash = size;
+
+    for (auto lane : lanes)
+        hash = rom_rotl(hash ^ lane, 27) * p1 + p2;
+
+    for (; i < size; i++)
+        hash = rom_rotl(hash ^ data[i] * p1, 11) * p2;
+
+    hash ^= hash >> 33;
+    hash *= p2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// the shared file for an image, -1 if there's no shared directory or the
+// file is unusable (someone else's, or the wrong size)
+static int rom_open_shared(const uint8_t* source, size_t size, size_t total)
+{
+    // hashing reads the whole file, only worth it when there's something to share
+    if (shared_dir.empty())
+        return -1;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/ultra-rom-%016llx-%s",
+        (unsigned long long)rom_hash(source, size), MEMORY_NATIVE_WORDS ? "native" : "be");
+
+    // the name is predictable and the directory may be world writable (like
+    // /dev/shm), so no following links and nothing but a file of our own
+    const int fd = open((shared_dir + name).c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+
+    if (fd < 0)
+        return -1;
+
+    // a new file is all zeros, nothing converted yet
+    struct stat st{};
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid()
+        || (st.st_size != off_t(total) && (st.st_size != 0 || ftruncate(fd, total) != 0)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// the file's pages from `data` on, the caller unmaps `source` on failure
+static bool rom_map_lazy(uint8_t* data, const uint8_t* source, size_t size, RomFormat format, bool& shared)
+{
+    std::lock_guard lock(lazy_mutex);
+
+    if (!rom_install_handler())
+        return false;
+
+    LazyRom* rom = rom_find_lazy(nullptr);
+
+    if (!rom)
+        return false;
+
+    const size_t pages = size / host_page_size;
+    const size_t total = size + ((pages + host_page_size - 1) & ~(host_page_size - 1));
+
+    int fd = rom_open_shared(source, size, total);
+    shared = fd >= 0;
+
+    if (!shared && ((fd = memfd_create("ultra-rom", MFD_CLOEXEC)) < 0 || ftruncate(fd, total) != 0))
+    {
+        if (fd >= 0)
+            close(fd);
+
+        return false;
+    }
+
+    void* alias = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (alias == MAP_FAILED || mmap(data, size, PROT_NONE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        if (alias != MAP_FAILED)
+            munmap(alias, total);
+
+        close(fd);
+        return false;
+    }
+
+    // the mappings keep the memory alive
+    close(fd);
+
+    rom->alias = (uint8_t*)alias;
+    rom->source = source;
+    rom->size = size;
+    rom->format = format;
+    rom->ready = (std::atomic<uint8_t>*)(rom->alias + size);
+    rom->converted = 0;
+    rom->view = data;
+
+    // what other processes converted already is open from the start
+    for (size_t page = 0; page < pages;)
+    {
+        const auto first = page;
+
+        while (page < pages && rom->ready[page].load(std::memory_order_acquire))
+            page++;
+
+        if (page > first)
+            mprotect(data + first * host_page_size, (page - first) * host_page_size, PROT_READ);
+
+        page += page == first;
+    }
+
+    return true;
+}
+#elif ROM_MMAP
+// the caller falls back to copying the image
+static bool rom_map_lazy(uint8_t*, const uint8_t*, size_t, RomFormat, bool&)
+{
+    return false;
+}
+#endif
+
+void rom_set_shared_dir(const char* dir)
+{
+#if ROM_LAZY
+    shared_dir = dir ? dir : "";
+#endif
+}
+
+bool rom_map_is_supported()
+{
+    return ROM_MMAP;
+}
+
+bool rom_lazy_is_supported()
+{
+    return ROM_LAZY;
+}
+
+bool rom_map(const char* path, size_t capacity, RomImage& image)
+{
+#if ROM_MMAP
+    host_page_size = size_t(sysconf(_SC_PAGESIZE));
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return false;
+
+    struct stat st{};
+    uint8_t magic[4]{};
+
+    if (fstat(fd, &st) != 0 || pread(fd, magic, sizeof(magic), 0) < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    const auto size = std::min<size_t>(st.st_size, capacity);
+    const auto mapped = (size + host_page_size - 1) & ~(host_page_size - 1);
+    const auto format = rom_detect_format(magic, size);
+    const bool lazy = rom_get_shuffle(format) != shuffle_none;
+    bool shared{};
+
+    // reads past the file (but inside the capacity) see zeros
+    void* data = mmap(nullptr, capacity, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    void* source = MAP_FAILED;
+
+    if (data != MAP_FAILED && mapped)
+    {
+        // in the memory layout already the file goes straight in, otherwise
+        // it's kept aside for the pages to be converted from
+        source = mmap(lazy ? nullptr : data, mapped, PROT_READ, MAP_PRIVATE | (lazy ? 0 : MAP_FIXED), fd, 0);
+    }
+
+    close(fd);
+
+    if (data == MAP_FAILED || (mapped && source == MAP_FAILED)
+        || (lazy && mapped && !rom_map_lazy((uint8_t*)data, (const uint8_t*)source, mapped, format, shared)))
+    {
+        if (lazy && source != MAP_FAILED)
+            munmap(source, mapped);
+
+        if (data != MAP_FAILED)
+            munmap(data, capacity);
+
+        return false;
+    }
+
+    if (mapped)
+        madvise(source, std::min<size_t>(mapped, ROM_BOOT_SIZE), MADV_WILLNEED);
+
+    image = { (uint8_t*)data, capacity, size, format, lazy && mapped, shared };
+    return true;
+#else
+    return false;
+#endif
+}
+
+void rom_unmap(RomImage& image)
+{
+#if ROM_MMAP
+    if (!image.data)
+        return;
+
+#if ROM_LAZY
+    if (image.lazy)
+    {
+        std::lock_guard lock(lazy_mutex);
+
+        if (auto* rom = rom_find_lazy(image.data))
+        {
+            rom->view = nullptr;
+            munmap(rom->alias, (uint8_t*)rom->ready - rom->alias + rom->size / host_page_size);
+            munmap((void*)rom->source, rom->size);
+        }
+    }
+#endif
+
+    munmap(image.data, image.capacity);
+#endif
+
+    image = {};
+}
+
+size_t rom_converted_pages(const RomImage& image)
+{
+#if ROM_LAZY
+    std::lock_guard lock(lazy_mutex);
+
+    if (const auto* rom = image.lazy ? rom_find_lazy(image.data) : nullptr)
+        return rom->converted;
+#endif
+
+    return 0;
+}
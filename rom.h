@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Cartridge images come in three byte orders, told apart by the first word
+// of the header (0x80371240 in big endian):
+//   z64  big endian, the cartridge's own order
+//   v64  16 bit words byteswapped (Doctor V64)
+//   n64  32 bit words byteswapped
+enum class RomFormat
+{
+    Z64,
+    V64,
+    N64,
+    Unknown,
+};
+
+// from the first 4 bytes of the image, Unknown if there are fewer
+RomFormat rom_detect_format(const uint8_t* data, size_t size);
+
+const char* rom_format_name(RomFormat format);
+
+// Converts an image in place from its format to the memory layout (see
+// MEMORY_NATIVE_WORDS). A trailing partial word is left as it is. Uses the
+// widest shuffle the host has (AVX2, SSSE3), plain word swaps otherwise.
+void rom_convert(uint8_t* data, size_t size, RomFormat format);
+
+// the same conversion without SIMD, for comparison
+void rom_convert_scalar(uint8_t* data, size_t size, RomFormat format);
+
+// An image mapped straight from its file (POSIX hosts). Pages already in the
+// memory layout are the file's own page cache, nothing is read up front. Any
+// other format (Linux only, rom_map() fails elsewhere) is mapped inaccessible
+// and each page is converted the first time something touches it, from a
+// SIGSEGV handler.
+struct RomImage
+{
+    uint8_t* data;          // `capacity` bytes, zero past the end of the file
+    size_t capacity;
+    size_t size;            // bytes that came from the file
+    RomFormat format;
+    bool lazy;              // pages are converted on first touch
+    bool shared;            // ... into memory shared with other processes
+};
+
+bool rom_map_is_supported();
+
+// byteswapped images can be mapped too
+bool rom_lazy_is_supported();
+
+// maps at most `capacity` bytes of the file, false if it can't be opened or
+// mapped. An Unknown header is mapped as z64.
+bool rom_map(const char* path, size_t capacity, RomImage& image);
+
+// nothing may touch the image any more
+void rom_unmap(RomImage& image);
+
+// pages of a lazy image this mapping converted itself, pages some other
+// mapping of the same image had already converted don't count
+size_t rom_converted_pages(const RomImage& image);
+
+// Off by default. Lazy images then convert into a file in `dir` (/dev/shm,
+// say) named after their contents, so every process running the same image
+// shares one converted copy and finds the pages converted by those before it.
+// Naming the file means hashing the whole image when it's mapped. The files
+// stay behind for the next run, one per image, until removed. nullptr turns
+// it back off.
+void rom_set_shared_dir(const char* dir);
@@ -0,0 +1,150 @@
+#include "scheduler.h"
+
+#include <utility>
+
+#define NUM_EVENTS                  int(SchedulerEvent::NumEvents)
+
+struct ScheduledEvent
+{
+    uint64_t cycle;
+    SchedulerEvent event;
+};
+
+uint64_t scheduler_next_cycle{UINT64_MAX};
+
+// binary min-heap on cycle, heap_index tracks where each event sits so it
+// can be moved or cancelled without searching
+static ScheduledEvent heap[NUM_EVENTS];
+static int heap_size{};
+static int heap_index[NUM_EVENTS];
+static scheduler_handler_t handlers[NUM_EVENTS]{};
+
+static void scheduler_swap(int a, int b)
+{
+    std::swap(heap[a], heap[b]);
+    heap_index[int(heap[a].event)] = a;
+    heap_index[int(heap[b].event)] = b;
+}
+
+static void scheduler_sift_up(int i)
+{
+    while (i > 0)
+    {
+        const int parent = (i - 1) / 2;
+
+        if (heap[parent].cycle <= heap[i].cycle)
+            break;
+
+        scheduler_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void scheduler_sift_down(int i)
+{
+    while (true)
+    {
+        const int left = i * 2 + 1;
+        const int right = left + 1;
+        int smallest = i;
+
+        if (left < heap_size && heap[left].cycle < heap[smallest].cycle)
+            smallest = left;
+
+        if (right < heap_size && heap[right].cycle < heap[smallest].cycle)
+            smallest = right;
+
+        if (smallest == i)
+            break;
+
+        scheduler_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void scheduler_remove_at(int i)
+{
+    heap_index[int(heap[i].event)] = -1;
+    heap_size--;
+
+    if (i != heap_size)
+    {
+        heap[i] = heap[heap_size];
+        heap_index[int(heap[i].event)] = i;
+        scheduler_sift_up(i);
+        scheduler_sift_down(heap_index[int(heap[i].event)]);
+    }
+}
+
+static void scheduler_update_next_cycle()
+{
+    scheduler_next_cycle = heap_size ? heap[0].cycle : UINT64_MAX;
+}
+
+void scheduler_init()
+{
+    heap_size = 0;
+
+    for (auto& index : heap_index)
+        index = -1;
+
+    scheduler_update_next_cycle();
+}
+
+void scheduler_set_handler(SchedulerEvent event, scheduler_handler_t handler)
+{
+    handlers[int(event)] = handler;
+}
+
+void scheduler_schedule(SchedulerEvent event, uint64_t cycle)
+{
+    auto i = heap_index[int(event)];
+
+    if (i < 0)
+    {
+        i = heap_size++;
+        heap[i].event = event;
+        heap_index[int(event)] = i;
+    }
+
+    heap[i].cycle = cycle;
+    scheduler_sift_up(i);
+    scheduler_sift_down(heap_index[int(event)]);
+    scheduler_update_next_cycle();
+}
+
+void scheduler_cancel(SchedulerEvent event)
+{
+    const auto i = heap_index[int(event)];
+
+    if (i < 0)
+        return;
+
+    scheduler_remove_at(i);
+    scheduler_update_next_cycle();
+}
+
+bool scheduler_is_pending(SchedulerEvent event)
+{
+    return heap_index[int(event)] >= 0;
+}
+
+uint64_t scheduler_get_event_cycle(SchedulerEvent event)
+{
+    const auto i = heap_index[int(event)];
+    return i < 0 ? UINT64_MAX : heap[i].cycle;
+}
+
+void scheduler_run_due(uint64_t now)
+{
+    while (heap_size && heap[0].cycle <= now)
+    {
+        const auto due = heap[0];
+
+        scheduler_remove_at(0);
+        scheduler_update_next_cycle();
+
+        if (auto handler = handlers[int(due.event)])
+            handler(due.cycle);
+    }
+}
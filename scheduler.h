@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+// Everything that happens at a point in time rather than in response to an
+// instruction is posted here, keyed by cycle_counter. The run loops only
+// compare the cycle count against scheduler_next_cycle between dispatches.
+enum class SchedulerEvent
+{
+    // COP0 count reaching compare
+    CountCompare,
+
+    // VI starting a new line (and every VI_NUM_LINES lines, a new frame)
+    ViLine,
+
+    // DMA transfers finishing
+    PiDma,
+    SiDma,
+    SpDma,
+
+    NumEvents,
+};
+
+// called with the cycle the event was due, which can be slightly earlier
+// than the current cycle count (events are only checked between dispatches)
+using scheduler_handler_t = void(*)(uint64_t due_cycle);
+
+// cycle the earliest pending event is due, UINT64_MAX when nothing is pending
+extern uint64_t scheduler_next_cycle;
+
+// drops every pending event, handlers stay registered
+void scheduler_init();
+
+void scheduler_set_handler(SchedulerEvent event, scheduler_handler_t handler);
+
+// each event is pending at most once, scheduling it again moves it
+void scheduler_schedule(SchedulerEvent event, uint64_t cycle);
+void scheduler_cancel(SchedulerEvent event);
+
+bool scheduler_is_pending(SchedulerEvent event);
+uint64_t scheduler_get_event_cycle(SchedulerEvent event);
+
+// runs every event due at or before `now` in cycle order, including ones the
+// handlers schedule while this runs
+void scheduler_run_due(uint64_t now);
@@ -2,9 +2,18 @@
 #include "cpu.h"
 #include "cpu_types.h"
 #include "disassembler.h"
+#include "fastmem.h"
+#include "icache.h"
+#include "memory.h"
+#include "rom.h"
+#include "trace.h"
+#include "magic_enum.hpp"
 
 #include <cstring>
+#include <filesystem>
 #include <functional>
+#include <iterator>
+#include <vector>
 
 // Mac OS X / Darwin features
 #include <libkern/OSByteOrder.h>
@@ -12,7 +21,13 @@
 #define bswap_32(x)             OSSwapInt32(x)
 #define bswap_64(x)             OSSwapInt64(x)
 
-extern uint8_t rdram[MB(8)];
+extern uint8_t rdram[RDRAM_SIZE];
+extern uint8_t cartridge_rom[MB(64)];
+extern uint64_t branch_delay_slot_address;
+
+// Implemented in cpu.cpp
+void cpu_get_cop0_register(int index, uint64_t& value);
+void cpu_set_cop0_register(int index, uint64_t value);
 
 void cpu_test_reset()
 {
@@ -28,4 +43,1267 @@ bool cpu_execute_single(InstructionType type, ExecutionContext context, std::fun
     }
 
     return false;
-}
\ No newline at end of file
+}
+
+static constexpr uint32_t encode_i(uint32_t op, uint32_t rs, uint32_t rt, uint16_t imm)
+{
+    return SET_INST_BITS(op) | SET_RS_BITS(rs) | SET_RT_BITS(rt) | SET_IMM_BITS(imm);
+}
+
+static constexpr uint32_t encode_r(uint32_t rs, uint32_t rt, uint32_t rd, uint32_t sa, uint32_t func)
+{
+    return SET_RS_BITS(rs) | SET_RT_BITS(rt) | SET_RD_BITS(rd) | SET_SHIFT_BITS(sa) | SET_FUNC_BITS(func);
+}
+
+// Writes a small arithmetic/load/store loop into RDRAM, terminated by an
+// opcode we don't implement so the run loops stop there. Returns its entry pc.
+uint64_t cpu_test_load_loop_program(uint32_t iterations)
+{
+    enum { zero = 0, t0 = 8, t1 = 9, t2 = 10, t3 = 11, t4 = 12, t5 = 13, t6 = 14, t7 = 15, t8 = 24 };
+
+    const uint32_t program[] = {
+        encode_i(0x0F, 0, t0, iterations >> 16),        // lui   t0, hi(iterations)
+        encode_i(0x0D, t0, t0, iterations & 0xFFFF),    // ori   t0, t0, lo(iterations)
+        encode_i(0x0F, 0, t1, 0x8020),                  // lui   t1, 0x8020
+        encode_i(0x09, t2, t2, 3),                      // loop: addiu t2, t2, 3
+        encode_r(t3, t2, t3, 0, 0x21),                  // addu  t3, t3, t2
+        encode_r(t3, t0, t4, 0, 0x26),                  // xor   t4, t3, t0
+        encode_r(0, t4, t5, 2, 0x00),                   // sll   t5, t4, 2
+        encode_i(0x2B, t1, t5, 0),                      // sw    t5, 0(t1)
+        encode_i(0x23, t1, t6, 0),                      // lw    t6, 0(t1)
+        encode_r(t6, t2, t7, 0, 0x25),                  // or    t7, t6, t2
+        encode_r(t7, t3, t6, 0, 0x23),                  // subu  t6, t7, t3
+        encode_r(t6, t4, t5, 0, 0x27),                  // nor   t5, t6, t4
+        encode_r(0, t5, t4, 7, 0x02),                   // srl   t4, t5, 7
+        encode_r(t4, t6, t7, 0, 0x2A),                  // slt   t7, t4, t6
+        encode_r(t5, t3, t7, 0, 0x2B),                  // sltu  t7, t5, t3
+        encode_i(0x0B, t4, t8, 0x8000),                 // sltiu t8, t4, 0x8000
+        encode_i(0x08, t6, t6, 0x7FF0),                 // addi  t6, t6, 0x7FF0
+        encode_r(t6, 0, 0, 0, 0x11),                    // mthi  t6
+        encode_r(0, 0, t5, 0, 0x10),                    // mfhi  t5
+        encode_i(0x0E, t5, t5, 0xA5A5),                 // xori  t5, t5, 0xA5A5
+        encode_i(0x09, t0, t0, 0xFFFF),                 // addiu t0, t0, -1
+        encode_i(0x05, t0, zero, 0xFFED),               // bne   t0, zero, loop
+        encode_i(0x0C, t2, t8, 0x00FF),                 // andi  t8, t2, 0xFF
+        SET_INST_BITS(0x3Fu),                           // unimplemented, stops the cpu
+    };
+
+    const uint32_t entry = 0x80100000;
+
+    for (size_t i = 0; i < std::size(program); i++)
+        memory_write32(entry + i * 4, program[i]);
+
+    return 0xFFFFFFFF00000000 | entry;
+}
+
+static uint32_t test_random_state{0x12345678};
+
+static uint32_t test_random()
+{
+    // xorshift32, deterministic across runs
+    test_random_state ^= test_random_state << 13;
+    test_random_state ^= test_random_state >> 17;
+    test_random_state ^= test_random_state << 5;
+    return test_random_state;
+}
+
+static bool test_decoder_matches_linear()
+{
+    auto check = [](uint32_t opcode)
+    {
+        auto* table = disassembler_decode_instruction(opcode);
+        auto* linear = disassembler_decode_instruction_linear(opcode);
+
+        if (table != linear)
+        {
+            printf("decoder mismatch for %08X: table=%s linear=%s\n", opcode,
+                table ? magic_enum::enum_name(table->type).data() : "null",
+                linear ? magic_enum::enum_name(linear->type).data() : "null"
+            );
+            return false;
+        }
+
+        return true;
+    };
+
+    // every primary/sub table slot with its free fields filled in
+    for (uint32_t op = 0; op < 64; op++)
+    {
+        for (uint32_t field = 0; field < 64; field++)
+        {
+            const uint32_t base = SET_INST_BITS(op);
+
+            if (!check(base | field) ||
+                !check(base | SET_RT_BITS(field)) ||
+                !check(base | SET_RS_BITS(field)) ||
+                !check(base | SET_RS_BITS(field) | (test_random() & 0x1FFFFF)) ||
+                !check(base | field | (test_random() & ~(INST_ENCODING_BITMASK | FUNC_ENCODING_BITMASK))))
+                return false;
+        }
+    }
+
+    for (int i = 0; i < 1 << 22; i++)
+    {
+        if (!check(test_random()))
+            return false;
+    }
+
+    return true;
+}
+
+static bool test_icache_invalidated_by_writes()
+{
+    const uint32_t address = 0x00100000;
+    const uint32_t ori = SET_INST_BITS(0x0D) | SET_RT_BITS(8) | SET_IMM_BITS(0x1234);
+    const uint32_t lui = SET_INST_BITS(0x0F) | SET_RT_BITS(8) | SET_IMM_BITS(0x1234);
+
+    memory_write32(0x80000000 | address, ori);
+
+    auto* first = icache_lookup(address);
+    if (!first || first->ctx.opbits != ori)
+        return false;
+
+    memory_write32(0xA0000000 | address, lui);
+
+    auto* second = icache_lookup(address);
+    return second && second->ctx.opbits == lui && second->ctx.rt_bits() == 8 && second->ctx.imm() == 0x1234;
+}
+
+static bool test_rdram_dirty_tracking()
+{
+    const uint32_t address = 0x00200000;
+
+    memory_rdram_clear_dirty(0, RDRAM_SIZE);
+
+    const auto before = memory_rdram_get_generation();
+
+    // the last byte of the first page, the next page stays clean
+    memory_write8(0x80000000 | (address + RDRAM_PAGE_SIZE - 1), 0xAB);
+    memory_write32(0xA0000000 | (address + RDRAM_PAGE_SIZE * 3), 0x12345678);
+
+    uint32_t pages[8];
+    const auto count = memory_rdram_collect_dirty(address, RDRAM_PAGE_SIZE * 8, pages, 8);
+
+    if (count != 2 || pages[0] != address || pages[1] != address + RDRAM_PAGE_SIZE * 3)
+        return false;
+
+    // no room writes nothing, a full array stops part way through the range
+    uint32_t guard[2] = { 0xFFFFFFFF, 0xFFFFFFFF };
+
+    if (memory_rdram_collect_dirty(address, RDRAM_PAGE_SIZE * 8, guard, 0) != 0 || guard[0] != 0xFFFFFFFF ||
+        memory_rdram_collect_dirty(address, RDRAM_PAGE_SIZE * 8, guard, 1) != 1 || guard[0] != address ||
+        guard[1] != 0xFFFFFFFF)
+        return false;
+
+    if (memory_rdram_is_dirty(address + RDRAM_PAGE_SIZE, RDRAM_PAGE_SIZE * 2))
+        return false;
+
+    if (!memory_rdram_written_since(address, RDRAM_PAGE_SIZE, before) ||
+        memory_rdram_written_since(address + RDRAM_PAGE_SIZE, RDRAM_PAGE_SIZE, before))
+        return false;
+
+    if (memory_rdram_get_page_generation(address + RDRAM_PAGE_SIZE * 3) != memory_rdram_get_generation())
+        return false;
+
+    memory_rdram_clear_dirty(address, RDRAM_PAGE_SIZE * 8);
+
+    // clearing dirty bits doesn't rewind generations
+    if (memory_rdram_is_dirty(0, RDRAM_SIZE) || !memory_rdram_written_since(address, RDRAM_PAGE_SIZE, before))
+        return false;
+
+    // a DMA straddling a page boundary dirties both pages and no more
+    const auto boundary = address + RDRAM_PAGE_SIZE * 6;
+    const auto before_dma = memory_rdram_get_generation();
+
+    memory_do_dma(0xA0000000 | (boundary - 8), 0xA0000000 | (address + RDRAM_PAGE_SIZE * 16), 16);
+
+    const auto dma_count = memory_rdram_collect_dirty(address, RDRAM_PAGE_SIZE * 8, pages, 8);
+
+    if (dma_count != 2 || pages[0] != boundary - RDRAM_PAGE_SIZE || pages[1] != boundary ||
+        !memory_rdram_written_since(boundary, RDRAM_PAGE_SIZE, before_dma))
+        return false;
+
+    memory_rdram_clear_dirty(0, RDRAM_SIZE);
+    return true;
+}
+
+// cartridge -> rdram goes straight between the buffers, unaligned and across
+// pages; anything touching MMIO still goes through the registers
+static bool test_dma_copies_spans()
+{
+    bool ok{true};
+
+    for (uint32_t i = 0; i < 0x3000; i++)
+        cartridge_rom[memory_byte_offset(0x1000 + i)] = uint8_t(i * 7 + 3);
+
+    memory_rdram_clear_dirty(0, RDRAM_SIZE);
+
+    ok &= memory_do_dma(0x00300003, 0xB0001005, 0x2001);
+    for (uint32_t i = 0; i < 0x2001; i++)
+        ok &= rdram[memory_byte_offset(0x00300003 + i)] == cartridge_rom[memory_byte_offset(0x1005 + i)];
+
+    uint32_t pages[8];
+    ok &= memory_rdram_collect_dirty(0, RDRAM_SIZE, pages, 8) == 3 && pages[0] == 0x00300000;
+
+    // VI_ORIGIN and VI_WIDTH from rdram
+    const uint8_t registers[] = { 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x01, 0x40 };
+    for (uint32_t i = 0; i < sizeof(registers); i++)
+        rdram[memory_byte_offset(0x00304000 + i)] = registers[i];
+
+    uint32_t origin{}, width{};
+    ok &= memory_do_dma(0x04400004, 0x00304000, sizeof(registers));
+    ok &= memory_read32(0xA4400004, origin) && memory_read32(0xA4400008, width);
+    ok &= origin == 0x00100000 && width == 320;
+
+    // the cartridge is read only
+    ok &= !memory_do_dma(0x10000000, 0x00300000, 4);
+
+    memory_rdram_clear_dirty(0, RDRAM_SIZE);
+
+    return ok;
+}
+
+// every width reads back the same guest bytes whichever layout memory is in
+static bool test_memory_layout_round_trips()
+{
+    bool ok{true};
+
+    ok &= memory_write64(0x80200000, 0x0011223344556677);
+
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        uint8_t b{};
+        ok &= memory_read8(0x80200000 + i, b) && b == i * 0x11;
+        ok &= rdram[memory_byte_offset(0x00200000 + i)] == i * 0x11;
+    }
+
+    uint16_t half{};
+    uint32_t word{};
+    uint64_t dword{};
+
+    ok &= memory_read16(0x80200002, half) && half == 0x2233;
+    ok &= memory_read32(0x80200004, word) && word == 0x44556677;
+    ok &= memory_read64(0x80200000, dword) && dword == 0x0011223344556677;
+
+    // misaligned accesses come back together from their pieces
+    ok &= memory_read16(0x80200001, half) && half == 0x1122;
+    ok &= memory_read32(0x80200003, word) && word == 0x33445566;
+
+    ok &= memory_write16(0x80200005, 0xABCD);
+    ok &= memory_read64(0x80200000, dword) && dword == 0x0011223344ABCD77;
+
+    return ok;
+}
+
+// the same image saved as z64, v64 and n64 loads to the same cartridge
+static bool test_rom_formats_load_the_same()
+{
+    const auto path = (std::filesystem::temp_directory_path() / "ultra_test.rom").string();
+    const uint32_t size = KB(4) + 12;
+    bool ok{true};
+
+    std::vector<uint8_t> z64(size);
+
+    for (uint32_t i = 0; i < size; i++)
+        z64[i] = uint8_t(test_random());
+
+    const uint8_t magic[] = { 0x80, 0x37, 0x12, 0x40 };
+    memcpy(z64.data(), magic, sizeof(magic));
+
+    // v64 swaps each pair of bytes, n64 each group of four
+    const int orders[][4] = { { 0, 1, 2, 3 }, { 1, 0, 3, 2 }, { 3, 2, 1, 0 } };
+    const RomFormat formats[] = { RomFormat::Z64, RomFormat::V64, RomFormat::N64 };
+
+    for (int f = 0; f < 3; f++)
+    {
+        std::vector<uint8_t> image(size);
+
+        for (uint32_t i = 0; i < size; i++)
+            image[i] = z64[(i & ~3u) + orders[f][i & 3]];
+
+        ok &= rom_detect_format(image.data(), size) == formats[f];
+
+        auto* file = fopen(path.c_str(), "wb");
+        fwrite(image.data(), 1, size, file);
+        fclose(file);
+
+        // SIMD and scalar conversion agree
+        auto scalar = image;
+        rom_convert_scalar(scalar.data(), size, formats[f]);
+        rom_convert(image.data(), size, formats[f]);
+        ok &= image == scalar;
+
+        // mapped from the file and copied into the cartridge buffer
+        for (const bool mapped : { true, false })
+        {
+            memory_enable_rom_mapping(mapped);
+            ok &= memory_load_rom(path.c_str());
+
+            for (uint32_t i = 0; i < size; i += 4)
+            {
+                uint32_t word{};
+                const uint32_t expected = uint32_t(z64[i]) << 24 | z64[i + 1] << 16 | z64[i + 2] << 8 | z64[i + 3];
+                ok &= memory_read32(0xB0000000 + i, word) && word == expected;
+            }
+
+            // past the end of the image
+            uint32_t word{1};
+            ok &= memory_read32(0xB0000000 + KB(16), word) && word == 0;
+        }
+    }
+
+    memory_enable_rom_mapping(true);
+    memory_unload_rom();
+    std::filesystem::remove(path);
+
+    return ok;
+}
+
+// code run from the cartridge is cached like any other, loading another image
+// has to throw it away
+static bool test_rom_reload_drops_cached_code()
+{
+    enum { t1 = 9 };
+
+    const ExecutionMode modes[] = {
+        ExecutionMode::Interpreter,
+        ExecutionMode::CachedInterpreter,
+        ExecutionMode::ChainedBlocks,
+        ExecutionMode::Recompiler,
+    };
+
+    const auto path = (std::filesystem::temp_directory_path() / "ultra_test.z64").string();
+    bool ok{true};
+
+    for (const bool mapped : { true, false })
+    {
+        memory_enable_rom_mapping(mapped);
+
+        for (auto mode : modes)
+        {
+            cpu_set_execution_mode(mode);
+
+            for (uint32_t value : { 1, 2 })
+            {
+                const uint32_t program[] = {
+                    0x80371240,                             // header
+                    encode_i(0x0D, 0, t1, value),           // ori t1, zero, value
+                    SET_INST_BITS(0x3Fu),                   // unimplemented, stops the cpu
+                };
+
+                std::vector<uint8_t> image(KB(8));
+
+                for (size_t i = 0; i < std::size(program); i++)
+                {
+                    const uint32_t offset = i ? KB(4) + (i - 1) * 4 : 0;
+
+                    for (int b = 0; b < 4; b++)
+                        image[offset + b] = uint8_t(program[i] >> (24 - b * 8));
+                }
+
+                auto* file = fopen(path.c_str(), "wb");
+                fwrite(image.data(), 1, image.size(), file);
+                fclose(file);
+
+                ok &= memory_load_rom(path.c_str());
+
+                cpu_test_reset();
+                branch_delay_slot_address = 0;
+                cpu.pc = 0xFFFFFFFFB0001000;
+                cpu_run(UINT64_MAX);
+
+                if (cpu.gpr[t1] != value)
+                {
+                    printf("%s ran the old cartridge\n", magic_enum::enum_name(mode).data());
+                    ok = false;
+                }
+            }
+        }
+    }
+
+    cpu_set_execution_mode(ExecutionMode::Interpreter);
+    memory_enable_rom_mapping(true);
+    memory_unload_rom();
+    std::filesystem::remove(path);
+
+    return ok;
+}
+
+static bool test_mapped_roms_convert_on_touch()
+{
+    if (!rom_lazy_is_supported())
+        return true;
+
+    const auto path = (std::filesystem::temp_directory_path() / "ultra_test.v64").string();
+    const uint32_t size = KB(256);
+    bool ok{true};
+
+    // v64 always needs converting, whatever the memory layout
+    std::vector<uint8_t> z64(size), v64(size);
+
+    for (uint32_t i = 0; i < size; i++)
+        z64[i] = uint8_t(test_random());
+
+    const uint8_t magic[] = { 0x80, 0x37, 0x12, 0x40 };
+    memcpy(z64.data(), magic, sizeof(magic));
+
+    for (uint32_t i = 0; i < size; i++)
+        v64[i] = z64[i ^ 1];
+
+    auto* file = fopen(path.c_str(), "wb");
+    fwrite(v64.data(), 1, size, file);
+    fclose(file);
+
+    ok &= memory_load_rom(path.c_str());
+    ok &= memory_get_rom_converted_pages() == 0;
+
+    // the header converts the pages around it
+    ok &= ((const uint8_t*)memory_get_rom_header())[memory_byte_offset(0)] == 0x80;
+
+    const auto header = memory_get_rom_converted_pages();
+    ok &= header > 0;
+
+    // DMA copies straight out of the mapping, converting what it passes over
+    const uint32_t offset = KB(64) + 6;
+    const uint32_t length = KB(32);
+
+    memory_do_dma(0xA0200000, 0xB0000000 + offset, length);
+
+    for (uint32_t i = 0; i < length; i++)
+        ok &= rdram[memory_byte_offset(0x00200000 + i)] == z64[offset + i];
+
+    const auto converted = memory_get_rom_converted_pages();
+    ok &= converted > header && converted < size / KB(4);
+
+    // a fastmem load of the cartridge faults out of the window and then again
+    // on the page it reads
+    if (memory_enable_fastmem(true))
+    {
+        const uint32_t i = KB(192);
+        const uint32_t expected = uint32_t(z64[i]) << 24 | z64[i + 1] << 16 | z64[i + 2] << 8 | z64[i + 3];
+        uint32_t word{};
+
+        ok &= memory_read32(0xB0000000 + i, word) && word == expected;
+        memory_enable_fastmem(false);
+    }
+
+    memory_unload_rom();
+    std::filesystem::remove(path);
+
+    return ok;
+}
+
+// two mappings of the same image (as two processes would) convert into one
+// file, the second finds what the first converted
+static bool test_mapped_roms_share_conversions()
+{
+    if (!rom_lazy_is_supported())
+        return true;
+
+    const auto dir = std::filesystem::temp_directory_path() / "ultra_test_roms";
+    const auto path = (std::filesystem::temp_directory_path() / "ultra_test_shared.rom").string();
+    const uint32_t size = KB(64);
+    bool ok{true};
+
+    std::filesystem::create_directories(dir);
+    rom_set_shared_dir(dir.c_str());
+
+    // n64 in one layout and z64 in the other need converting
+    std::vector<uint8_t> z64(size), image(size);
+
+    for (uint32_t i = 0; i < size; i++)
+        z64[i] = uint8_t(test_random());
+
+    const uint8_t magic[] = { 0x80, 0x37, 0x12, 0x40 };
+    memcpy(z64.data(), magic, sizeof(magic));
+
+    for (uint32_t i = 0; i < size; i++)
+        image[i] = MEMORY_NATIVE_WORDS ? z64[i] : z64[i ^ 3];
+
+    auto* file = fopen(path.c_str(), "wb");
+    fwrite(image.data(), 1, size, file);
+    fclose(file);
+
+    RomImage first{}, second{};
+    ok &= rom_map(path.c_str(), MB(1), first) && first.lazy && first.shared;
+
+    // the whole image through the first one
+    auto converted = z64;
+    rom_convert(converted.data(), size, RomFormat::Z64);
+    ok &= memcmp(first.data, converted.data(), size) == 0;
+    ok &= rom_converted_pages(first) > 0;
+
+    ok &= rom_map(path.c_str(), MB(1), second) && second.shared;
+    ok &= memcmp(second.data, converted.data(), size) == 0;
+    ok &= rom_converted_pages(second) == 0;
+
+    // one file between them
+    ok &= std::distance(std::filesystem::directory_iterator(dir), {}) == 1;
+
+    rom_unmap(first);
+    rom_unmap(second);
+
+    // a link planted under the file's name isn't followed, the image is
+    // converted privately instead
+    const auto shared = std::filesystem::directory_iterator(dir)->path();
+    const auto target = dir / "target";
+
+    std::filesystem::rename(shared, target);
+    std::filesystem::create_symlink(target, shared);
+
+    RomImage third{};
+    ok &= rom_map(path.c_str(), MB(1), third) && third.lazy && !third.shared;
+    ok &= memcmp(third.data, converted.data(), size) == 0;
+    ok &= rom_converted_pages(third) > 0;
+
+    rom_unmap(third);
+    rom_set_shared_dir(nullptr);
+
+    std::filesystem::remove_all(dir);
+    std::filesystem::remove(path);
+
+    return ok;
+}
+
+static bool test_execution_modes_match_interpreter()
+{
+    const ExecutionMode modes[] = {
+        ExecutionMode::Interpreter,
+        ExecutionMode::CachedInterpreter,
+        ExecutionMode::ChainedBlocks,
+        ExecutionMode::Recompiler,
+    };
+
+    CPU results[std::size(modes)]{};
+    uint64_t cycles[std::size(modes)]{};
+
+    for (size_t i = 0; i < std::size(modes); i++)
+    {
+        cpu_test_reset();
+        branch_delay_slot_address = 0;
+        cpu.pc = cpu_test_load_loop_program(1000);
+
+        const auto start = cpu_get_cycle_count();
+
+        cpu_set_execution_mode(modes[i]);
+        while (cpu_run_next()) {}
+
+        cycles[i] = cpu_get_cycle_count() - start;
+        results[i] = cpu;
+    }
+
+    cpu_set_execution_mode(ExecutionMode::Interpreter);
+
+    for (size_t i = 1; i < std::size(modes); i++)
+    {
+        const bool same
+             = memcmp(results[0].gpr, results[i].gpr, sizeof(CPU::gpr)) == 0
+            && results[0].pc == results[i].pc
+            && results[0].hi_lo == results[i].hi_lo
+            && cycles[0] == cycles[i];
+
+        if (!same)
+        {
+            printf("%s differs from the interpreter\n", magic_enum::enum_name(modes[i]).data());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool test_run_stop_reasons()
+{
+    cpu_test_reset();
+    branch_delay_slot_address = 0;
+    cpu.pc = cpu_test_load_loop_program(100);
+
+    const auto entry = cpu.pc;
+    const auto loop = entry + 3 * 4;
+    bool ok{true};
+
+    // the interpreter retires exactly the budget
+    auto result = cpu_run(10);
+    ok &= result.reason == StopReason::BudgetExhausted && result.cycles == 10;
+
+    // stops in front of the loop head every iteration, stepping over it each time
+    cpu_add_breakpoint(loop);
+
+    for (int i = 0; i < 3; i++)
+    {
+        result = cpu_run(UINT64_MAX);
+        ok &= result.reason == StopReason::Breakpoint && cpu.pc == loop;
+    }
+
+    cpu_remove_breakpoint(loop);
+
+    // the program ends on an opcode nothing implements
+    result = cpu_run(UINT64_MAX);
+    ok &= result.reason == StopReason::UnknownOpcode && cpu_get_fault().address == SET_INST_BITS(0x3Fu);
+
+    return ok;
+}
+
+// the store in the loop trips a write watchpoint, the loads next to it don't
+static bool test_watchpoints_stop_after_access()
+{
+    cpu_test_reset();
+    branch_delay_slot_address = 0;
+    cpu.pc = cpu_test_load_loop_program(100);
+    cpu_set_execution_mode(ExecutionMode::ChainedBlocks);
+
+    const auto store = cpu.pc + 7 * 4;
+    bool ok{true};
+
+    ok &= memory_add_watchpoint(0x80200000, 4, MEMORY_WATCH_WRITE);
+
+    for (int i = 0; i < 2; i++)
+    {
+        const auto result = cpu_run(UINT64_MAX);
+        const auto* hit = memory_get_watchpoint_hit();
+
+        ok &= result.reason == StopReason::Watchpoint && cpu.pc == store + 4;
+        ok &= hit && hit->address == 0x00200000 && hit->size == 4 && hit->write;
+    }
+
+    // the rest of rdram stays on the page table
+    ok &= memory_get_host_pointer(0x00100000) == rdram + 0x00100000;
+
+    memory_remove_watchpoint(0x80200000);
+    ok &= !memory_has_watchpoints();
+
+    const auto result = cpu_run(UINT64_MAX);
+    ok &= result.reason == StopReason::UnknownOpcode && cpu.gpr[10] == 300;
+
+    cpu_set_execution_mode(ExecutionMode::Interpreter);
+
+    return ok;
+}
+
+static bool test_trace_variant_matches()
+{
+    CPU results[2]{};
+    uint64_t cycles[2]{};
+
+    for (int i = 0; i < 2; i++)
+    {
+        cpu_test_reset();
+        branch_delay_slot_address = 0;
+        cpu.pc = cpu_test_load_loop_program(100);
+
+        const auto start = cpu_get_cycle_count();
+
+        cpu_set_tracing(i == 1);
+        while (cpu_run_next()) {}
+
+        cycles[i] = cpu_get_cycle_count() - start;
+        results[i] = cpu;
+    }
+
+    cpu_set_tracing(false);
+
+    return memcmp(results[0].gpr, results[1].gpr, sizeof(CPU::gpr)) == 0
+        && results[0].pc == results[1].pc
+        && cycles[0] == cycles[1];
+}
+
+// a recorded trace replays to the same register state the cpu ended up in
+static bool test_trace_recording_round_trips()
+{
+    const auto path = (std::filesystem::temp_directory_path() / "ultra_test.trace").string();
+
+    cpu_test_reset();
+    branch_delay_slot_address = 0;
+    cpu.pc = cpu_test_load_loop_program(100);
+
+    const auto entry = cpu.pc;
+    const auto start = cpu_get_cycle_count();
+
+    if (!cpu_start_recording(path.c_str()))
+        return false;
+
+    while (cpu_run_next()) {}
+    cpu_stop_recording();
+
+    const auto executed = cpu_get_cycle_count() - start;
+
+    uint64_t events{};
+    uint64_t last_pc{};
+    uint64_t registers[TRACE_NUM_REGISTERS]{};
+
+    const bool read = trace_read(path.c_str(), [&](const TraceEvent& event)
+    {
+        events++;
+        last_pc = event.pc;
+        memcpy(registers, event.registers, sizeof(registers));
+        return true;
+    });
+
+    std::filesystem::remove(path);
+
+    return read && events == executed
+        && memcmp(registers + 1, cpu.gpr + 1, 31 * 8) == 0
+        && registers[TRACE_REGISTER_HI_LO] == cpu.hi_lo
+        && last_pc == entry + 21 * 4;   // the final, not taken bne
+}
+
+// long enough to fill several chunks: every event's changes take the
+// previous event's registers to its own, including the first after a sync
+static bool test_trace_recording_crosses_chunks()
+{
+    const auto path = (std::filesystem::temp_directory_path() / "ultra_test.trace").string();
+
+    cpu_test_reset();
+    branch_delay_slot_address = 0;
+    cpu.pc = cpu_test_load_loop_program(31000);
+
+    const auto start = cpu_get_cycle_count();
+
+    if (!cpu_start_recording(path.c_str()))
+        return false;
+
+    while (cpu_run_next()) {}
+    cpu_stop_recording();
+
+    const auto executed = cpu_get_cycle_count() - start;
+    const bool crossed = trace_get_bytes_recorded() > 2 * MB(1);
+
+    uint64_t events{};
+    bool consistent{true};
+    uint64_t registers[TRACE_NUM_REGISTERS]{};
+
+    const bool read = trace_read(path.c_str(), [&](const TraceEvent& event)
+    {
+        if (events++)
+        {
+            for (int i = 0; i < event.num_changes; i++)
+            {
+                const auto& change = event.changes[i];
+                consistent &= registers[change.index] == change.before;
+                registers[change.index] = change.after;
+            }
+
+            consistent &= memcmp(registers, event.registers, sizeof(registers)) == 0;
+        }
+
+        memcpy(registers, event.registers, sizeof(registers));
+        return true;
+    });
+
+    std::filesystem::remove(path);
+
+    return read && crossed && consistent && events == executed
+        && memcmp(registers + 1, cpu.gpr + 1, 31 * 8) == 0
+        && registers[TRACE_REGISTER_HI_LO] == cpu.hi_lo;
+}
+
+// a store to cartridge ROM faults, every mode has to stop on the store
+// without retiring it
+static bool test_faults_stop_on_instruction()
+{
+    enum { t0 = 8, t1 = 9 };
+
+    const ExecutionMode modes[] = {
+        ExecutionMode::Interpreter,
+        ExecutionMode::CachedInterpreter,
+        ExecutionMode::ChainedBlocks,
+        ExecutionMode::Recompiler,
+    };
+
+    const uint32_t program[] = {
+        encode_i(0x0F, 0, t0, 0xB000),                  // lui   t0, 0xB000
+        encode_i(0x0D, 0, t1, 5),                       // ori   t1, zero, 5
+        encode_i(0x2B, t0, t1, 0),                      // sw    t1, 0(t0)
+        encode_i(0x0D, 0, t1, 6),                       // ori   t1, zero, 6
+    };
+
+    const uint32_t entry = 0x80110000;
+
+    for (size_t i = 0; i < std::size(program); i++)
+        memory_write32(entry + i * 4, program[i]);
+
+    bool ok{true};
+
+    for (auto mode : modes)
+    {
+        cpu_test_reset();
+        branch_delay_slot_address = 0;
+        cpu.pc = 0xFFFFFFFF00000000 | entry;
+
+        const auto start = cpu_get_cycle_count();
+
+        cpu_set_execution_mode(mode);
+        const auto result = cpu_run(UINT64_MAX);
+
+        const auto& fault = cpu_get_fault();
+
+        if (result.reason != StopReason::Fault || result.cycles != 2 ||
+            cpu.pc != (0xFFFFFFFF00000000 | (entry + 8)) || cpu.gpr[t1] != 5 ||
+            cpu_get_cycle_count() - start != 2 || fault.address != 0xB0000000)
+        {
+            printf("%s didn't stop on the faulting store\n", magic_enum::enum_name(mode).data());
+            ok = false;
+        }
+    }
+
+    // the same store in a delay slot stops with the delay slot still pending,
+    // resuming once it can succeed runs it and then the branch target
+    const uint32_t delay_program[] = {
+        encode_i(0x0F, 0, t0, 0xB000),                  // lui   t0, 0xB000
+        encode_i(0x0D, 0, t1, 5),                       // ori   t1, zero, 5
+        encode_i(0x04, 0, 0, 2),                        // beq   zero, zero, target
+        encode_i(0x2B, t0, t1, 0),                      // sw    t1, 0(t0)
+        encode_i(0x0D, 0, t1, 6),                       // ori   t1, zero, 6
+        encode_i(0x0D, 0, t1, 7),                       // target: ori t1, zero, 7
+        SET_INST_BITS(0x3Fu),                           // unimplemented, stops the cpu
+    };
+
+    const uint32_t delay_entry = 0x80110100;
+
+    for (size_t i = 0; i < std::size(delay_program); i++)
+        memory_write32(delay_entry + i * 4, delay_program[i]);
+
+    for (auto mode : modes)
+    {
+        cpu_test_reset();
+        branch_delay_slot_address = 0;
+        cpu.pc = 0xFFFFFFFF00000000 | delay_entry;
+
+        cpu_set_execution_mode(mode);
+        const auto result = cpu_run(UINT64_MAX);
+
+        bool stopped = result.reason == StopReason::Fault && result.cycles == 3 &&
+            cpu.pc == (0xFFFFFFFF00000000 | (delay_entry + 20)) &&
+            branch_delay_slot_address == (0xFFFFFFFF00000000 | (delay_entry + 12));
+
+        // somewhere the store can go
+        cpu.gpr[t0] = 0xFFFFFFFF80200000;
+        memory_write32(0x80200000, 0);
+        cpu_run(UINT64_MAX);
+
+        uint32_t stored{};
+        memory_read32(0x80200000, stored);
+
+        if (!stopped || stored != 5 || cpu.gpr[t1] != 7)
+        {
+            printf("%s didn't stop on the faulting delay slot\n", magic_enum::enum_name(mode).data());
+            ok = false;
+        }
+    }
+
+    cpu_set_execution_mode(ExecutionMode::Interpreter);
+    branch_delay_slot_address = 0;
+
+    return ok;
+}
+
+static bool test_chained_blocks_see_code_writes()
+{
+    uint64_t t2[2]{};
+
+    for (int run = 0; run < 2; run++)
+    {
+        cpu_test_reset();
+        branch_delay_slot_address = 0;
+        cpu.pc = cpu_test_load_loop_program(100);
+
+        // second time round the loop body gets patched after being linked
+        if (run == 1)
+            memory_write32(0x80100000 + 3 * 4, encode_i(0x09, 10, 10, 5));
+
+        cpu_set_execution_mode(ExecutionMode::ChainedBlocks);
+        while (cpu_run_next()) {}
+
+        t2[run] = cpu.gpr[10];
+    }
+
+    cpu_set_execution_mode(ExecutionMode::Interpreter);
+
+    return t2[0] == 300 && t2[1] == 500;
+}
+
+// device completions and the timer interrupt land on the cycle they were
+// scheduled for, not when something next polls for them
+static bool test_scheduled_events_fire_on_time()
+{
+    cpu_test_reset();
+    branch_delay_slot_address = 0;
+    cpu.pc = cpu_test_load_loop_program(1000);
+
+    bool ok{true};
+
+    // unmask the PI interrupt, then DMA 8 bytes from the cartridge
+    memory_write32(0x0430000C, 1 << 9);
+    memory_write32(0x04600000, 0x00200000);
+    memory_write32(0x04600004, 0x10000000);
+    memory_write32(0x0460000C, 7);
+
+    uint32_t status{};
+    memory_read32(0x04600010, status);
+    ok &= status == 0x01;
+
+    // 8 bytes at 5 cycles a byte, the completion runs ahead of the next instruction
+    cpu_run(40);
+    memory_read32(0x04600010, status);
+    ok &= status == 0x01 && !(cpu.cop0.cause() & (1 << 10));
+
+    cpu_run(1);
+    memory_read32(0x04600010, status);
+    ok &= status == 0x08 && (cpu.cop0.cause() & (1 << 10));
+
+    // acknowledging it drops the line again
+    memory_write32(0x04600010, 0x02);
+    memory_read32(0x04600010, status);
+    ok &= status == 0 && !(cpu.cop0.cause() & (1 << 10));
+
+    // count ticks on odd cycles, so from an even one compare is hit after 20
+    cpu_run(cpu_get_cycle_count() & 1);
+    cpu_set_cop0_register(9, 0);
+    cpu_set_cop0_register(11, 10);
+
+    uint64_t count{};
+
+    cpu_run(20);
+    cpu_get_cop0_register(9, count);
+    ok &= !(cpu.cop0.cause() & (1 << 15)) && count == 10;
+
+    cpu_run(1);
+    ok &= (cpu.cop0.cause() & (1 << 15)) != 0;
+
+    // writing compare acknowledges it
+    cpu_set_cop0_register(11, 100);
+    ok &= !(cpu.cop0.cause() & (1 << 15));
+
+    return ok;
+}
+
+// a large PI DMA copies while the cpu runs on; touching the destination
+// early waits for the copy, the registers only follow the modelled timing
+static bool test_pi_dma_runs_in_background()
+{
+    cpu_test_reset();
+    branch_delay_slot_address = 0;
+    cpu.pc = cpu_test_load_loop_program(100000);
+
+    const uint32_t size = KB(64);
+    bool ok{true};
+
+    for (uint32_t i = 0; i < size; i++)
+        cartridge_rom[memory_byte_offset(0x10000 + i)] = uint8_t(i * 13 + 1);
+
+    auto start_dma = [size]()
+    {
+        memory_write32(0x04600000, 0x00400000);
+        memory_write32(0x04600004, 0x10010000);
+        memory_write32(0x0460000C, size - 1);
+    };
+
+    const auto before = memory_get_async_dma_stats();
+    uint32_t status{}, value{};
+
+    start_dma();
+    cpu_run(1000);
+
+    memory_read32(0x04600010, status);
+    ok &= status == 0x01 && memory_async_dma_pending();
+
+    // reading the destination finishes the copy, the status doesn't change
+    ok &= memory_read32(0x80400010, value) && value == 0xD1DEEBF8;
+    ok &= !memory_async_dma_pending();
+
+    memory_read32(0x04600010, status);
+    ok &= status == 0x01;
+
+    // the next one is left alone until the transfer time is up
+    cpu_run(size * 5);
+    memory_write32(0x04600010, 0x02);
+    memset(rdram + 0x00400000, 0, size);
+
+    start_dma();
+    cpu_run(size * 5 + 1);
+
+    memory_read32(0x04600010, status);
+    ok &= status == 0x08 && !memory_async_dma_pending();
+    ok &= memcmp(rdram + 0x00400000, cartridge_rom + 0x10000, size) == 0;
+    ok &= memory_get_async_dma_stats().transfers == before.transfers + 2;
+
+    memory_write32(0x04600010, 0x02);
+
+    // code already predecoded from the destination is dropped when the copy starts
+    memory_write32(0x80400010, 0);
+    ok &= icache_lookup(0x00400010) && icache_lookup(0x00400010)->ctx.opbits == 0;
+
+    start_dma();
+
+    const auto* fetched = icache_lookup(0x00400010);
+    ok &= fetched && fetched->ctx.opbits == 0xD1DEEBF8 && !memory_async_dma_pending();
+
+    cpu_run(size * 5 + 1);
+    memory_write32(0x04600010, 0x02);
+
+    return ok;
+}
+
+// count and random follow the cycle count, so the same run reads the same values
+static bool test_cop0_timers_follow_cycle_count()
+{
+    cpu_test_reset();
+    branch_delay_slot_address = 0;
+    cpu.pc = cpu_test_load_loop_program(1000);
+
+    bool ok{true};
+    uint64_t value{};
+
+    // writing wired restarts random at 31
+    cpu_set_cop0_register(6, 5);
+    cpu_get_cop0_register(1, value);
+    ok &= value == 31;
+
+    for (int i = 0; i < 100; i++)
+    {
+        cpu_run(1);
+        cpu_get_cop0_register(1, value);
+        ok &= value == 31 - uint64_t(i + 1) % 27;
+    }
+
+    cpu_set_cop0_register(6, 0);
+
+    // count keeps its written value and ticks every other cycle from there
+    cpu_set_cop0_register(9, 0xFFFFFFF0);
+    const auto start = cpu_get_cycle_count();
+
+    cpu_run(100);
+    cpu_get_cop0_register(9, value);
+    ok &= value == uint32_t(0xFFFFFFF0 + (cpu_get_cycle_count() / 2 - start / 2));
+
+    return ok;
+}
+
+// direct page table accesses and the callback path see the same memory
+static bool test_page_table_matches_callbacks()
+{
+    bool ok{true};
+
+    // straddles two RDRAM pages, so it takes the callback path
+    const uint32_t address = 0x80200000 + RDRAM_PAGE_SIZE - 2;
+    ok &= memory_write32(address, 0x11223344);
+
+    uint16_t halves[2]{};
+    ok &= memory_read16(address, halves[0]) && memory_read16(address + 2, halves[1]);
+    ok &= halves[0] == 0x1122 && halves[1] == 0x3344;
+
+    ok &= memory_get_host_pointer(0x00200000) == rdram + 0x00200000;
+    ok &= memory_get_host_pointer(0x04300004) == nullptr;
+
+    // the cartridge is mapped read only
+    ok &= !memory_write32(0xB0000100, 0);
+
+    return ok;
+}
+
+// fastmem loads see the same memory as the page table, MMIO and TLB mapped
+// addresses fall back to the bus through the fault handler
+static bool test_fastmem_matches_page_table()
+{
+    if (!memory_enable_fastmem(true))
+        return true;
+
+    bool ok{true};
+
+    // RDRAM really is in the window, not left on the page table
+    ok &= fastmem_is_mapped(0x00200100) && fastmem_is_mapped(RDRAM_SIZE - 1);
+
+    ok &= memory_write32(0x80200100, 0xCAFEBABE);
+
+    uint32_t value{};
+    ok &= memory_read32(0x80200100, value) && value == 0xCAFEBABE;
+    ok &= memory_read32(0xA0200100, value) && value == 0xCAFEBABE;
+
+    uint32_t low{};
+    uint64_t wide{};
+    ok &= memory_read32(0x80200104, low) && memory_read64(0x00200100, wide) && wide == (0xCAFEBABEull << 32 | low);
+
+    // MI_VERSION, through the fault handler
+    ok &= memory_read32(0xA4300004, value) && value == 0x10101010;
+
+    // still faults as a TLB miss
+    ok &= !memory_read32(0xC0000000, value);
+
+    memory_enable_fastmem(false);
+    return ok;
+}
+
+// neighbouring registers decode to themselves, overlapping installs are refused
+static bool test_address_decode()
+{
+    bool ok{true};
+
+    // VI_ORIGIN and VI_WIDTH
+    ok &= memory_write32(0xA4400004, 0x00100000) && memory_write32(0xA4400008, 320);
+
+    uint32_t origin{}, width{};
+    ok &= memory_read32(0xA4400004, origin) && memory_read32(0xA4400008, width);
+    ok &= origin == 0x00100000 && width == 320;
+
+    // byte lanes of MI_VERSION (0x10101010 after init)
+    uint8_t lane{};
+    ok &= memory_read8(0xA4300007, lane) && lane == 0x10;
+
+    const MemoryHandlers none{};
+    ok &= !memory_install_handlers(0x04400008, 0x0440000B, none, "overlapping VI_WIDTH");
+    ok &= !memory_install_handlers(0x00000000, 0x00000FFF, none, "overlapping RDRAM");
+
+    // still the original mapping
+    ok &= memory_read32(0xA4400008, width) && width == 320;
+
+    // nothing is mapped there
+    ok &= !memory_read32(0xA4C00000, width);
+
+    return ok;
+}
+
+// TLB writes through the instructions show up in translation straight away,
+// even for pages the micro-TLB already holds
+static bool test_tlb_translation_follows_writes()
+{
+    // stage the registers the way a game does, through MTC0 from t0
+    auto mtc0 = [](uint32_t cop0_register, uint64_t value)
+    {
+        cpu.gpr[8] = value;
+        const uint32_t opcode = 0x40800000 | SET_RT_BITS(8) | SET_RD_BITS(cop0_register);
+        return cpu_execute_single(InstructionType::MTC0, ExecutionContext(opcode), []() { return true; });
+    };
+
+    auto tlb_stage = [&](uint32_t entry_hi, uint32_t lo0, uint32_t lo1)
+    {
+        return mtc0(5, 0) && mtc0(10, entry_hi) && mtc0(2, lo0) && mtc0(3, lo1);
+    };
+
+    auto tlb_write = [&](int index, uint32_t entry_hi, uint32_t lo0, uint32_t lo1)
+    {
+        return mtc0(0, index) && tlb_stage(entry_hi, lo0, lo1) &&
+            cpu_execute_single(InstructionType::TLBWI, ExecutionContext(0x42000002), []() { return true; });
+    };
+
+    auto lo = [](uint32_t physical_address, uint32_t flags) { return ((physical_address >> 12) << 6) | flags; };
+
+    bool ok{true};
+    uint32_t value{};
+
+    ok &= memory_write32(0x80100010, 0x11111111);
+    ok &= memory_write32(0x80200010, 0x22222222);
+    ok &= memory_write32(0x80300010, 0x33333333);
+
+    // KSEG3 even/odd pair, global
+    const auto valid_global = TLB_ENTRY_VALID | TLB_ENTRY_GLOBAL;
+    ok &= tlb_write(5, 0xE0000000, lo(0x00100000, valid_global), lo(0x00200000, valid_global));
+
+    ok &= memory_read32(0xE0000010, value) && value == 0x11111111;
+    ok &= memory_read32(0xE0001010, value) && value == 0x22222222;
+
+    const auto before = memory_get_tlb_stats();
+    ok &= memory_read32(0xE0000010, value) && value == 0x11111111;
+    ok &= memory_get_tlb_stats().hits == before.hits + 1;
+
+    // remapping the even page replaces the cached lookup
+    ok &= tlb_write(5, 0xE0000000, lo(0x00300000, valid_global), lo(0x00200000, valid_global));
+    ok &= memory_read32(0xE0000010, value) && value == 0x33333333;
+
+    // TLBP finds the entry, and flags a miss in bit 31
+    cpu.cop0.entry_hi() = 0xE0000000;
+    cpu_execute_single(InstructionType::TLBP, ExecutionContext(0x42000008), []() { return true; });
+    ok &= cpu.cop0.index() == 5;
+
+    cpu.cop0.entry_hi() = 0xC0000000;
+    cpu_execute_single(InstructionType::TLBP, ExecutionContext(0x42000008), []() { return true; });
+    ok &= cpu.cop0.index() == 0x80000000;
+
+    // Index only keeps the entry number and the probe bit
+    ok &= mtc0(0, 0x7FFFFF45) && cpu.cop0.index() == 5;
+
+    // TLBR reads the entry back into the staging registers
+    ok &= tlb_stage(0, 0, 0);
+    cpu_execute_single(InstructionType::TLBR, ExecutionContext(0x42000001), []() { return true; });
+    ok &= cpu.cop0.pagemask() == 0 && uint32_t(cpu.cop0.entry_hi()) == 0xE0000000 &&
+        cpu.cop0.entry_lo0() == lo(0x00300000, valid_global) &&
+        cpu.cop0.entry_lo1() == lo(0x00200000, valid_global);
+
+    // TLBWR lands on the entry Random points at
+    uint64_t random{};
+    cpu_get_cop0_register(1, random);
+    ok &= tlb_stage(0xE0010000, lo(0x00100000, valid_global), 0);
+    cpu_execute_single(InstructionType::TLBWR, ExecutionContext(0x42000006), []() { return true; });
+    ok &= memory_read32(0xE0010010, value) && value == 0x11111111;
+
+    cpu_execute_single(InstructionType::TLBP, ExecutionContext(0x42000008), []() { return true; });
+    ok &= cpu.cop0.index() == random;
+
+    // KSSEG entry only for ASID 3
+    ok &= tlb_write(6, 0xC0000003, lo(0x00100000, TLB_ENTRY_VALID), 0);
+
+    cpu_set_cop0_register(10, 3);
+    ok &= memory_read32(0xC0000010, value) && value == 0x11111111;
+
+    // the odd page isn't valid
+    ok &= !memory_translate(0xC0001010, value);
+
+    cpu_set_cop0_register(10, 4);
+    ok &= !memory_translate(0xC0000010, value);
+
+    memory_tlb_reset();
+    cpu_set_cop0_register(10, 0);
+
+    return ok;
+}
+
+bool cpu_run_tests()
+{
+    struct Test
+    {
+        const char* name;
+        bool(*func)();
+    };
+
+    static const Test tests[] = {
+        { "decoder matches linear scan", test_decoder_matches_linear },
+        { "icache invalidated by writes", test_icache_invalidated_by_writes },
+        { "rdram dirty tracking", test_rdram_dirty_tracking },
+        { "page table matches callbacks", test_page_table_matches_callbacks },
+        { "address decode", test_address_decode },
+        { "memory layout round trips", test_memory_layout_round_trips },
+        { "dma copies spans", test_dma_copies_spans },
+        { "rom formats load the same", test_rom_formats_load_the_same },
+        { "rom reload drops cached code", test_rom_reload_drops_cached_code },
+        { "mapped roms convert on touch", test_mapped_roms_convert_on_touch },
+        { "mapped roms share conversions", test_mapped_roms_share_conversions },
+        { "tlb translation follows writes", test_tlb_translation_follows_writes },
+        { "fastmem matches page table", test_fastmem_matches_page_table },
+        { "execution modes match interpreter", test_execution_modes_match_interpreter },
+        { "chained blocks see code writes", test_chained_blocks_see_code_writes },
+        { "faults stop on the instruction", test_faults_stop_on_instruction },
+        { "run stop reasons", test_run_stop_reasons },
+        { "watchpoints stop after the access", test_watchpoints_stop_after_access },
+        { "trace variant matches", test_trace_variant_matches },
+        { "trace recording round trips", test_trace_recording_round_trips },
+        { "trace recording crosses chunks", test_trace_recording_crosses_chunks },
+        { "scheduled events fire on time", test_scheduled_events_fire_on_time },
+        { "pi dma runs in the background", test_pi_dma_runs_in_background },
+        { "cop0 timers follow the cycle count", test_cop0_timers_follow_cycle_count },
+    };
+
+    int failed{};
+
+    memory_enable_logging(false);
+
+    for (const auto& test : tests)
+    {
+        const bool passed = test.func();
+        printf("[%s] %s\n", passed ? "PASS" : "FAIL", test.name);
+
+        if (!passed)
+            failed++;
+    }
+
+    printf("%d/%d tests passed\n", int(std::size(tests)) - failed, int(std::size(tests)));
+    return failed == 0;
+}
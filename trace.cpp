@@ -0,0 +1,374 @@
+#include "trace.h"
+#include "cpu_types.h"
+#include "platform.h"
+
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Records are packed into a ring of chunks. The cpu fills one while the writer
+// thread drains the full ones to disk; if the writer falls a whole ring behind
+// the cpu waits for it rather than dropping records.
+#define TRACE_CHUNK_SIZE            MB(1)
+#define TRACE_NUM_CHUNKS            8
+
+// tag + pc delta + opcode + a change for every register
+#define TRACE_MAX_RECORD_SIZE       (1 + 10 + 4 + TRACE_NUM_REGISTERS * 11)
+
+struct TraceChunk
+{
+    std::unique_ptr<uint8_t[]> data;
+    uint32_t used;
+    uint32_t records;
+};
+
+static FILE* trace_file{};
+static TraceChunk chunks[TRACE_NUM_CHUNKS];
+static TraceChunk* chunk{};
+
+static std::thread writer;
+static std::mutex writer_mutex;
+static std::condition_variable writer_cv;
+static uint64_t chunks_submitted{};
+static uint64_t chunks_written{};
+static bool writer_stopping{};
+
+static uint64_t registers[TRACE_NUM_REGISTERS]{};
+static uint64_t last_pc{};
+static uint64_t bytes_recorded{};
+
+static void trace_read_registers(uint64_t* dst)
+{
+    memcpy(dst, cpu.gpr, sizeof(cpu.gpr));
+    dst[0] = 0;
+    dst[TRACE_REGISTER_HI_LO] = cpu.hi_lo;
+}
+
+static uint8_t* trace_put_varint(uint8_t* out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = uint8_t(value) | 0x80;
+        value >>= 7;
+    }
+
+    *out++ = uint8_t(value);
+    return out;
+}
+
+static void trace_writer_main()
+{
+    std::unique_lock lock(writer_mutex);
+
+    while (true)
+    {
+        writer_cv.wait(lock, []() { return chunks_written < chunks_submitted || writer_stopping; });
+
+        if (chunks_written == chunks_submitted)
+            break;
+
+        const auto& full = chunks[chunks_written % TRACE_NUM_CHUNKS];
+        const TraceChunkHeader header{ full.used, full.records };
+
+        lock.unlock();
+        fwrite(&header, sizeof(header), 1, trace_file);
+        fwrite(full.data.get(), 1, full.used, trace_file);
+        lock.lock();
+
+        chunks_written++;
+        writer_cv.notify_all();
+    }
+}
+
+// every chunk starts from a full copy of the registers as the records before
+// it left them. Not read from the cpu: a new chunk is begun from
+// trace_record(), after the instruction it's about to record has already run.
+static void trace_begin_chunk()
+{
+    chunk = &chunks[chunks_submitted % TRACE_NUM_CHUNKS];
+    chunk->used = 0;
+    chunk->records = 1;
+
+    auto* out = chunk->data.get();
+
+    *out++ = TRACE_RECORD_SYNC;
+    memcpy(out, &last_pc, 8);
+    memcpy(out + 8, registers, sizeof(registers));
+
+    chunk->used = 1 + 8 + sizeof(registers);
+}
+
+static void trace_submit_chunk()
+{
+    bytes_recorded += chunk->used;
+
+    std::unique_lock lock(writer_mutex);
+    chunks_submitted++;
+    writer_cv.notify_all();
+
+    // the next chunk in the ring has to have been written out first
+    writer_cv.wait(lock, []() { return chunks_submitted - chunks_written < TRACE_NUM_CHUNKS; });
+}
+
+bool trace_open(const char* path)
+{
+    trace_close();
+
+    if (!(trace_file = fopen(path, "wb")))
+        return false;
+
+    TraceFileHeader header{};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    fwrite(&header, sizeof(header), 1, trace_file);
+
+    for (auto& c : chunks)
+    {
+        if (!c.data)
+            c.data = std::make_unique<uint8_t[]>(TRACE_CHUNK_SIZE);
+    }
+
+    chunks_submitted = 0;
+    chunks_written = 0;
+    writer_stopping = false;
+    bytes_recorded = 0;
+
+    // the first instruction recorded is then the sequential one after last_pc
+    trace_read_registers(registers);
+    last_pc = cpu.pc - 4;
+
+    trace_begin_chunk();
+    writer = std::thread(trace_writer_main);
+
+    return true;
+}
+
+void trace_close()
+{
+    if (!trace_file)
+        return;
+
+    trace_submit_chunk();
+
+    {
+        std::lock_guard lock(writer_mutex);
+        writer_stopping = true;
+    }
+
+    writer_cv.notify_all();
+    writer.join();
+
+    fclose(trace_file);
+    trace_file = nullptr;
+    chunk = nullptr;
+}
+
+bool trace_is_open()
+{
+    return trace_file != nullptr;
+}
+
+void trace_record(uint64_t pc, uint32_t opcode)
+{
+    if (chunk->used + TRACE_MAX_RECORD_SIZE > TRACE_CHUNK_SIZE)
+    {
+        trace_submit_chunk();
+        trace_begin_chunk();
+    }
+
+    auto* out = chunk->data.get() + chunk->used;
+    auto* tag = out++;
+
+    *tag = 0;
+
+    if (pc != last_pc + 4)
+    {
+        const auto delta = int64_t(pc - (last_pc + 4));
+
+        *tag |= TRACE_RECORD_JUMP;
+        out = trace_put_varint(out, (uint64_t(delta) << 1) ^ uint64_t(delta >> 63));
+    }
+
+    memcpy(out, &opcode, 4);
+    out += 4;
+
+    // An instruction can only write its rt or rd field, ra (links) or hi/lo,
+    // so only those are compared. r0 is skipped, writes to it are discarded
+    // before the next instruction anyway.
+    const uint8_t candidates[] = { uint8_t(GET_RT_BITS(opcode)), uint8_t(GET_RD_BITS(opcode)), 31 };
+    uint8_t changes{};
+
+    for (auto i : candidates)
+    {
+        if (i == 0 || cpu.gpr[i] == registers[i])
+            continue;
+
+        *out++ = i;
+        out = trace_put_varint(out, cpu.gpr[i] ^ registers[i]);
+        registers[i] = cpu.gpr[i];
+        changes++;
+    }
+
+    if (cpu.hi_lo != registers[TRACE_REGISTER_HI_LO])
+    {
+        *out++ = TRACE_REGISTER_HI_LO;
+        out = trace_put_varint(out, cpu.hi_lo ^ registers[TRACE_REGISTER_HI_LO]);
+        registers[TRACE_REGISTER_HI_LO] = cpu.hi_lo;
+        changes++;
+    }
+
+    *tag |= changes;
+
+    last_pc = pc;
+    chunk->used = out - chunk->data.get();
+    chunk->records++;
+}
+
+uint64_t trace_get_bytes_recorded()
+{
+    return bytes_recorded + (chunk ? chunk->used : 0);
+}
+
+/**************************************************************************/
+// Reader
+/**************************************************************************/
+struct TraceCursor
+{
+    const uint8_t* at;
+    const uint8_t* end;
+
+    bool read(void* dst, size_t size)
+    {
+        if (size_t(end - at) < size)
+            return false;
+
+        memcpy(dst, at, size);
+        at += size;
+        return true;
+    }
+
+    bool read_varint(uint64_t& value)
+    {
+        value = 0;
+
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (at == end)
+                return false;
+
+            const auto byte = *at++;
+            value |= uint64_t(byte & 0x7F) << shift;
+
+            if (!(byte & 0x80))
+                return true;
+        }
+
+        return false;
+    }
+};
+
+static bool trace_read_chunk(TraceCursor cursor, const std::function<bool(const TraceEvent&)>& func, bool& stop)
+{
+    uint64_t state[TRACE_NUM_REGISTERS]{};
+    uint64_t pc{};
+    bool synced{};
+
+    TraceEvent event{};
+    event.registers = state;
+
+    while (cursor.at != cursor.end)
+    {
+        uint8_t tag{};
+        cursor.read(&tag, 1);
+
+        if (tag & TRACE_RECORD_SYNC)
+        {
+            if (!cursor.read(&pc, 8) || !cursor.read(state, sizeof(state)))
+                return false;
+
+            synced = true;
+            continue;
+        }
+
+        if (!synced)
+            return false;
+
+        pc += 4;
+
+        if (tag & TRACE_RECORD_JUMP)
+        {
+            uint64_t zigzag{};
+
+            if (!cursor.read_varint(zigzag))
+                return false;
+
+            pc += (zigzag >> 1) ^ (0 - (zigzag & 1));
+        }
+
+        event.pc = pc;
+        event.num_changes = tag & TRACE_RECORD_CHANGE_MASK;
+
+        if (!cursor.read(&event.opcode, 4) || event.num_changes > TRACE_NUM_REGISTERS)
+            return false;
+
+        for (int i = 0; i < event.num_changes; i++)
+        {
+            auto& change = event.changes[i];
+            uint64_t diff{};
+
+            if (!cursor.read(&change.index, 1) || change.index >= TRACE_NUM_REGISTERS || !cursor.read_varint(diff))
+                return false;
+
+            change.before = state[change.index];
+            change.after = change.before ^ diff;
+            state[change.index] = change.after;
+        }
+
+        if (!func(event))
+        {
+            stop = true;
+            return true;
+        }
+    }
+
+    return true;
+}
+
+bool trace_read(const char* path, const std::function<bool(const TraceEvent&)>& func)
+{
+    auto* file = fopen(path, "rb");
+
+    if (!file)
+        return false;
+
+    TraceFileHeader header{};
+    bool ok = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0
+        && header.version == TRACE_VERSION;
+
+    std::unique_ptr<uint8_t[]> data;
+    uint32_t capacity{};
+    bool stop{};
+
+    while (ok && !stop)
+    {
+        TraceChunkHeader chunk_header{};
+
+        if (fread(&chunk_header, sizeof(chunk_header), 1, file) != 1)
+            break;
+
+        if (chunk_header.size > capacity)
+        {
+            capacity = chunk_header.size;
+            data = std::make_unique<uint8_t[]>(capacity);
+        }
+
+        ok = fread(data.get(), 1, chunk_header.size, file) == chunk_header.size
+            && trace_read_chunk({ data.get(), data.get() + chunk_header.size }, func, stop);
+    }
+
+    fclose(file);
+    return ok;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+// Binary execution trace.
+//
+// A trace file is a TraceFileHeader followed by chunks. Each chunk is a
+// TraceChunkHeader and `size` bytes of records, and opens with a sync record
+// so it can be decoded without the chunks before it. Records:
+//
+//  sync:        tag (TRACE_RECORD_SYNC), u64 pc, u64 registers[TRACE_NUM_REGISTERS]
+//  instruction: tag (TRACE_RECORD_JUMP | change count)
+//               [varint zigzag(pc - (previous pc + 4)), only with TRACE_RECORD_JUMP]
+//               u32 opcode
+//               change count * (u8 register, varint new value ^ old value)
+//
+// Registers are gpr[0..31] then hi_lo as register 32. Everything is stored in
+// host (little endian) byte order.
+#define TRACE_MAGIC                 "ULTRATRC"
+#define TRACE_VERSION               1
+
+#define TRACE_NUM_REGISTERS         33
+#define TRACE_REGISTER_HI_LO        32
+
+#define TRACE_RECORD_SYNC           0x80
+#define TRACE_RECORD_JUMP           0x40
+#define TRACE_RECORD_CHANGE_MASK    0x3F
+
+struct TraceFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct TraceChunkHeader
+{
+    uint32_t size;
+    uint32_t records;
+};
+
+// starts streaming records to path, false if it can't be created
+bool trace_open(const char* path);
+void trace_close();
+bool trace_is_open();
+
+// one executed instruction, call it after the instruction has run so the
+// register changes it made are picked up from the cpu
+void trace_record(uint64_t pc, uint32_t opcode);
+
+// bytes handed to the writer thread so far (record data, excluding headers)
+uint64_t trace_get_bytes_recorded();
+
+struct TraceChange
+{
+    uint8_t index;
+    uint64_t before;
+    uint64_t after;
+};
+
+struct TraceEvent
+{
+    uint64_t pc;
+    uint32_t opcode;
+
+    int num_changes;
+    TraceChange changes[TRACE_NUM_REGISTERS];
+
+    // register state after the instruction
+    const uint64_t* registers;
+};
+
+// decodes a trace file, calling func for each instruction until it returns
+// false. Returns false if the file is missing or malformed.
+bool trace_read(const char* path, const std::function<bool(const TraceEvent&)>& func);
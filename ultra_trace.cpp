@@ -0,0 +1,66 @@
+#include "disassembler.h"
+#include "trace.h"
+
+#include <cstdio>
+#include <cstring>
+
+// Implemented in disassembler.cpp
+const char* parser_get_symbolic_gpr_name(int i);
+
+// Decodes a trace recorded with `ultra --record <file>` (see trace.h) back into
+// the same text cpu_step's logging prints.
+//
+//  ultra-trace <file>            disassembly and register changes
+//  ultra-trace <file> --stats    instruction count only
+int main(int argc, const char** argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: ultra-trace <file> [--stats]\n");
+        return 1;
+    }
+
+    const bool stats_only = argc > 2 && strcmp(argv[2], "--stats") == 0;
+    uint64_t instructions{};
+    uint64_t jumps{};
+    uint64_t last_pc{};
+
+    disassembler_init();
+
+    const bool ok = trace_read(argv[1], [&](const TraceEvent& event)
+    {
+        jumps += instructions && event.pc != last_pc + 4;
+        instructions++;
+        last_pc = event.pc;
+
+        if (stats_only)
+            return true;
+
+        char parse_buffer[256]{};
+        disassembler_parse_instruction(event.opcode, disassembler_decode_instruction(event.opcode), parse_buffer, 0);
+        printf("0x%016llX: %08X: %s\n", (unsigned long long)event.pc, event.opcode, parse_buffer);
+
+        for (int i = 0; i < event.num_changes; i++)
+        {
+            const auto& change = event.changes[i];
+            const auto* name = change.index == TRACE_REGISTER_HI_LO ? "hi_lo" : parser_get_symbolic_gpr_name(change.index);
+
+            printf("\t$%s: 0x%016llX -> 0x%016llX\n", name,
+                (unsigned long long)change.before, (unsigned long long)change.after);
+        }
+
+        if (event.num_changes)
+            printf("\n");
+
+        return true;
+    });
+
+    if (!ok)
+    {
+        printf("ultra-trace: %s is missing or corrupt\n", argv[1]);
+        return 1;
+    }
+
+    printf("%llu instructions, %llu non-sequential\n", (unsigned long long)instructions, (unsigned long long)jumps);
+    return 0;
+}